@@ -0,0 +1,5 @@
+async function user_script(obj) {
+    let array = new Int32Array(obj);
+    let reply = new Int32Array(await host_call("sum", obj));
+    array[2] = reply[0];
+}
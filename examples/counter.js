@@ -0,0 +1,8 @@
+function user_script(obj) {
+    let array = new Int32Array(obj);
+    let stored = kv_get("counter");
+    let counter = stored ? new Int32Array(stored)[0] : 0;
+    counter += array[0];
+    kv_put("counter", new Int32Array([counter]));
+    array[2] = counter;
+}
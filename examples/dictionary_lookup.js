@@ -0,0 +1,5 @@
+function user_script(obj) {
+    let array = new Int32Array(obj);
+    let words = new Uint8Array(dataset("dictionary"));
+    array[2] = words[array[0] % words.length];
+}
@@ -0,0 +1,4 @@
+function user_script(obj) {
+    let array = new Int32Array(obj);
+    array[2] = array[2] * 2;
+}
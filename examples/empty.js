@@ -0,0 +1,2 @@
+function user_script(obj) {
+}
\ No newline at end of file
@@ -0,0 +1,3 @@
+function user_script(doc) {
+    return { id: doc.id, name: doc.name };
+}
@@ -0,0 +1,3 @@
+function user_script(record) {
+    return record;
+}
@@ -1,4 +1,4 @@
 function user_script(obj) {
-    let array = new Int32Array(obj);
-    array[2] = array[0] + array[1];
-}
\ No newline at end of file
+    let sum = new test_sum_t(obj);
+    sum.ans = sum.a + sum.b;
+}
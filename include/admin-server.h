@@ -0,0 +1,202 @@
+#pragma once
+
+#include "storage.h"
+
+#include "seastar/core/smp.hh"
+#include "seastar/http/function_handlers.hh"
+#include "seastar/http/httpd.hh"
+#include "seastar/net/socket_defs.hh"
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+/// HTTP endpoints for inspecting scripts of a storage_t.
+///
+/// GET /profile/cpu?script=<name>&seconds=<n>&interval_us=<n>
+///     samples the script for n seconds and replies with collapsed stacks
+///
+/// GET /trace
+///     replies with the kept invocation traces in the Chrome trace event format
+///
+/// GET /trace/sampling?percent=<n>
+///     traces n percent of the following invocations, 0 disables tracing
+///
+/// GET /capture/start?path=<file>
+///     records the following invocations to the file for v8-with-seastar-replay
+///
+/// GET /capture/stop
+///     finishes the running capture
+///
+/// GET /ready
+///     replies 503 with the scripts being warmed up while there are any
+class admin_server {
+public:
+    /// @param storage_ the storage of the calling shard, requests received on
+    ///                 other shards are forwarded to it
+    admin_server(storage_t& storage_)
+    : storage(storage_),
+      storage_shard(seastar::this_shard_id()) {}
+
+    seastar::future<> start(uint16_t port) {
+        return server.start("admin")
+        .then([this]{
+            return server.set_routes([this](seastar::httpd::routes& r){
+                r.add(seastar::httpd::GET, seastar::httpd::url("/profile/cpu"), new seastar::httpd::function_handler(
+                    [this](std::unique_ptr<seastar::httpd::request> req, std::unique_ptr<seastar::httpd::reply> rep){
+                        return profile_cpu(std::move(req), std::move(rep));
+                    }, "txt"));
+                r.add(seastar::httpd::GET, seastar::httpd::url("/trace"), new seastar::httpd::function_handler(
+                    [this](std::unique_ptr<seastar::httpd::request> req, std::unique_ptr<seastar::httpd::reply> rep){
+                        return trace(std::move(rep));
+                    }, "json"));
+                r.add(seastar::httpd::GET, seastar::httpd::url("/trace/sampling"), new seastar::httpd::function_handler(
+                    [this](std::unique_ptr<seastar::httpd::request> req, std::unique_ptr<seastar::httpd::reply> rep){
+                        return set_trace_sampling(std::move(req), std::move(rep));
+                    }, "txt"));
+                r.add(seastar::httpd::GET, seastar::httpd::url("/capture/start"), new seastar::httpd::function_handler(
+                    [this](std::unique_ptr<seastar::httpd::request> req, std::unique_ptr<seastar::httpd::reply> rep){
+                        return start_capture(std::move(req), std::move(rep));
+                    }, "txt"));
+                r.add(seastar::httpd::GET, seastar::httpd::url("/capture/stop"), new seastar::httpd::function_handler(
+                    [this](std::unique_ptr<seastar::httpd::request> req, std::unique_ptr<seastar::httpd::reply> rep){
+                        return stop_capture(std::move(rep));
+                    }, "txt"));
+                r.add(seastar::httpd::GET, seastar::httpd::url("/ready"), new seastar::httpd::function_handler(
+                    [this](std::unique_ptr<seastar::httpd::request> req, std::unique_ptr<seastar::httpd::reply> rep){
+                        return ready(std::move(rep));
+                    }, "txt"));
+            });
+        })
+        .then([this, port]{
+            return server.listen(seastar::socket_address(seastar::ipv4_addr(port)));
+        });
+    }
+
+    seastar::future<> stop() {
+        return server.stop();
+    }
+
+private:
+    static std::optional<long> parse_param(const seastar::httpd::request& req, const char* name, long default_value) {
+        auto value = req.get_query_param(name);
+        if (value.empty()) {
+            return default_value;
+        }
+        try {
+            return std::stol(value);
+        } catch (...) {
+            return std::nullopt;
+        }
+    }
+
+    seastar::future<std::unique_ptr<seastar::httpd::reply>> profile_cpu(std::unique_ptr<seastar::httpd::request> req, std::unique_ptr<seastar::httpd::reply> rep) {
+        auto script = std::string(req->get_query_param("script"));
+        auto seconds = parse_param(*req, "seconds", 10);
+        auto interval_us = parse_param(*req, "interval_us", 1000);
+        if (script.empty() || !seconds || !interval_us || *seconds <= 0 || *interval_us <= 0) {
+            rep->set_status(seastar::httpd::reply::status_type::bad_request, "script, seconds and interval_us are expected");
+            return seastar::make_ready_future<std::unique_ptr<seastar::httpd::reply>>(std::move(rep));
+        }
+
+        return seastar::smp::submit_to(storage_shard, [this, script, duration = std::chrono::seconds(*seconds), interval = std::chrono::microseconds(*interval_us)]{
+            return storage.profile_cpu(script, duration, interval);
+        })
+        .then([rep = std::move(rep)](std::optional<std::string> profile) mutable {
+            if (!profile) {
+                rep->set_status(seastar::httpd::reply::status_type::not_found, "script is not found or already profiled");
+            } else {
+                rep->_content = seastar::sstring(profile->data(), profile->size());
+            }
+            rep->done("txt");
+            return std::move(rep);
+        });
+    }
+
+    seastar::future<std::unique_ptr<seastar::httpd::reply>> trace(std::unique_ptr<seastar::httpd::reply> rep) {
+        return seastar::smp::submit_to(storage_shard, [this]{
+            return storage.trace_json();
+        })
+        .then([rep = std::move(rep)](std::string json) mutable {
+            rep->_content = seastar::sstring(json.data(), json.size());
+            rep->done("json");
+            return std::move(rep);
+        });
+    }
+
+    seastar::future<std::unique_ptr<seastar::httpd::reply>> set_trace_sampling(std::unique_ptr<seastar::httpd::request> req, std::unique_ptr<seastar::httpd::reply> rep) {
+        auto percent = parse_param(*req, "percent", -1);
+        if (!percent || *percent < 0 || *percent > 100) {
+            rep->set_status(seastar::httpd::reply::status_type::bad_request, "percent from 0 to 100 is expected");
+            return seastar::make_ready_future<std::unique_ptr<seastar::httpd::reply>>(std::move(rep));
+        }
+
+        return seastar::smp::submit_to(storage_shard, [this, rate = *percent / 100.0]{
+            storage.set_trace_sampling_rate(rate);
+        })
+        .then([rep = std::move(rep)]() mutable {
+            rep->done("txt");
+            return std::move(rep);
+        });
+    }
+
+    seastar::future<std::unique_ptr<seastar::httpd::reply>> start_capture(std::unique_ptr<seastar::httpd::request> req, std::unique_ptr<seastar::httpd::reply> rep) {
+        auto path = std::string(req->get_query_param("path"));
+        if (path.empty()) {
+            rep->set_status(seastar::httpd::reply::status_type::bad_request, "path is expected");
+            return seastar::make_ready_future<std::unique_ptr<seastar::httpd::reply>>(std::move(rep));
+        }
+
+        return seastar::smp::submit_to(storage_shard, [this, path]{
+            return storage.start_capture(path).then([]{
+                return true;
+            })
+            .handle_exception([path](std::exception_ptr ex){
+                std::cout << "Can not start capture to " << path << ": " << ex << std::endl;
+                return false;
+            });
+        })
+        .then([rep = std::move(rep)](bool started) mutable {
+            if (!started) {
+                rep->set_status(seastar::httpd::reply::status_type::internal_server_error, "can not open the capture file");
+            }
+            rep->done("txt");
+            return std::move(rep);
+        });
+    }
+
+    seastar::future<std::unique_ptr<seastar::httpd::reply>> stop_capture(std::unique_ptr<seastar::httpd::reply> rep) {
+        return seastar::smp::submit_to(storage_shard, [this]{
+            return storage.stop_capture();
+        })
+        .then([rep = std::move(rep)]() mutable {
+            rep->done("txt");
+            return std::move(rep);
+        });
+    }
+
+    seastar::future<std::unique_ptr<seastar::httpd::reply>> ready(std::unique_ptr<seastar::httpd::reply> rep) {
+        return seastar::smp::submit_to(storage_shard, [this]{
+            return storage.warming_scripts();
+        })
+        .then([rep = std::move(rep)](std::vector<std::string> warming) mutable {
+            if (warming.empty()) {
+                rep->_content = "ready";
+            } else {
+                std::string content = "warming up:";
+                for (const auto& name : warming) {
+                    content += " " + name;
+                }
+                rep->set_status(seastar::httpd::reply::status_type::service_unavailable, seastar::sstring(content.data(), content.size()));
+            }
+            rep->done("txt");
+            return std::move(rep);
+        });
+    }
+
+    storage_t& storage;
+    seastar::shard_id storage_shard;
+    seastar::httpd::http_server_control server;
+};
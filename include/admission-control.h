@@ -0,0 +1,148 @@
+#pragma once
+
+#include "seastar/core/future.hh"
+#include "seastar/core/semaphore.hh"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+/// why admission_controller turned a run away
+enum class rejection_reason : size_t {
+    // max_queue_length runs already wait
+    queue_full,
+    // the run would wait longer than max_queue_time judging by recent runs
+    predicted_timeout,
+    // the run waited max_queue_time without getting a slot
+    queue_timeout,
+    count,
+};
+
+inline const char* rejection_reason_name(rejection_reason reason) {
+    switch (reason) {
+    case rejection_reason::queue_full: return "queue_full";
+    case rejection_reason::predicted_timeout: return "predicted_timeout";
+    case rejection_reason::queue_timeout: return "queue_timeout";
+    case rejection_reason::count: break;
+    }
+    return "unknown";
+}
+
+/// the future of a rejected run fails with it
+class overloaded_error : public std::runtime_error {
+public:
+    overloaded_error(const std::string& script, rejection_reason reason_)
+    : std::runtime_error("script " + script + " is overloaded: " + rejection_reason_name(reason_)),
+      reason(reason_) {}
+
+    const rejection_reason reason;
+};
+
+struct admission_limits {
+    // runs of the script at once, the others wait
+    size_t max_concurrency = 1;
+    // waiting runs, more are rejected at once
+    size_t max_queue_length = 128;
+    // how long a run may wait for its turn
+    std::chrono::milliseconds max_queue_time{100};
+};
+
+struct admission_counters {
+    std::array<uint64_t, static_cast<size_t>(rejection_reason::count)> rejections{};
+    // admitted runs which completed
+    uint64_t admitted = 0;
+
+    admission_counters& operator+=(const admission_counters& other) {
+        for (size_t i = 0; i < rejections.size(); i++) {
+            rejections[i] += other.rejections[i];
+        }
+        admitted += other.admitted;
+        return *this;
+    }
+};
+
+/**
+ * bounds the runs of a script a shard accepts: at most max_concurrency run,
+ * at most max_queue_length wait for them and none waits longer than
+ * max_queue_time. a run which would exceed a limit is rejected with
+ * overloaded_error instead of queueing, so overload shows up as fast
+ * failures rather than unbounded latency and memory.
+ */
+class admission_controller {
+public:
+    using clock_type = seastar::semaphore::clock;
+
+    /// @throws std::invalid_argument if the limits admit no run
+    explicit admission_controller(std::string script_, admission_limits limits_)
+    : script(std::move(script_)), limits(checked(limits_)), slots(limits.max_concurrency) {}
+
+    /// a slot held until the units are destroyed
+    seastar::future<seastar::semaphore_units<>> admit() {
+        if (slots.available_units() <= 0) {
+            if (slots.waiters() >= limits.max_queue_length) {
+                return reject(rejection_reason::queue_full);
+            }
+            // every max_concurrency runs ahead of this one take a service time
+            auto rounds = slots.waiters() / limits.max_concurrency + 1;
+            if (service_time_ewma * rounds > limits.max_queue_time) {
+                return reject(rejection_reason::predicted_timeout);
+            }
+        }
+
+        return seastar::get_units(slots, 1, clock_type::now() + limits.max_queue_time)
+        .handle_exception_type([this](const seastar::semaphore_timed_out&){
+            return reject(rejection_reason::queue_timeout);
+        });
+    }
+
+    /// runs which got a slot keep it, waiting ones keep their deadline.
+    /// invalid limits throw std::invalid_argument and leave the current ones.
+    void set_limits(admission_limits limits_) {
+        checked(limits_);
+        if (limits_.max_concurrency > limits.max_concurrency) {
+            slots.signal(limits_.max_concurrency - limits.max_concurrency);
+        } else {
+            slots.consume(limits.max_concurrency - limits_.max_concurrency);
+        }
+        limits = limits_;
+    }
+
+    /// feeds the prediction of queue times, call it when an admitted run completes
+    void completed(std::chrono::steady_clock::duration service_time) {
+        // an exponentially weighted moving average over the last ~8 runs
+        service_time_ewma += (service_time - service_time_ewma) / 8;
+        stats.admitted++;
+    }
+
+    const admission_counters& counters() const {
+        return stats;
+    }
+
+    size_t queue_length() const {
+        return slots.waiters();
+    }
+
+private:
+    static const admission_limits& checked(const admission_limits& limits) {
+        if (limits.max_concurrency == 0) {
+            throw std::invalid_argument("admission limits need a max_concurrency of at least 1");
+        }
+        if (limits.max_queue_time.count() < 0) {
+            throw std::invalid_argument("admission limits need a non-negative max_queue_time");
+        }
+        return limits;
+    }
+
+    seastar::future<seastar::semaphore_units<>> reject(rejection_reason reason) {
+        stats.rejections[static_cast<size_t>(reason)]++;
+        return seastar::make_exception_future<seastar::semaphore_units<>>(overloaded_error(script, reason));
+    }
+
+    const std::string script;
+    admission_limits limits;
+    seastar::semaphore slots;
+    std::chrono::steady_clock::duration service_time_ewma{};
+    admission_counters stats;
+};
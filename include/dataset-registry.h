@@ -0,0 +1,152 @@
+#pragma once
+
+#include "v8.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * one version of a dataset: a file, or a copy of it in memory, which every
+ * isolate maps privately. the pages are shared between the isolates until
+ * one writes to them, the writer gets its own copy of a page, so a script
+ * can not change what the others see.
+ */
+class dataset_version {
+public:
+    dataset_version(int fd_, size_t size_)
+    : fd(fd_), size(size_) {}
+
+    ~dataset_version() {
+        ::close(fd);
+    }
+
+    dataset_version(const dataset_version&) = delete;
+    dataset_version& operator=(const dataset_version&) = delete;
+
+    /// a copy-on-write mapping for one isolate
+    std::shared_ptr<v8::BackingStore> map() const {
+        void* data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            throw std::system_error(errno, std::system_category(), "can not map dataset");
+        }
+        return v8::SharedArrayBuffer::NewBackingStore(data, size, [](void* data, size_t size, void*){
+            ::munmap(data, size);
+        }, nullptr);
+    }
+
+    size_t byte_length() const {
+        return size;
+    }
+
+private:
+    const int fd;
+    const size_t size;
+};
+
+/**
+ * process-wide datasets shared by the isolates of every shard. an isolate
+ * gets a dataset as a SharedArrayBuffer via dataset(name), mapped from the
+ * dataset's version, see dataset_version, so its memory exists once however
+ * many isolates read it and a script writing to it only changes its copy.
+ *
+ * publishing a dataset under an existing name swaps it: later dataset(name)
+ * calls see the new version, and the old one is released once the last
+ * isolate mapping it drops it.
+ */
+class dataset_registry {
+public:
+    static dataset_registry& instance() {
+        static dataset_registry registry;
+        return registry;
+    }
+
+    /**
+     * opens the file at @c path. blocks, call it from a worker thread.
+     *
+     * @param use_mmap map the file itself, so pages are read on first access
+     *                 and shared with the page cache. otherwise the file is
+     *                 copied into memory first.
+     */
+    static std::shared_ptr<dataset_version> load_file(const std::string& path, bool use_mmap) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::system_error(errno, std::system_category(), "can not open " + path);
+        }
+        std::unique_ptr<int, void(*)(int*)> fd_guard(&fd, [](int* fd){ ::close(*fd); });
+
+        struct stat st;
+        if (::fstat(fd, &st) < 0) {
+            throw std::system_error(errno, std::system_category(), "can not stat " + path);
+        }
+        size_t size = st.st_size;
+        if (size == 0) {
+            throw std::runtime_error("dataset " + path + " is empty");
+        }
+        if (use_mmap) {
+            fd_guard.release();
+            return std::make_shared<dataset_version>(fd, size);
+        }
+
+        int copy_fd = ::memfd_create("dataset", MFD_CLOEXEC);
+        if (copy_fd < 0) {
+            throw std::system_error(errno, std::system_category(), "can not allocate dataset " + path);
+        }
+        auto copy = std::make_shared<dataset_version>(copy_fd, size);
+        if (::ftruncate(copy_fd, size) < 0) {
+            throw std::system_error(errno, std::system_category(), "can not allocate dataset " + path);
+        }
+        for (size_t offset = 0; offset < size;) {
+            auto n = ::copy_file_range(fd, nullptr, copy_fd, nullptr, size - offset, 0);
+            if (n <= 0) {
+                throw std::system_error(n < 0 ? errno : EIO, std::system_category(), "can not read " + path);
+            }
+            offset += n;
+        }
+        return copy;
+    }
+
+    /// makes @c version the current version of the dataset @c name
+    void publish(const std::string& name, std::shared_ptr<dataset_version> version) {
+        std::lock_guard lock{mutex};
+        datasets.insert_or_assign(name, std::move(version));
+    }
+
+    bool remove(const std::string& name) {
+        std::lock_guard lock{mutex};
+        return datasets.erase(name) > 0;
+    }
+
+    /// drops every dataset, called before V8 is disposed
+    void clear() {
+        std::lock_guard lock{mutex};
+        datasets.clear();
+    }
+
+    std::shared_ptr<dataset_version> get(const std::string& name) {
+        std::lock_guard lock{mutex};
+        auto it = datasets.find(name);
+        return it == datasets.end() ? nullptr : it->second;
+    }
+
+    /// bytes of the current versions, swapped out versions still in use are not counted
+    size_t memory_usage() {
+        std::lock_guard lock{mutex};
+        size_t total = 0;
+        for (const auto& [name, version] : datasets) {
+            total += version->byte_length();
+        }
+        return total;
+    }
+
+private:
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<dataset_version>> datasets;
+};
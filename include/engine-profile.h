@@ -0,0 +1,101 @@
+#pragma once
+
+#include "v8.h"
+
+#include <memory>
+#include <string>
+
+/**
+ * how V8 runs the scripts of an instance. the heap limits and heuristics are
+ * set per isolate. V8's flags, e.g. the wasm tiers, the stack size or
+ * --jitless, are process wide and fixed once V8 is initialized, so they form
+ * the profile's process configuration: a profile can only be used in a
+ * process initialized with the same flags, see storage_t::init_v8.
+ */
+struct engine_profile {
+    // for v8::V8::SetFlagsFromString, space separated
+    std::string process_flags;
+    // heap limits of the isolate, 0 keeps V8's defaults
+    size_t max_old_generation_bytes = 0;
+    size_t max_young_generation_bytes = 0;
+    size_t initial_old_generation_bytes = 0;
+    // V8's heuristics favor memory over speed, as for an isolate in the background
+    bool optimize_for_memory = false;
+    // compiles every function of the script upfront instead of on its first call
+    bool eager_compile = false;
+
+    bool is_compatible(const std::string& flags) const {
+        return process_flags == flags;
+    }
+
+    v8::Isolate::CreateParams create_params() const {
+        v8::Isolate::CreateParams params;
+        params.array_buffer_allocator_shared = std::shared_ptr<v8::ArrayBuffer::Allocator>(v8::ArrayBuffer::Allocator::NewDefaultAllocator());
+        if (max_old_generation_bytes) {
+            params.constraints.set_max_old_generation_size_in_bytes(max_old_generation_bytes);
+        }
+        if (max_young_generation_bytes) {
+            params.constraints.set_max_young_generation_size_in_bytes(max_young_generation_bytes);
+        }
+        if (initial_old_generation_bytes) {
+            params.constraints.set_initial_old_generation_size_in_bytes(initial_old_generation_bytes);
+        }
+        return params;
+    }
+
+    /// the caller holds the isolate's Locker
+    void apply(v8::Isolate* isolate) const {
+        if (optimize_for_memory) {
+            isolate->IsolateInBackgroundNotification();
+        }
+    }
+
+    v8::ScriptCompiler::CompileOptions compile_options() const {
+        return eager_compile ? v8::ScriptCompiler::kEagerCompile : v8::ScriptCompiler::kNoCompileOptions;
+    }
+};
+
+/// profiles for the usual kinds of scripts, in the default process configuration
+namespace engine_profiles {
+
+inline engine_profile balanced() {
+    return engine_profile{};
+}
+
+/// rarely called scripts: a small heap which V8 keeps small. a run
+/// outgrowing it is canceled
+inline engine_profile cold() {
+    engine_profile profile;
+    profile.max_old_generation_bytes = 64 << 20;
+    profile.max_young_generation_bytes = 1 << 20;
+    profile.optimize_for_memory = true;
+    return profile;
+}
+
+/// hot scripts: compiled upfront, with a young generation large enough for
+/// their garbage to rarely trigger a scavenge
+inline engine_profile hot() {
+    engine_profile profile;
+    profile.max_young_generation_bytes = 32 << 20;
+    profile.initial_old_generation_bytes = 32 << 20;
+    profile.eager_compile = true;
+    return profile;
+}
+
+/// a process of scripts which only run a few times each: no JIT, so no
+/// machine code in memory. wasm is unavailable then.
+inline engine_profile jitless() {
+    engine_profile profile = cold();
+    profile.process_flags = "--jitless";
+    return profile;
+}
+
+/// a process of long running wasm scripts: wasm is compiled by TurboFan
+/// only, starting slower but skipping the baseline tier and its code
+inline engine_profile wasm_optimized() {
+    engine_profile profile = hot();
+    profile.process_flags = "--no-liftoff";
+    return profile;
+}
+
+} // namespace engine_profiles
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "seastar/core/future.hh"
+#include "seastar/core/temporary_buffer.hh"
+#include "storage.h"
+#include "struct-binding.h"
+
+#include <algorithm>
+#include <cstring>
+
+/**
+ * what the scripts of examples/ expect from the storage besides their own
+ * source: the test_sum_t binding and the host functions. the server, the
+ * replay tool and the benchmarks register the same, so a captured run
+ * behaves the same when replayed.
+ */
+
+struct test_sum_t {
+    int a;
+    int b;
+
+    int ans;
+};
+
+constexpr auto test_sum_binding = make_struct_binding<test_sum_t>("test_sum_t",
+    STRUCT_BINDING_FIELD(test_sum_t, a),
+    STRUCT_BINDING_FIELD(test_sum_t, b),
+    STRUCT_BINDING_FIELD(test_sum_t, ans));
+
+// host function of examples/async_sum.js
+inline seastar::future<seastar::temporary_buffer<char>> host_sum(seastar::temporary_buffer<char> data) {
+    test_sum_t obj{};
+    std::memcpy(&obj, data.get(), std::min(data.size(), sizeof(test_sum_t)));
+    seastar::temporary_buffer<char> result(sizeof(int));
+    int ans = obj.a + obj.b;
+    std::memcpy(result.get_write(), &ans, sizeof(int));
+    return seastar::make_ready_future<seastar::temporary_buffer<char>>(std::move(result));
+}
+
+/// call it before the scripts are added, they are compiled after the prelude
+inline void register_example_prelude(storage_t& storage) {
+    storage.add_struct_binding(test_sum_binding);
+    storage.register_host_function("sum", host_sum);
+}
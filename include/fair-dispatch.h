@@ -0,0 +1,210 @@
+#pragma once
+
+#include "seastar/core/future.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * divides the worker time a shard gets from the pool between tenants by
+ * their shares, after the ideas of seastar::fair_queue: every tenant
+ * accumulates the worker time of its runs divided by its shares, and the
+ * next free slot goes to the waiting tenant which accumulated the least. a
+ * tenant flooding the shard only competes for its share, the runs of the
+ * others do not wait behind its backlog.
+ *
+ * the cost of a run is not known before it completes, so a tenant is charged
+ * the average of its recent runs at dispatch and the difference at
+ * completion. a tenant returning from idle starts from the least accumulated
+ * cost of the busy ones, it can not save up worker time.
+ *
+ * a tenant may be several scripts and have a run of each in flight, but
+ * runs with the same key, the script, are dispatched one at a time: they are
+ * serialized by its instance anyway, a second one would only hold a slot
+ * while waiting for the first.
+ *
+ * with fairness disabled the slots go to the runs in the order they arrived,
+ * whatever their tenants used.
+ */
+class fair_dispatcher {
+public:
+    using clock_type = std::chrono::steady_clock;
+
+    static constexpr uint32_t default_shares = 100;
+
+    /// @param concurrency_ runs dispatched at once, the pool's slots of the shard
+    explicit fair_dispatcher(size_t concurrency_ = 1)
+    : concurrency(std::max<size_t>(concurrency_, 1)) {}
+
+    void set_concurrency(size_t concurrency_) {
+        concurrency = std::max<size_t>(concurrency_, 1);
+        dispatch_next();
+    }
+
+    void set_shares(const std::string& tenant, uint32_t shares) {
+        tenant_of(tenant).shares = std::max<uint32_t>(shares, 1);
+    }
+
+    /// dispatches runs in arrival order if @c fair is false
+    void set_fair(bool fair_) {
+        fair = fair_;
+        dispatch_next();
+    }
+
+    /// forgets @c tenant and its shares, once its runs completed
+    void remove_tenant(const std::string& tenant_name) {
+        auto it = tenants.find(tenant_name);
+        if (it == tenants.end()) {
+            return;
+        }
+        auto& tenant = it->second;
+        if (tenant.waiting.empty() && tenant.in_flight == 0) {
+            tenants.erase(it);
+            return;
+        }
+        tenant.removed = true;
+    }
+
+    /**
+     * runs @c func, which returns a future, once @c tenant gets a slot and
+     * no other run with @c key is in flight
+     */
+    template <typename Func>
+    auto dispatch(const std::string& tenant_name, const std::string& key, Func&& func) {
+        auto& tenant = tenant_of(tenant_name);
+        tenant.removed = false;
+        if (tenant.waiting.empty() && tenant.in_flight == 0) {
+            // back from idle
+            tenant.vtime = std::max(tenant.vtime, global_vtime);
+            active.push_back(&tenant);
+        }
+        auto& waiter = tenant.waiting.emplace_back(key, next_sequence++);
+        auto ready = waiter.ready.get_future();
+        queued++;
+        dispatch_next();
+
+        return ready.then([this, &tenant, key, func = std::forward<Func>(func)](double charged) mutable {
+            auto start = clock_type::now();
+            return seastar::futurize_invoke(func).finally([this, &tenant, key = std::move(key), charged, start]{
+                complete(tenant, key, charged, clock_type::now() - start);
+            });
+        });
+    }
+
+    /// runs waiting for a slot
+    size_t queue_length() const {
+        return queued;
+    }
+
+    uint64_t dispatched(const std::string& tenant) const {
+        auto it = tenants.find(tenant);
+        return it == tenants.end() ? 0 : it->second.dispatched;
+    }
+
+private:
+    struct waiter_t {
+        waiter_t(const std::string& key_, uint64_t sequence_)
+        : key(key_), sequence(sequence_) {}
+
+        std::string key;
+        uint64_t sequence;
+        // set to what the run was charged at dispatch
+        seastar::promise<double> ready;
+    };
+
+    struct tenant_t {
+        uint32_t shares = default_shares;
+        // worker time used, in nanoseconds per share
+        double vtime = 0;
+        // the average worker time of the tenant's recent runs
+        double cost_estimate_ns = 0;
+        std::deque<waiter_t> waiting;
+        size_t in_flight = 0;
+        uint64_t dispatched = 0;
+        // erased once idle, see remove_tenant
+        bool removed = false;
+    };
+
+    tenant_t& tenant_of(const std::string& name) {
+        // node based, so references to tenants stay valid
+        return tenants[name];
+    }
+
+    // the first run of the tenant whose key has no run in flight
+    std::deque<waiter_t>::iterator first_ready(tenant_t& tenant) {
+        return std::find_if(tenant.waiting.begin(), tenant.waiting.end(), [this](const waiter_t& waiter){
+            return !busy_keys.contains(waiter.key);
+        });
+    }
+
+    void dispatch_next() {
+        while (in_flight < concurrency) {
+            tenant_t* next = nullptr;
+            std::deque<waiter_t>::iterator next_waiter;
+            for (auto* tenant : active) {
+                if (tenant->waiting.empty() || (next && fair && tenant->vtime >= next->vtime)) {
+                    continue;
+                }
+                auto waiter = first_ready(*tenant);
+                if (waiter != tenant->waiting.end() && (!next || fair || waiter->sequence < next_waiter->sequence)) {
+                    next = tenant;
+                    next_waiter = waiter;
+                }
+            }
+            if (!next) {
+                return;
+            }
+
+            global_vtime = std::max(global_vtime, next->vtime);
+            double charged = next->cost_estimate_ns / next->shares;
+            next->vtime += charged;
+            next->in_flight++;
+            next->dispatched++;
+            in_flight++;
+            queued--;
+
+            busy_keys.insert(next_waiter->key);
+            auto ready = std::move(next_waiter->ready);
+            next->waiting.erase(next_waiter);
+            ready.set_value(charged);
+        }
+    }
+
+    void complete(tenant_t& tenant, const std::string& key, double charged, clock_type::duration elapsed) {
+        double cost_ns = std::chrono::duration<double, std::nano>(elapsed).count();
+        tenant.vtime += cost_ns / tenant.shares - charged;
+        // an exponentially weighted moving average over the last ~8 runs
+        tenant.cost_estimate_ns += (cost_ns - tenant.cost_estimate_ns) / 8;
+        tenant.in_flight--;
+        in_flight--;
+        busy_keys.erase(key);
+        if (tenant.waiting.empty() && tenant.in_flight == 0) {
+            std::erase(active, &tenant);
+            if (tenant.removed) {
+                std::erase_if(tenants, [&tenant](const auto& entry){
+                    return &entry.second == &tenant;
+                });
+            }
+        }
+        dispatch_next();
+    }
+
+    size_t concurrency;
+    size_t in_flight = 0;
+    size_t queued = 0;
+    bool fair = true;
+    uint64_t next_sequence = 0;
+    // vtime of the last dispatched tenant, the least of the waiting ones then
+    double global_vtime = 0;
+    std::unordered_map<std::string, tenant_t> tenants;
+    // tenants with waiting or running runs
+    std::vector<tenant_t*> active;
+    // keys of the runs in flight
+    std::unordered_set<std::string> busy_keys;
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "native_thread_pool.h"
+
+#include "seastar/core/iostream.hh"
+#include "seastar/core/loop.hh"
+#include "seastar/core/temporary_buffer.hh"
+#include "v8-profiler.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/// v8::OutputStream which hands heap snapshot chunks serialized on a worker
+/// thread to a seastar output_stream on the reactor. the worker blocks once
+/// @c max_pending_chunks are not written yet, so a snapshot never has to fit
+/// in memory.
+class heap_snapshot_stream final : public v8::OutputStream {
+public:
+    explicit heap_snapshot_stream(size_t max_pending_chunks_ = 16)
+    : max_pending_chunks(max_pending_chunks_) {}
+
+    int GetChunkSize() override {
+        return 64 * 1024;
+    }
+
+    WriteResult WriteAsciiChunk(char* data, int size) override {
+        {
+            std::unique_lock lock{mutex};
+            writer_cond.wait(lock, [this]{
+                return chunks.size() < max_pending_chunks || aborted;
+            });
+            if (aborted) {
+                return kAbort;
+            }
+            chunks.emplace_back(data, size);
+        }
+        on_chunk.notify();
+        return kContinue;
+    }
+
+    void EndOfStream() override {
+        close();
+    }
+
+    /// called by the worker after serialization, also when it failed
+    void close() {
+        {
+            std::lock_guard lock{mutex};
+            if (closed) {
+                return;
+            }
+            closed = true;
+        }
+        on_chunk.notify();
+    }
+
+    /// writes chunks to @c out until the worker closes the stream
+    seastar::future<> write_to(seastar::output_stream<char>& out) {
+        return seastar::repeat([this, &out]{
+            return on_chunk.wait()
+            .then([this, &out]{
+                std::deque<seastar::temporary_buffer<char>> ready;
+                bool last = false;
+                {
+                    std::lock_guard lock{mutex};
+                    ready.swap(chunks);
+                    last = closed;
+                }
+                writer_cond.notify_one();
+
+                return seastar::do_with(std::move(ready), [&out](auto& ready){
+                    return seastar::do_for_each(ready, [&out](auto& chunk){
+                        return out.write(std::move(chunk));
+                    });
+                })
+                .then([last]{
+                    return last ? seastar::stop_iteration::yes : seastar::stop_iteration::no;
+                });
+            });
+        })
+        .handle_exception([this](std::exception_ptr ex){
+            abort();
+            return seastar::make_exception_future<>(ex);
+        });
+    }
+
+private:
+    void abort() {
+        {
+            std::lock_guard lock{mutex};
+            aborted = true;
+        }
+        writer_cond.notify_one();
+    }
+
+    const size_t max_pending_chunks;
+    std::mutex mutex;
+    std::condition_variable writer_cond;
+    std::deque<seastar::temporary_buffer<char>> chunks;
+    bool closed = false;
+    bool aborted = false;
+    v::Condition on_chunk;
+};
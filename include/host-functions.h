@@ -0,0 +1,26 @@
+#pragma once
+
+#include "kv-store.h"
+
+#include "seastar/core/future.hh"
+#include "seastar/core/temporary_buffer.hh"
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+/// operation a script starts with host_call(name, data). it runs on the
+/// reactor, the promise returned to the script is resolved with its result as
+/// an ArrayBuffer, or rejected if the future fails.
+using host_function_t = std::function<seastar::future<seastar::temporary_buffer<char>>(seastar::temporary_buffer<char>)>;
+
+using host_functions_t = std::unordered_map<std::string, host_function_t>;
+
+/// what storage_t provides to the scripts of its instances
+struct host_environment {
+    host_functions_t host_functions;
+    // the shard's state behind kv_get and kv_put
+    kv_store kv;
+    // compiled into every context before its script, see add_struct_binding
+    std::string script_prelude;
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "native_thread_pool.h"
+#include "v8-instance.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+struct idle_gc_policy {
+    // time a worker donates to garbage collection every time it finds no tasks
+    std::chrono::milliseconds idle_time_budget{5};
+    // share of free seastar memory below which isolates get LowMemoryNotification
+    double low_memory_threshold = 0.1;
+    std::chrono::milliseconds memory_check_period{1000};
+};
+
+/// runs garbage collection of registered isolates on idle pool workers, so it
+/// does not happen in the middle of script invocations
+class idle_gc_t : public v::IdleWork {
+public:
+    void add_instance(v8_instance* instance) {
+        std::lock_guard lock{mtx};
+        instances.push_back(instance);
+    }
+
+    /// waits for a running idle notification of @c instance to finish
+    void remove_instance(v8_instance* instance) {
+        std::lock_guard lock{mtx};
+        std::erase(instances, instance);
+    }
+
+    void notify_low_memory() {
+        std::lock_guard lock{mtx};
+        for (auto* instance : instances) {
+            instance->request_low_memory_notification();
+        }
+    }
+
+    void on_idle(std::chrono::steady_clock::time_point deadline) override {
+        std::lock_guard lock{mtx};
+        for (size_t i = 0; i < instances.size() && std::chrono::steady_clock::now() < deadline; ++i) {
+            // round robin, so every isolate gets its share of idle time
+            next_instance = (next_instance + 1) % instances.size();
+            instances[next_instance]->idle_notification(deadline);
+        }
+    }
+
+private:
+    std::mutex mtx;
+    std::vector<v8_instance*> instances;
+    size_t next_instance = 0;
+};
@@ -0,0 +1,207 @@
+#pragma once
+
+#include "seastar/core/file.hh"
+#include "seastar/core/fstream.hh"
+#include "seastar/core/iostream.hh"
+#include "seastar/core/seastar.hh"
+#include "seastar/core/temporary_buffer.hh"
+#include "seastar/util/log.hh"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+/**
+ * file of recorded invocations, replayed by the v8-with-seastar-replay tool.
+ * the file starts with capture_magic, followed by a record per invocation:
+ *
+ *     u64 arrival, nanoseconds since the capture started
+ *     u32 size of the script name
+ *     u32 size of the input
+ *     the script name
+ *     the input bytes, as they were before the script ran
+ *
+ * all integers are little-endian.
+ */
+inline constexpr std::string_view capture_magic = "V8SCAP01";
+
+struct captured_invocation {
+    std::chrono::nanoseconds arrival;
+    std::string script;
+    seastar::temporary_buffer<char> input;
+};
+
+namespace capture_detail {
+
+inline constexpr size_t header_size = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+
+inline void put_le(char* out, uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        out[i] = char((value >> (8 * i)) & 0xff);
+    }
+}
+
+inline uint64_t get_le(const char* in, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+        value |= uint64_t(static_cast<unsigned char>(in[i])) << (8 * i);
+    }
+    return value;
+}
+
+} // namespace capture_detail
+
+/**
+ * appends the invocations of a storage_t to a capture file without waiting
+ * for the disk. records are written in the background, when more than
+ * @c max_buffered_bytes wait for the disk new records are dropped and counted,
+ * as are records whose write failed.
+ */
+class invocation_recorder {
+public:
+    static seastar::future<std::unique_ptr<invocation_recorder>> open(std::string path, size_t max_buffered_bytes = 64 << 20) {
+        auto flags = seastar::open_flags::wo | seastar::open_flags::create | seastar::open_flags::truncate;
+        return seastar::open_file_dma(path, flags)
+        .then([](seastar::file f){
+            return seastar::make_file_output_stream(std::move(f));
+        })
+        .then([max_buffered_bytes](seastar::output_stream<char> out){
+            auto recorder = std::unique_ptr<invocation_recorder>(new invocation_recorder(std::move(out), max_buffered_bytes));
+            return recorder->out.write(capture_magic.data(), capture_magic.size())
+            .then([recorder = std::move(recorder)]() mutable {
+                return std::move(recorder);
+            });
+        });
+    }
+
+    /// copies @c input, call it before the script changes the bytes
+    void record(std::string_view script, std::span<const char> input) {
+        using namespace capture_detail;
+
+        size_t size = header_size + script.size() + input.size();
+        if (buffered_bytes + size > max_buffered_bytes) {
+            dropped_records++;
+            return;
+        }
+
+        seastar::temporary_buffer<char> record(size);
+        auto arrival = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        put_le(record.get_write(), arrival.count(), sizeof(uint64_t));
+        put_le(record.get_write() + sizeof(uint64_t), script.size(), sizeof(uint32_t));
+        put_le(record.get_write() + sizeof(uint64_t) + sizeof(uint32_t), input.size(), sizeof(uint32_t));
+        std::memcpy(record.get_write() + header_size, script.data(), script.size());
+        std::memcpy(record.get_write() + header_size + script.size(), input.data(), input.size());
+
+        buffered_bytes += size;
+        recorded_records++;
+        // a failed write drops its record, the following ones are still tried
+        written = written.then([this, record = std::move(record)]() mutable {
+            return out.write(std::move(record));
+        })
+        .handle_exception([this](std::exception_ptr ex){
+            if (!write_failed) {
+                std::cout << "Can not write capture: " << ex << std::endl;
+                write_failed = true;
+            }
+            recorded_records--;
+            dropped_records++;
+        })
+        .finally([this, size]{
+            buffered_bytes -= size;
+        });
+    }
+
+    /// writes the buffered records and closes the file
+    seastar::future<> close() {
+        return std::exchange(written, seastar::make_ready_future<>())
+        .handle_exception([](std::exception_ptr ex){
+            std::cout << "Can not write capture: " << ex << std::endl;
+        })
+        .finally([this]{
+            return out.close();
+        });
+    }
+
+    uint64_t recorded() const {
+        return recorded_records;
+    }
+
+    uint64_t dropped() const {
+        return dropped_records;
+    }
+
+private:
+    invocation_recorder(seastar::output_stream<char> out_, size_t max_buffered_bytes_)
+    : out(std::move(out_)), max_buffered_bytes(max_buffered_bytes_) {}
+
+    seastar::output_stream<char> out;
+    const size_t max_buffered_bytes;
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    seastar::future<> written = seastar::make_ready_future<>();
+    size_t buffered_bytes = 0;
+    uint64_t recorded_records = 0;
+    uint64_t dropped_records = 0;
+    // only the first failed write is logged
+    bool write_failed = false;
+};
+
+/// reads the records of a capture file in order
+class capture_reader {
+public:
+    explicit capture_reader(seastar::input_stream<char>& in_)
+    : in(in_) {}
+
+    /// the next record, or nothing at the end of the file
+    seastar::future<std::optional<captured_invocation>> next() {
+        using namespace capture_detail;
+        using record_t = std::optional<captured_invocation>;
+
+        return check_magic().then([this]{
+            return in.read_exactly(header_size);
+        })
+        .then([this](seastar::temporary_buffer<char> header){
+            if (header.empty()) {
+                return seastar::make_ready_future<record_t>();
+            }
+            if (header.size() < header_size) {
+                return seastar::make_exception_future<record_t>(std::runtime_error("truncated capture record header"));
+            }
+
+            auto arrival = std::chrono::nanoseconds(get_le(header.get(), sizeof(uint64_t)));
+            size_t script_size = get_le(header.get() + sizeof(uint64_t), sizeof(uint32_t));
+            size_t input_size = get_le(header.get() + sizeof(uint64_t) + sizeof(uint32_t), sizeof(uint32_t));
+            return in.read_exactly(script_size + input_size).then([arrival, script_size, input_size](seastar::temporary_buffer<char> body){
+                if (body.size() < script_size + input_size) {
+                    return seastar::make_exception_future<record_t>(std::runtime_error("truncated capture record"));
+                }
+                std::string script(body.get(), script_size);
+                body.trim_front(script_size);
+                return seastar::make_ready_future<record_t>(captured_invocation{arrival, std::move(script), std::move(body)});
+            });
+        });
+    }
+
+private:
+    seastar::future<> check_magic() {
+        if (magic_checked) {
+            return seastar::make_ready_future<>();
+        }
+        return in.read_exactly(capture_magic.size()).then([this](seastar::temporary_buffer<char> magic){
+            if (std::string_view(magic.get(), magic.size()) != capture_magic) {
+                return seastar::make_exception_future<>(std::runtime_error("not a capture file"));
+            }
+            magic_checked = true;
+            return seastar::make_ready_future<>();
+        });
+    }
+
+    seastar::input_stream<char>& in;
+    bool magic_checked = false;
+};
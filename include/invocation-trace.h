@@ -0,0 +1,154 @@
+#pragma once
+
+#include <fmt/format.h>
+
+#include <array>
+#include <chrono>
+#include <deque>
+#include <string>
+
+#include <unistd.h>
+
+/// timestamps of the stages of one invocation, taken on the reactor and on
+/// the worker which ran it. stages an invocation skipped stay unset.
+struct invocation_trace {
+    using clock_type = std::chrono::steady_clock;
+
+    enum stage : size_t {
+        // storage_t received the call
+        arrived,
+        // the invocation holds v8_instance::mtx
+        instance_locked,
+        // the isolate exists, see ensure_materialized
+        ready,
+        // the task passed the pool's add_task_sem
+        pool_admitted,
+        // the task got one of the shard's free_slots and is queued
+        slot_acquired,
+        worker_started,
+        js_started,
+        js_finished,
+        worker_finished,
+        // the reactor got the result
+        completed,
+        n_stages,
+    };
+
+    void mark(stage s) {
+        stages[s] = clock_type::now();
+        if (s == worker_started) {
+            worker_tid = ::gettid();
+        }
+    }
+
+    std::array<clock_type::time_point, n_stages> stages{};
+    pid_t worker_tid = 0;
+};
+
+inline void trace_mark(invocation_trace* trace, invocation_trace::stage s) {
+    if (trace) {
+        trace->mark(s);
+    }
+}
+
+/// the last traced invocations of a shard, exported in the Chrome trace event
+/// format which chrome://tracing and Perfetto open
+class trace_ring {
+public:
+    explicit trace_ring(size_t capacity_ = 4096)
+    : capacity(capacity_) {}
+
+    /// @param rate share of invocations to trace, 0 disables tracing
+    void set_sampling_rate(double rate) {
+        sampling_rate = rate;
+        sampling_credit = 0;
+    }
+
+    bool should_sample() {
+        if (sampling_rate <= 0) {
+            return false;
+        }
+        sampling_credit += sampling_rate;
+        if (sampling_credit < 1) {
+            return false;
+        }
+        sampling_credit -= 1;
+        return true;
+    }
+
+    void push(std::string script, const invocation_trace& trace) {
+        if (traces.size() == capacity) {
+            traces.pop_front();
+        }
+        traces.push_back(traced_invocation{std::move(script), trace});
+    }
+
+    /// spans of every traced invocation. reactor side spans are on the
+    /// shard's track, worker side ones on the worker thread's track.
+    std::string chrome_trace_json(unsigned shard) const {
+        using stage = invocation_trace::stage;
+        struct span_t {
+            const char* name;
+            stage from;
+            stage to;
+            bool on_worker;
+        };
+        static constexpr std::array<span_t, 8> spans = {{
+            {"invocation", stage::arrived, stage::completed, false},
+            {"wait_instance", stage::arrived, stage::instance_locked, false},
+            {"materialize", stage::instance_locked, stage::ready, false},
+            {"wait_pool_admission", stage::ready, stage::pool_admitted, false},
+            {"wait_free_slot", stage::pool_admitted, stage::slot_acquired, false},
+            {"wait_worker", stage::slot_acquired, stage::worker_started, false},
+            {"worker_task", stage::worker_started, stage::worker_finished, true},
+            {"js", stage::js_started, stage::js_finished, true},
+        }};
+
+        std::string json = "{\"traceEvents\":[";
+        bool first = true;
+        for (const auto& traced : traces) {
+            auto script = escape(traced.script);
+            for (const auto& span : spans) {
+                auto from = traced.trace.stages[span.from];
+                auto to = traced.trace.stages[span.to];
+                if (from == invocation_trace::clock_type::time_point{} || to == invocation_trace::clock_type::time_point{}) {
+                    continue;
+                }
+                auto tid = span.on_worker ? traced.trace.worker_tid : static_cast<pid_t>(shard);
+                json += fmt::format("{}{{\"name\":\"{}\",\"cat\":\"invocation\",\"ph\":\"X\",\"ts\":{:.3f},\"dur\":{:.3f},\"pid\":{},\"tid\":{},\"args\":{{\"script\":\"{}\"}}}}",
+                    first ? "" : ",", span.name, to_us(from.time_since_epoch()), to_us(to - from), shard, tid, script);
+                first = false;
+            }
+        }
+        json += "],\"displayTimeUnit\":\"ns\"}";
+        return json;
+    }
+
+private:
+    struct traced_invocation {
+        std::string script;
+        invocation_trace trace;
+    };
+
+    static double to_us(invocation_trace::clock_type::duration d) {
+        return std::chrono::duration<double, std::micro>(d).count();
+    }
+
+    static std::string escape(const std::string& value) {
+        std::string escaped;
+        for (char c : value) {
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+            }
+            if (static_cast<unsigned char>(c) >= 0x20) {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    const size_t capacity;
+    double sampling_rate = 0;
+    double sampling_credit = 0;
+    std::deque<traced_invocation> traces;
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <cstring>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/// how run_json hands a JSON document to the script
+enum class json_parsing {
+    // the whole document is parsed by v8::JSON::Parse before the call
+    eager,
+    // fields of the top-level object are parsed when the script reads them,
+    // see json_index
+    lazy,
+};
+
+/**
+ * structural index of a JSON document's top-level object: the raw bytes of
+ * every field's value, found by a single pass over the document which checks
+ * brackets and strings but not the values themselves. a malformed value is
+ * reported when the script reads its field.
+ */
+class json_index {
+public:
+    /// false if @c document is not an object, its structure is broken or a
+    /// key has escapes, run_json parses such documents eagerly
+    bool build(std::string_view document) {
+        doc = document;
+        pos = 0;
+        fields.clear();
+        keys.clear();
+
+        skip_whitespace();
+        if (!consume('{')) {
+            return false;
+        }
+        skip_whitespace();
+        if (consume('}')) {
+            return at_end();
+        }
+
+        for (;;) {
+            skip_whitespace();
+            auto key = scan_key();
+            skip_whitespace();
+            if (!key || !consume(':')) {
+                return false;
+            }
+            skip_whitespace();
+            auto value_start = pos;
+            if (!skip_value()) {
+                return false;
+            }
+            auto [it, inserted] = fields.insert_or_assign(*key, doc.substr(value_start, pos - value_start));
+            if (inserted) {
+                keys.push_back(*key);
+            }
+
+            skip_whitespace();
+            if (consume('}')) {
+                return at_end();
+            }
+            if (!consume(',')) {
+                return false;
+            }
+        }
+    }
+
+    std::optional<std::string_view> find(std::string_view key) const {
+        auto it = fields.find(key);
+        if (it == fields.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    /// keys in document order
+    const std::vector<std::string_view>& field_names() const {
+        return keys;
+    }
+
+private:
+    bool consume(char c) {
+        if (pos < doc.size() && doc[pos] == c) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    void skip_whitespace() {
+        while (pos < doc.size() && (doc[pos] == ' ' || doc[pos] == '\n' || doc[pos] == '\r' || doc[pos] == '\t')) {
+            pos++;
+        }
+    }
+
+    bool at_end() {
+        skip_whitespace();
+        return pos == doc.size();
+    }
+
+    std::optional<std::string_view> scan_key() {
+        if (!consume('"')) {
+            return std::nullopt;
+        }
+        auto start = pos;
+        while (pos < doc.size() && doc[pos] != '"') {
+            if (doc[pos] == '\\' || static_cast<unsigned char>(doc[pos]) < 0x20) {
+                return std::nullopt;
+            }
+            pos++;
+        }
+        if (pos == doc.size()) {
+            return std::nullopt;
+        }
+        return doc.substr(start, pos++ - start);
+    }
+
+    bool skip_string() {
+        pos++;
+        while (pos < doc.size()) {
+            auto* next = static_cast<const char*>(std::memchr(doc.data() + pos, '"', doc.size() - pos));
+            if (!next) {
+                return false;
+            }
+            pos = next - doc.data();
+            // the quote is escaped if an odd number of backslashes precede it
+            size_t backslashes = 0;
+            while (backslashes < pos && doc[pos - 1 - backslashes] == '\\') {
+                backslashes++;
+            }
+            pos++;
+            if (backslashes % 2 == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool skip_value() {
+        if (pos == doc.size()) {
+            return false;
+        }
+        if (doc[pos] == '"') {
+            return skip_string();
+        }
+        if (doc[pos] != '{' && doc[pos] != '[') {
+            auto start = pos;
+            while (pos < doc.size() && !std::strchr(",}] \n\r\t", doc[pos])) {
+                pos++;
+            }
+            return pos > start;
+        }
+
+        std::vector<char> closing;
+        while (pos < doc.size()) {
+            char c = doc[pos];
+            if (c == '"') {
+                if (!skip_string()) {
+                    return false;
+                }
+                continue;
+            }
+            if (c == '{' || c == '[') {
+                closing.push_back(c == '{' ? '}' : ']');
+            } else if (c == '}' || c == ']') {
+                if (closing.empty() || closing.back() != c) {
+                    return false;
+                }
+                closing.pop_back();
+                if (closing.empty()) {
+                    pos++;
+                    return true;
+                }
+            }
+            pos++;
+        }
+        return false;
+    }
+
+    std::string_view doc;
+    size_t pos = 0;
+    std::unordered_map<std::string_view, std::string_view> fields;
+    std::vector<std::string_view> keys;
+};
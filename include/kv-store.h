@@ -0,0 +1,218 @@
+#pragma once
+
+#include "seastar/core/smp.hh"
+
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+ * per-shard hash table of byte strings. keys and values live in arena chunks,
+ * so a value can be handed out as a view without copying; a view keeps its
+ * chunk alive after the value is overwritten or compacted away.
+ *
+ * scripts reach the store of their own shard through the kv_get and kv_put
+ * globals, kv_get returns such a view, which scripts must treat as read-only.
+ * the kv_get and kv_put host calls route by key to the store of
+ * owner_shard(), a script sharing keys between shards has to use them only.
+ *
+ * the reactor and the worker running a script of the shard use the store
+ * concurrently, every operation takes the store's mutex.
+ */
+class kv_store {
+    struct arena_chunk {
+        explicit arena_chunk(size_t size_)
+        : data(new char[size_]), size(size_) {}
+
+        std::unique_ptr<char[]> data;
+        size_t size;
+        size_t used = 0;
+    };
+
+    struct slot {
+        enum class status : uint8_t { empty, used, deleted };
+
+        status state = status::empty;
+        size_t hash = 0;
+        uint32_t chunk = 0;
+        uint32_t key_size = 0;
+        uint32_t value_size = 0;
+        // key bytes followed by value bytes
+        const char* data = nullptr;
+    };
+
+public:
+    /// a stored value, valid as long as the view lives
+    struct value_view {
+        std::shared_ptr<const arena_chunk> chunk;
+        const char* data;
+        size_t size;
+    };
+
+    explicit kv_store(size_t chunk_size_ = 1 << 20)
+    : chunk_size(chunk_size_), slots(16) {}
+
+    std::optional<value_view> get(std::string_view key) const {
+        std::lock_guard lock{mutex};
+        auto index = find(key, std::hash<std::string_view>{}(key));
+        if (!index) {
+            return std::nullopt;
+        }
+        const auto& found = slots[*index];
+        return value_view{chunks[found.chunk], found.data + found.key_size, found.value_size};
+    }
+
+    void put(std::string_view key, std::span<const char> value) {
+        std::lock_guard lock{mutex};
+        auto hash = std::hash<std::string_view>{}(key);
+        if (auto index = find(key, hash)) {
+            auto& found = slots[*index];
+            garbage_bytes += found.key_size + found.value_size;
+            live_bytes -= found.key_size + found.value_size;
+            found.state = slot::status::deleted;
+            n_deleted++;
+            n_keys--;
+        }
+
+        if ((n_keys + n_deleted + 1) * 10 > slots.size() * 7) {
+            rehash(n_keys * 2 >= slots.size() / 2 ? slots.size() * 2 : slots.size());
+        }
+
+        auto& free_slot = slots[probe_free(hash)];
+        if (free_slot.state == slot::status::deleted) {
+            n_deleted--;
+        }
+        store(free_slot, hash, key, value);
+        n_keys++;
+        live_bytes += key.size() + value.size();
+        maybe_compact();
+    }
+
+    bool erase(std::string_view key) {
+        std::lock_guard lock{mutex};
+        auto index = find(key, std::hash<std::string_view>{}(key));
+        if (!index) {
+            return false;
+        }
+        auto& found = slots[*index];
+        garbage_bytes += found.key_size + found.value_size;
+        live_bytes -= found.key_size + found.value_size;
+        found.state = slot::status::deleted;
+        n_deleted++;
+        n_keys--;
+        maybe_compact();
+        return true;
+    }
+
+    size_t size() const {
+        std::lock_guard lock{mutex};
+        return n_keys;
+    }
+
+    /// bytes of the arena chunks owned by the store
+    size_t memory_usage() const {
+        std::lock_guard lock{mutex};
+        size_t total = 0;
+        for (const auto& chunk : chunks) {
+            total += chunk->size;
+        }
+        return total;
+    }
+
+    /// the shard whose store owns @c key when requests are routed by key
+    static unsigned owner_shard(std::string_view key) {
+        return std::hash<std::string_view>{}(key) % seastar::smp::count;
+    }
+
+    /// the store of the current shard, set by storage_t
+    static kv_store* local() {
+        return local_store;
+    }
+
+    static void set_local(kv_store* store) {
+        local_store = store;
+    }
+
+private:
+    std::optional<size_t> find(std::string_view key, size_t hash) const {
+        auto mask = slots.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            const auto& candidate = slots[i];
+            if (candidate.state == slot::status::empty) {
+                return std::nullopt;
+            }
+            if (candidate.state == slot::status::used && candidate.hash == hash &&
+                std::string_view(candidate.data, candidate.key_size) == key) {
+                return i;
+            }
+        }
+    }
+
+    size_t probe_free(size_t hash) const {
+        auto mask = slots.size() - 1;
+        size_t i = hash & mask;
+        while (slots[i].state == slot::status::used) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    void store(slot& target, size_t hash, std::string_view key, std::span<const char> value) {
+        auto size = key.size() + value.size();
+        if (chunks.empty() || chunks.back()->size - chunks.back()->used < size) {
+            chunks.push_back(std::make_shared<arena_chunk>(std::max(chunk_size, size)));
+        }
+        auto& chunk = *chunks.back();
+        char* data = chunk.data.get() + chunk.used;
+        std::memcpy(data, key.data(), key.size());
+        std::memcpy(data + key.size(), value.data(), value.size());
+        chunk.used += size;
+
+        target = slot{slot::status::used, hash, uint32_t(chunks.size() - 1), uint32_t(key.size()), uint32_t(value.size()), data};
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<slot> old_slots(capacity);
+        old_slots.swap(slots);
+        n_deleted = 0;
+        for (const auto& old : old_slots) {
+            if (old.state == slot::status::used) {
+                slots[probe_free(old.hash)] = old;
+            }
+        }
+    }
+
+    /// copies live entries to new chunks once most of the arena is garbage
+    void maybe_compact() {
+        if (garbage_bytes < chunk_size || garbage_bytes < live_bytes) {
+            return;
+        }
+
+        auto old_chunks = std::exchange(chunks, {});
+        for (auto& entry : slots) {
+            if (entry.state == slot::status::used) {
+                std::string_view key(entry.data, entry.key_size);
+                std::span<const char> value(entry.data + entry.key_size, entry.value_size);
+                store(entry, entry.hash, key, value);
+            }
+        }
+        garbage_bytes = 0;
+    }
+
+    inline static thread_local kv_store* local_store = nullptr;
+
+    const size_t chunk_size;
+    mutable std::mutex mutex;
+    std::vector<slot> slots;
+    std::vector<std::shared_ptr<arena_chunk>> chunks;
+    size_t n_keys = 0;
+    size_t n_deleted = 0;
+    size_t live_bytes = 0;
+    size_t garbage_bytes = 0;
+};
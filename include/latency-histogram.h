@@ -0,0 +1,90 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+
+/**
+ * log-linear histogram of latencies in nanoseconds: every power of two is
+ * split into 64 buckets, so a recorded value is reported with an error
+ * below 1.6%. fixed size, so it can be merged across shards by value.
+ */
+class latency_histogram {
+public:
+    void record(std::chrono::nanoseconds latency) {
+        uint64_t value = std::max<int64_t>(latency.count(), 0);
+        buckets[bucket_of(value)]++;
+        total++;
+        sum += value;
+        max_value = std::max(max_value, value);
+    }
+
+    void merge(const latency_histogram& other) {
+        for (size_t i = 0; i < n_buckets; i++) {
+            buckets[i] += other.buckets[i];
+        }
+        total += other.total;
+        sum += other.sum;
+        max_value = std::max(max_value, other.max_value);
+    }
+
+    uint64_t count() const {
+        return total;
+    }
+
+    std::chrono::nanoseconds mean() const {
+        return std::chrono::nanoseconds(total ? sum / total : 0);
+    }
+
+    std::chrono::nanoseconds max() const {
+        return std::chrono::nanoseconds(max_value);
+    }
+
+    /// @param quantile from 0 to 1
+    /// @return the upper bound of the bucket holding the quantile
+    std::chrono::nanoseconds percentile(double quantile) const {
+        if (total == 0) {
+            return std::chrono::nanoseconds(0);
+        }
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(quantile * total + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < n_buckets; i++) {
+            seen += buckets[i];
+            if (seen >= rank) {
+                return std::chrono::nanoseconds(std::min(upper_bound_of(i), max_value));
+            }
+        }
+        return std::chrono::nanoseconds(max_value);
+    }
+
+private:
+    static constexpr unsigned sub_bucket_bits = 6;
+    static constexpr size_t sub_buckets = 1 << sub_bucket_bits;
+    static constexpr size_t n_buckets = (64 - sub_bucket_bits + 1) * sub_buckets;
+
+    // values below sub_buckets have a bucket each, above it the bucket is
+    // picked by the highest set bit and the next sub_bucket_bits bits
+    static size_t bucket_of(uint64_t value) {
+        if (value < sub_buckets) {
+            return value;
+        }
+        unsigned shift = std::bit_width(value) - 1 - sub_bucket_bits;
+        return (shift + 1) * sub_buckets + ((value >> shift) - sub_buckets);
+    }
+
+    static uint64_t upper_bound_of(size_t bucket) {
+        if (bucket < sub_buckets) {
+            return bucket;
+        }
+        unsigned shift = bucket / sub_buckets - 1;
+        uint64_t base = (sub_buckets + bucket % sub_buckets) << shift;
+        return base + ((uint64_t(1) << shift) - 1);
+    }
+
+    std::array<uint64_t, n_buckets> buckets{};
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t max_value = 0;
+};
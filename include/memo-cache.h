@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * results of a deterministic script keyed by its input bytes: the bytes the
+ * buffer held after a run of the same input. entries are evicted in LRU
+ * order, and a new entry is only admitted when it is used more often than
+ * the entries it would evict (TinyLFU), so one-off inputs do not flush the
+ * hot ones.
+ */
+class memo_cache {
+    struct entry {
+        size_t hash;
+        std::string input;
+        std::string output;
+
+        size_t bytes() const {
+            return input.size() + output.size() + sizeof(entry);
+        }
+    };
+
+    /// approximate access counts of recent inputs, a count-min sketch with
+    /// 4 bit counters which are halved after every 10 * width accesses
+    class frequency_sketch {
+    public:
+        explicit frequency_sketch(size_t width_)
+        : width(std::bit_ceil(std::max<size_t>(width_, 64))), counters(width * rows / 2) {}
+
+        void increment(size_t hash) {
+            for (size_t row = 0; row < rows; row++) {
+                auto index = counter_index(hash, row);
+                auto& byte = counters[index / 2];
+                auto shift = (index % 2) * 4;
+                if (((byte >> shift) & 0xf) < 0xf) {
+                    byte += 1 << shift;
+                }
+            }
+            if (++samples >= width * 10) {
+                age();
+            }
+        }
+
+        uint8_t estimate(size_t hash) const {
+            uint8_t result = 0xf;
+            for (size_t row = 0; row < rows; row++) {
+                auto index = counter_index(hash, row);
+                result = std::min<uint8_t>(result, (counters[index / 2] >> ((index % 2) * 4)) & 0xf);
+            }
+            return result;
+        }
+
+    private:
+        static constexpr size_t rows = 4;
+
+        size_t counter_index(size_t hash, size_t row) const {
+            static constexpr std::array<uint64_t, rows> seeds = {
+                0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full, 0x165667b19e3779f9ull, 0x27d4eb2f165667c5ull};
+            uint64_t h = (hash ^ (hash >> 29)) * seeds[row];
+            return row * width + ((h >> 32) & (width - 1));
+        }
+
+        void age() {
+            for (auto& byte : counters) {
+                byte = (byte >> 1) & 0x77;
+            }
+            samples /= 2;
+        }
+
+        size_t width;
+        std::vector<uint8_t> counters;
+        size_t samples = 0;
+    };
+
+public:
+    struct stats_t {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        // results not admitted because the entries they would evict are used more
+        uint64_t rejections = 0;
+    };
+
+    /// @param max_bytes_ memory of the cached inputs and outputs
+    explicit memo_cache(size_t max_bytes_)
+    : max_bytes(max_bytes_), sketch(max_bytes_ / 256) {}
+
+    /// copies the cached result of the input held by @c data into it
+    bool lookup(std::span<char> data) {
+        std::string_view input(data.data(), data.size());
+        auto hash = std::hash<std::string_view>{}(input);
+        sketch.increment(hash);
+
+        auto it = index.find(hash);
+        if (it == index.end() || it->second->input != input || it->second->output.size() != data.size()) {
+            cache_stats.misses++;
+            return false;
+        }
+
+        lru.splice(lru.begin(), lru, it->second);
+        std::memcpy(data.data(), it->second->output.data(), data.size());
+        cache_stats.hits++;
+        return true;
+    }
+
+    void insert(std::string_view input, std::span<const char> output) {
+        auto hash = std::hash<std::string_view>{}(input);
+        if (auto it = index.find(hash); it != index.end()) {
+            // a hash collision or a repeated miss of the same input
+            erase(it->second);
+        }
+
+        entry candidate{hash, std::string(input), std::string(output.data(), output.size())};
+        if (candidate.bytes() > max_bytes) {
+            return;
+        }
+
+        auto frequency = sketch.estimate(hash);
+        while (used_bytes + candidate.bytes() > max_bytes) {
+            auto& victim = lru.back();
+            if (frequency <= sketch.estimate(victim.hash)) {
+                cache_stats.rejections++;
+                return;
+            }
+            erase(std::prev(lru.end()));
+            cache_stats.evictions++;
+        }
+
+        used_bytes += candidate.bytes();
+        lru.push_front(std::move(candidate));
+        index.emplace(hash, lru.begin());
+    }
+
+    const stats_t& stats() const {
+        return cache_stats;
+    }
+
+    size_t memory_usage() const {
+        return used_bytes;
+    }
+
+private:
+    void erase(std::list<entry>::iterator it) {
+        used_bytes -= it->bytes();
+        index.erase(it->hash);
+        lru.erase(it);
+    }
+
+    size_t max_bytes;
+    size_t used_bytes = 0;
+    // most recently used first
+    std::list<entry> lru;
+    std::unordered_map<size_t, std::list<entry>::iterator> index;
+    frequency_sketch sketch;
+    stats_t cache_stats;
+};
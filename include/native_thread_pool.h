@@ -22,12 +22,20 @@
 #include <boost/lockfree/queue.hpp>
 #include <boost/optional.hpp>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <mutex>
 #include <semaphore.h>
+#include <stdexcept>
+#include <thread>
+#include <time.h>
 #include <tuple>
 #include <type_traits>
+#include <vector>
 
+#include "invocation-trace.h"
 #include "semaphore.h"
 
 namespace v {
@@ -55,10 +63,20 @@ public:
     }
 };
 
+/// what a task reports about its run besides its result
+struct TaskAccounting {
+    // stages of the task are marked in it
+    invocation_trace* trace = nullptr;
+    // the CPU time the worker spent in the task is added to it
+    std::chrono::nanoseconds* cpu_time = nullptr;
+};
+
 struct WorkItem {
     virtual ~WorkItem() {
     }
     virtual void process() = 0;
+    // when the task was submitted, its queue wait is measured from it
+    std::chrono::steady_clock::time_point submitted;
 };
 
 template<typename Func>
@@ -67,18 +85,32 @@ struct Task final : WorkItem {
     Func func;
     seastar::future_state<int> state;
     Condition on_done;
+    TaskAccounting accounting;
+
+    static std::chrono::nanoseconds thread_cpu_time() {
+        timespec ts;
+        ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+    }
 
 public:
-    explicit Task(Func&& f)
-      : func(std::move(f)) {
+    explicit Task(Func&& f, TaskAccounting accounting_ = {})
+      : func(std::move(f))
+      , accounting(accounting_) {
     }
     void process() override {
+        trace_mark(accounting.trace, invocation_trace::worker_started);
+        auto cpu_start = accounting.cpu_time ? thread_cpu_time() : std::chrono::nanoseconds(0);
         try {
             func();
             state.set(0);
         } catch (...) {
             state.set_exception(std::current_exception());
         }
+        if (accounting.cpu_time) {
+            *accounting.cpu_time += thread_cpu_time() - cpu_start;
+        }
+        trace_mark(accounting.trace, invocation_trace::worker_finished);
         on_done.notify();
     }
     seastar::future<> get_future() {
@@ -93,6 +125,15 @@ public:
     }
 };
 
+/// work a worker thread performs when it finds nothing to do in the pending
+/// queue. the worker is unavailable for regular tasks until it returns, so
+/// implementations must honor the deadline.
+struct IdleWork {
+    virtual ~IdleWork() {
+    }
+    virtual void on_idle(std::chrono::steady_clock::time_point deadline) = 0;
+};
+
 struct SubmitQueue {
     seastar::semaphore free_slots;
     seastar::gate pending_tasks;
@@ -104,19 +145,69 @@ struct SubmitQueue {
     }
 };
 
+/**
+ * bounds and triggers of the thread count of a ThreadPool. the pool starts
+ * max_threads threads and keeps between min_threads and max_threads of them
+ * active, the others are parked. every period a thread is activated if tasks
+ * waited longer than grow_wait on average, counting the tasks which still
+ * wait with the time they waited so far, so a pool whose threads are all
+ * stuck in long tasks grows although none starts. one is parked if the pool
+ * looked oversized for shrink_periods periods in a row: without it the other
+ * threads would have stayed below shrink_utilization and tasks waited less
+ * than half of grow_wait. the gap between the triggers and the streak keep
+ * the size from oscillating, a pool grows fast and shrinks slowly.
+ */
+struct PoolSizing {
+    size_t min_threads = 1;
+    size_t max_threads = 1;
+    std::chrono::microseconds grow_wait{200};
+    double shrink_utilization = 0.5;
+    std::chrono::milliseconds period{100};
+    unsigned shrink_periods = 10;
+};
+
 /// an engine for scheduling non-seastar tasks from seastar fibers
 class ThreadPool {
     std::atomic<bool> stopping = false;
     std::mutex mutex;
     std::condition_variable cond;
     std::vector<std::thread> threads;
+    const PoolSizing sizing;
+    // threads with a lower index take tasks, the others are parked
+    std::atomic<size_t> active_threads;
+    std::mutex park_mutex;
+    std::condition_variable park_cond;
+    std::thread sizer;
+    std::atomic<uint64_t> started_tasks = 0;
+    std::atomic<uint64_t> queue_wait_ns = 0;
+    std::atomic<uint64_t> busy_ns = 0;
+    std::atomic<uint64_t> resizes = 0;
+    // tasks submitted but not admitted to a thread yet, and the sum of their
+    // submit times since epoch, so the sizer gets their mean age
+    const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    std::mutex waiting_mutex;
+    uint64_t waiting_tasks = 0;
+    uint64_t waiting_since_ns = 0;
     seastar::sharded<SubmitQueue> submit_queue;
     const size_t queue_size;
     boost::lockfree::queue<WorkItem*> pending;
     semaphore add_task_sem;
+    std::mutex idle_mutex;
+    std::vector<IdleWork*> idle_works;
+    std::chrono::steady_clock::duration idle_budget = std::chrono::milliseconds(5);
 
-    void loop() {
+    void loop(size_t index) {
         for (;;) {
+            if (index >= active_threads.load(std::memory_order_relaxed)) {
+                std::unique_lock lock{park_mutex};
+                park_cond.wait(lock, [this, index] {
+                    return index < active_threads.load(std::memory_order_relaxed) || is_stopping();
+                });
+                if (is_stopping()) {
+                    break;
+                }
+                continue;
+            }
             WorkItem* work_item = nullptr;
             {
                 std::unique_lock lock{mutex};
@@ -126,15 +217,110 @@ class ThreadPool {
                   });
             }
             if (work_item) {
+                auto started = std::chrono::steady_clock::now();
+                queue_wait_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(started - work_item->submitted).count(), std::memory_order_relaxed);
+                started_tasks.fetch_add(1, std::memory_order_relaxed);
+                // the reactor may delete the item once it is processed
                 work_item->process();
+                busy_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count(), std::memory_order_relaxed);
             } else if (is_stopping()) {
                 break;
+            } else {
+                run_idle_works();
+            }
+        }
+    }
+    // only one worker donates its idle time at once, the others keep
+    // waiting for tasks
+    void run_idle_works() {
+        std::unique_lock lock{idle_mutex, std::try_to_lock};
+        if (!lock.owns_lock() || idle_works.empty()) {
+            return;
+        }
+        auto deadline = std::chrono::steady_clock::now() + idle_budget;
+        for (auto* idle_work : idle_works) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                break;
             }
+            idle_work->on_idle(deadline);
         }
     }
+    // adjusts the active threads to the load every sizing.period
+    void resize_loop() {
+        uint64_t last_tasks = 0;
+        uint64_t last_wait_ns = 0;
+        uint64_t last_busy_ns = 0;
+        unsigned oversized_periods = 0;
+        std::unique_lock lock{park_mutex};
+        while (!park_cond.wait_for(lock, sizing.period, [this] { return is_stopping(); })) {
+            uint64_t tasks = started_tasks.load(std::memory_order_relaxed);
+            uint64_t wait = queue_wait_ns.load(std::memory_order_relaxed);
+            uint64_t busy = busy_ns.load(std::memory_order_relaxed);
+            auto mean_wait = std::max(std::chrono::nanoseconds(tasks > last_tasks ? (wait - last_wait_ns) / (tasks - last_tasks) : 0), mean_waiting_age());
+            size_t active = active_threads.load(std::memory_order_relaxed);
+            double period_ns = std::chrono::duration<double, std::nano>(sizing.period).count();
+            double utilization_without_one = active > 1 ? (busy - last_busy_ns) / (period_ns * (active - 1)) : 1.0;
+            last_tasks = tasks;
+            last_wait_ns = wait;
+            last_busy_ns = busy;
+
+            if (mean_wait > sizing.grow_wait && active < sizing.max_threads) {
+                set_active_threads(active + 1);
+                oversized_periods = 0;
+            } else if (active > sizing.min_threads && mean_wait < sizing.grow_wait / 2 && utilization_without_one < sizing.shrink_utilization) {
+                if (++oversized_periods >= sizing.shrink_periods) {
+                    set_active_threads(active - 1);
+                    oversized_periods = 0;
+                }
+            } else {
+                oversized_periods = 0;
+            }
+        }
+    }
+    uint64_t since_epoch_ns(std::chrono::steady_clock::time_point time) const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time - epoch).count();
+    }
+    void note_waiting(std::chrono::steady_clock::time_point submitted) {
+        std::lock_guard lock{waiting_mutex};
+        waiting_tasks++;
+        waiting_since_ns += since_epoch_ns(submitted);
+    }
+    void note_admitted(std::chrono::steady_clock::time_point submitted) {
+        std::lock_guard lock{waiting_mutex};
+        waiting_tasks--;
+        waiting_since_ns -= since_epoch_ns(submitted);
+    }
+    // how long the tasks still waiting for a thread waited so far
+    std::chrono::nanoseconds mean_waiting_age() {
+        auto now = since_epoch_ns(std::chrono::steady_clock::now());
+        std::lock_guard lock{waiting_mutex};
+        if (waiting_tasks == 0) {
+            return std::chrono::nanoseconds(0);
+        }
+        return std::chrono::nanoseconds((waiting_tasks * now - waiting_since_ns) / waiting_tasks);
+    }
+    // under park_mutex. a parked thread finishes its task first
+    void set_active_threads(size_t active) {
+        add_task_sem.add_slots(int64_t(active) - int64_t(active_threads.load(std::memory_order_relaxed)));
+        active_threads.store(active, std::memory_order_relaxed);
+        resizes.fetch_add(1, std::memory_order_relaxed);
+        park_cond.notify_all();
+    }
     bool is_stopping() const {
         return stopping.load(std::memory_order_relaxed);
     }
+    static const PoolSizing& checked(const PoolSizing& sizing, const std::vector<unsigned>& cpu_ids) {
+        if (cpu_ids.empty()) {
+            throw std::invalid_argument("thread pool needs a CPU to pin its threads to");
+        }
+        if (sizing.min_threads == 0) {
+            throw std::invalid_argument("thread pool needs a min_threads of at least 1");
+        }
+        if (sizing.min_threads > sizing.max_threads) {
+            throw std::invalid_argument("thread pool needs min_threads not above max_threads");
+        }
+        return sizing;
+    }
     static void pin(unsigned cpu_id) {
         cpu_set_t cs;
         CPU_ZERO(&cs);
@@ -160,17 +346,39 @@ public:
      * reasonable limit.
      */
     ThreadPool(size_t n_threads, size_t queue_size, unsigned cpu_id)
-      : queue_size{queue_size} // round_up_to(queue_sz, seastar::smp::count)}
+      : ThreadPool(PoolSizing{.min_threads = n_threads, .max_threads = n_threads}, queue_size, {cpu_id}) {
+    }
+    /**
+     * a pool whose thread count adapts to the load within @c sizing, see
+     * PoolSizing.
+     * @param cpu_ids the i-th thread is pinned to cpu_ids[i % cpu_ids.size()]
+     * @throws std::invalid_argument without CPUs, without threads or with
+     *         min_threads above max_threads
+     * @note a shard has queue_size / smp::count tasks at once at most, so
+     * its tasks use max_threads threads only if queue_size allows it.
+     */
+    ThreadPool(PoolSizing sizing_, size_t queue_size, std::vector<unsigned> cpu_ids)
+      : sizing{checked(sizing_, cpu_ids)}
+      , active_threads{sizing_.min_threads}
+      , queue_size{queue_size}
       , pending{queue_size}
-      , add_task_sem(n_threads) {
-        for (size_t i = 0; i < n_threads; i++) {
-            threads.emplace_back([this, cpu_id] {
+      , add_task_sem(sizing_.min_threads) {
+        for (size_t i = 0; i < sizing.max_threads; i++) {
+            threads.emplace_back([this, i, cpu_id = cpu_ids[i % cpu_ids.size()]] {
                 pin(cpu_id);
-                loop();
+                loop(i);
+            });
+        }
+        if (sizing.min_threads < sizing.max_threads) {
+            sizer = std::thread([this] {
+                resize_loop();
             });
         }
     }
     ~ThreadPool() {
+        if (sizer.joinable()) {
+            sizer.join();
+        }
         for (auto& thread : threads) {
             thread.join();
         }
@@ -181,24 +389,76 @@ public:
     }
     seastar::future<> stop() {
         return submit_queue.stop().then([this] {
-            stopping = true;
+            {
+                std::lock_guard lock{park_mutex};
+                stopping = true;
+            }
             cond.notify_all();
+            park_cond.notify_all();
         });
     }
+    /// threads taking tasks, the others are parked
+    size_t active_thread_count() const {
+        return active_threads.load(std::memory_order_relaxed);
+    }
+    /// times a thread was activated or parked
+    uint64_t resize_count() const {
+        return resizes.load(std::memory_order_relaxed);
+    }
+    /// tasks a worker started
+    uint64_t started_task_count() const {
+        return started_tasks.load(std::memory_order_relaxed);
+    }
+    /// time the started tasks waited from submit() to a worker
+    std::chrono::nanoseconds total_queue_wait() const {
+        return std::chrono::nanoseconds(queue_wait_ns.load(std::memory_order_relaxed));
+    }
+    /// tasks a shard can have queued or running at once
+    size_t slots_per_shard() const {
+        return queue_size / seastar::smp::count;
+    }
+    /// @param budget how long a worker may spend in idle works every time
+    ///               it waited for a task without getting one
+    void set_idle_budget(std::chrono::steady_clock::duration budget) {
+        std::lock_guard lock{idle_mutex};
+        idle_budget = budget;
+    }
+    void add_idle_work(IdleWork* idle_work) {
+        std::lock_guard lock{idle_mutex};
+        idle_works.push_back(idle_work);
+    }
+    /// waits until no worker runs @c idle_work, so it can be destroyed after
+    void remove_idle_work(IdleWork* idle_work) {
+        std::lock_guard lock{idle_mutex};
+        std::erase(idle_works, idle_work);
+    }
     template<typename Func, typename... Args>
     auto submit(Func&& func, Args&&... args) {
         auto packaged = [func = std::move(func),
                          args = std::forward_as_tuple(args...)] {
             return std::apply(std::move(func), std::move(args));
         };
+        return submit_accounted({}, std::move(packaged));
+    }
+    /// submit() which reports on the task's run into @c accounting
+    template<typename Func>
+    auto submit_accounted(TaskAccounting accounting, Func&& func) {
+        auto submitted = std::chrono::steady_clock::now();
+        note_waiting(submitted);
         return add_task_sem.lock()
-        .then([this, packaged = std::move(packaged)]{
+        .finally([this, submitted]{
+            note_admitted(submitted);
+        })
+        .then([this, accounting, submitted, packaged = std::move(func)]{
+            trace_mark(accounting.trace, invocation_trace::pool_admitted);
             return seastar::with_gate(
             submit_queue.local().pending_tasks,
-            [packaged = std::move(packaged), this] {
+            [packaged = std::move(packaged), accounting, submitted, this] {
                 return local_free_slots().wait().then(
-                    [packaged = std::move(packaged), this] {
-                        auto task = new Task{std::move(packaged)};
+                    [packaged = std::move(packaged), accounting, submitted, this] {
+                        trace_mark(accounting.trace, invocation_trace::slot_acquired);
+                        auto task = new Task{std::move(packaged), accounting};
+                        task->submitted = submitted;
                         auto fut = task->get_future();
                         pending.push(task);
                         cond.notify_one();
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "v8-profiler.h"
+#include "v8.h"
+
+#include <cstdint>
+#include <map>
+#include <sstream>
+#include <string>
+
+/// folded stacks ("outer;inner value" lines), the input format of
+/// flamegraph.pl and speedscope. profiles of several isolates are merged by
+/// collapsing them into the same map.
+using collapsed_stacks_t = std::map<std::string, uint64_t>;
+
+inline std::string profile_frame_name(const char* function_name, const char* resource_name, int line_number) {
+    std::string frame = *function_name ? function_name : "(anonymous)";
+    if (*resource_name) {
+        frame.append(" ").append(resource_name).append(":").append(std::to_string(line_number));
+    }
+    // ';' separates frames and ' ' the value in the folded format
+    for (auto& c : frame) {
+        if (c == ';') {
+            c = ':';
+        }
+    }
+    return frame;
+}
+
+inline void collapse_cpu_profile_node(const v8::CpuProfileNode* node, const std::string& parent_stack, collapsed_stacks_t& stacks) {
+    std::string stack = parent_stack;
+    if (node->GetParent() != nullptr) {
+        if (!stack.empty()) {
+            stack.push_back(';');
+        }
+        stack.append(profile_frame_name(node->GetFunctionNameStr(), node->GetScriptResourceNameStr(), node->GetLineNumber()));
+        if (node->GetHitCount() > 0) {
+            stacks[stack] += node->GetHitCount();
+        }
+    }
+
+    for (int i = 0; i < node->GetChildrenCount(); ++i) {
+        collapse_cpu_profile_node(node->GetChild(i), stack, stacks);
+    }
+}
+
+/// adds the self samples of every frame of @c profile to @c stacks
+inline void collapse_cpu_profile(const v8::CpuProfile* profile, collapsed_stacks_t& stacks) {
+    collapse_cpu_profile_node(profile->GetTopDownRoot(), std::string{}, stacks);
+}
+
+inline std::string format_collapsed_stacks(const collapsed_stacks_t& stacks) {
+    std::ostringstream out;
+    for (const auto& [stack, value] : stacks) {
+        out << stack << ' ' << value << '\n';
+    }
+    return out.str();
+}
+
+inline void collapse_allocation_profile_node(v8::Isolate* isolate, const v8::AllocationProfile::Node* node, const std::string& parent_stack, bool is_root, collapsed_stacks_t& stacks) {
+    std::string stack = parent_stack;
+    if (!is_root) {
+        v8::String::Utf8Value function_name(isolate, node->name);
+        v8::String::Utf8Value resource_name(isolate, node->script_name);
+        if (!stack.empty()) {
+            stack.push_back(';');
+        }
+        stack.append(profile_frame_name(*function_name ? *function_name : "", *resource_name ? *resource_name : "", node->line_number));
+
+        uint64_t bytes = 0;
+        for (const auto& allocation : node->allocations) {
+            bytes += static_cast<uint64_t>(allocation.size) * allocation.count;
+        }
+        if (bytes > 0) {
+            stacks[stack] += bytes;
+        }
+    }
+
+    for (const auto* child : node->children) {
+        collapse_allocation_profile_node(isolate, child, stack, false, stacks);
+    }
+}
+
+/// adds the sampled live bytes allocated by every frame of @c profile to
+/// @c stacks. the caller has to be inside a HandleScope of @c isolate.
+inline void collapse_allocation_profile(v8::Isolate* isolate, v8::AllocationProfile* profile, collapsed_stacks_t& stacks) {
+    collapse_allocation_profile_node(isolate, profile->GetRootNode(), std::string{}, true, stacks);
+}
@@ -0,0 +1,232 @@
+#pragma once
+
+#include "seastar/core/preempt.hh"
+#include "v8-seastar-platform.h"
+#include "v8.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+/**
+ * runs tiny scripts on the reactor thread, sparing them the hand off to a
+ * worker and back. the shard has one isolate for them which only its reactor
+ * enters, so it is used without a Locker.
+ *
+ * a run may take its script's budget of time. while a run is active a ticker
+ * thread requests interrupts of the isolate, the interrupt terminates the run
+ * once the budget is spent or the reactor has to preempt. the caller restores
+ * the input and runs the script on the pool instead.
+ *
+ * scripts get the storage's prelude but no host API, a script calling it
+ * fails here and belongs on the pool.
+ */
+class reactor_engine {
+public:
+    enum class run_result {
+        succeeded,
+        // the script threw or returned a promise
+        failed,
+        // the reactor had other work to do
+        preempted,
+        over_budget,
+    };
+
+    /// @param tick_ how often a run is checked against its budget
+    explicit reactor_engine(std::chrono::microseconds tick_ = std::chrono::microseconds(20))
+    : tick(tick_) {
+        v8::Isolate::CreateParams create_params;
+        create_params.array_buffer_allocator_shared = std::shared_ptr<v8::ArrayBuffer::Allocator>(v8::ArrayBuffer::Allocator::NewDefaultAllocator());
+        isolate = v8::Isolate::New(create_params);
+        isolate->SetMicrotasksPolicy(v8::MicrotasksPolicy::kExplicit);
+        ticker = std::thread([this]{
+            ticker_loop();
+        });
+    }
+
+    ~reactor_engine() {
+        {
+            std::lock_guard lock{ticker_mutex};
+            stopping = true;
+        }
+        ticker_cond.notify_one();
+        ticker.join();
+
+        scripts.clear();
+        isolate->Dispose();
+        if (auto* platform = seastar_v8_platform::current()) {
+            platform->notify_isolate_shutdown(isolate);
+        }
+    }
+
+    reactor_engine(const reactor_engine&) = delete;
+    reactor_engine& operator=(const reactor_engine&) = delete;
+
+    /// compiles @c source after @c prelude in a context of its own
+    bool add_script(const std::string& name, std::string_view source, const std::string& prelude, std::chrono::microseconds budget) {
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        v8::TryCatch try_catch(isolate);
+        v8::Local<v8::Context> local_ctx = v8::Context::New(isolate);
+        v8::Context::Scope context_scope(local_ctx);
+
+        for (auto code : {std::string_view(prelude), source}) {
+            if (code.empty()) {
+                continue;
+            }
+            v8::Local<v8::String> script_code = v8::String::NewFromUtf8(isolate, code.data(), v8::NewStringType::kNormal, code.size()).ToLocalChecked();
+            v8::Local<v8::Script> compiled_script;
+            v8::Local<v8::Value> result;
+            if (!v8::Script::Compile(local_ctx, script_code).ToLocal(&compiled_script) || !compiled_script->Run(local_ctx).ToLocal(&result)) {
+                v8::String::Utf8Value error(isolate, try_catch.Exception());
+                std::cout << "Can not compile script " << name << " for the reactor: " << std::string(*error, error.length()) << std::endl;
+                return false;
+            }
+        }
+
+        v8::Local<v8::Value> function_val;
+        if (!local_ctx->Global()->Get(local_ctx, v8::String::NewFromUtf8Literal(isolate, "user_script")).ToLocal(&function_val) || !function_val->IsFunction()) {
+            std::cout << "Script " << name << " has no user_script function" << std::endl;
+            return false;
+        }
+
+        auto& script = scripts[name];
+        script.context.Reset(isolate, local_ctx);
+        script.function.Reset(isolate, function_val.As<v8::Function>());
+        script.budget = budget;
+        return true;
+    }
+
+    void remove_script(const std::string& name) {
+        scripts.erase(name);
+    }
+
+    bool has_script(const std::string& name) const {
+        return scripts.contains(name);
+    }
+
+    /// a failed run may have changed @c data
+    run_result run(const std::string& name, std::span<char> data) {
+        auto it = scripts.find(name);
+        if (it == scripts.end()) {
+            return run_result::failed;
+        }
+        auto& script = it->second;
+
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        v8::TryCatch try_catch(isolate);
+        v8::Local<v8::Context> local_ctx = script.context.Get(isolate);
+        v8::Context::Scope context_scope(local_ctx);
+
+        auto store = v8::ArrayBuffer::NewBackingStore(data.data(), data.size(), v8::BackingStore::EmptyDeleter, nullptr);
+        v8::Local<v8::Value> argv[1] = { v8::ArrayBuffer::New(isolate, std::move(store)) };
+
+        termination = run_result::succeeded;
+        start_run(script.budget);
+        v8::Local<v8::Value> result;
+        bool succeeded = script.function.Get(isolate)->Call(local_ctx, local_ctx->Global(), 1, argv).ToLocal(&result);
+        deadline_ns.store(0, std::memory_order_relaxed);
+        bool terminated = try_catch.HasTerminated();
+        if (terminated) {
+            isolate->CancelTerminateExecution();
+        }
+
+        // foreground tasks V8 posted, e.g. finalizing a GC. the reactor is
+        // the only thread using the isolate, it stands in for the Locker.
+        if (auto* platform = seastar_v8_platform::current()) {
+            platform->pump_message_loop(isolate);
+        }
+
+        if (terminated) {
+            return termination;
+        }
+        if (!succeeded || result->IsPromise()) {
+            return run_result::failed;
+        }
+        return run_result::succeeded;
+    }
+
+private:
+    struct script_t {
+        v8::Global<v8::Context> context;
+        v8::Global<v8::Function> function;
+        std::chrono::microseconds budget;
+    };
+
+    static int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // under ticker_mutex, so a parking ticker either sees the deadline or is woken
+    void start_run(std::chrono::microseconds budget) {
+        std::lock_guard lock{ticker_mutex};
+        deadline_ns.store(now_ns() + std::chrono::nanoseconds(budget).count(), std::memory_order_relaxed);
+        if (ticker_parked) {
+            ticker_cond.notify_one();
+        }
+    }
+
+    // runs on the reactor thread, inside the script
+    static void on_interrupt(v8::Isolate* isolate, void* data) {
+        auto* engine = static_cast<reactor_engine*>(data);
+        auto deadline = engine->deadline_ns.load(std::memory_order_relaxed);
+        if (deadline == 0 || engine->termination != run_result::succeeded) {
+            return;
+        }
+        if (now_ns() >= deadline) {
+            engine->termination = run_result::over_budget;
+        } else if (seastar::need_preempt()) {
+            engine->termination = run_result::preempted;
+        } else {
+            return;
+        }
+        isolate->TerminateExecution();
+    }
+
+    // parks after a while without runs, so an idle shard does not poll
+    void ticker_loop() {
+        constexpr int idle_ticks_before_parking = 1000;
+        int idle_ticks = 0;
+        while (!stopping.load(std::memory_order_relaxed)) {
+            if (deadline_ns.load(std::memory_order_relaxed) != 0) {
+                idle_ticks = 0;
+                isolate->RequestInterrupt(on_interrupt, this);
+            } else if (++idle_ticks >= idle_ticks_before_parking) {
+                std::unique_lock lock{ticker_mutex};
+                ticker_parked = true;
+                ticker_cond.wait(lock, [this]{
+                    return stopping.load(std::memory_order_relaxed) || deadline_ns.load(std::memory_order_relaxed) != 0;
+                });
+                ticker_parked = false;
+                idle_ticks = 0;
+                continue;
+            }
+            std::this_thread::sleep_for(tick);
+        }
+    }
+
+    const std::chrono::microseconds tick;
+    v8::Isolate* isolate = nullptr;
+    std::unordered_map<std::string, script_t> scripts;
+
+    // steady clock deadline of the active run, 0 between runs
+    std::atomic<int64_t> deadline_ns{0};
+    // why the interrupt terminated the active run, only used by the reactor thread
+    run_result termination = run_result::succeeded;
+
+    std::thread ticker;
+    std::mutex ticker_mutex;
+    std::condition_variable ticker_cond;
+    // under ticker_mutex
+    bool ticker_parked = false;
+    std::atomic<bool> stopping{false};
+};
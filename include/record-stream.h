@@ -0,0 +1,143 @@
+#pragma once
+
+#include "seastar/core/iostream.hh"
+#include "seastar/core/loop.hh"
+#include "seastar/core/temporary_buffer.hh"
+
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+/// how records are delimited in a stream processed by storage_t::process_stream
+enum class record_framing {
+    // records end with '\n', which is not part of the record
+    newline,
+    // every record is preceded by its size as a little-endian uint32
+    length_prefixed,
+};
+
+struct stream_options {
+    record_framing framing = record_framing::newline;
+    // a batch is dispatched to a worker once it has this many records or bytes
+    size_t batch_records = 1024;
+    size_t batch_bytes = 1 << 20;
+    // bytes of records read but not written yet, reading waits above it
+    size_t max_in_flight_bytes = 16 << 20;
+    size_t max_record_size = 16 << 20;
+};
+
+struct stream_stats {
+    uint64_t records_in = 0;
+    uint64_t records_out = 0;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t batches = 0;
+    // false if a batch failed and the rest of the stream was not processed
+    bool succeeded = true;
+};
+
+/// splits an input_stream into records. records of the newline framing share
+/// the buffers of the stream unless they span several of them.
+class record_reader {
+public:
+    record_reader(seastar::input_stream<char>& in_, record_framing framing_, size_t max_record_size_)
+    : in(in_), framing(framing_), max_record_size(max_record_size_) {}
+
+    /// the next record, or nothing at the end of the stream
+    seastar::future<std::optional<seastar::temporary_buffer<char>>> next() {
+        if (framing == record_framing::length_prefixed) {
+            return next_length_prefixed();
+        }
+        return next_line();
+    }
+
+private:
+    using record_t = std::optional<seastar::temporary_buffer<char>>;
+
+    seastar::future<record_t> next_line() {
+        return seastar::repeat_until_value([this]{
+            if (!chunk.empty()) {
+                auto* end = static_cast<const char*>(std::memchr(chunk.get(), '\n', chunk.size()));
+                if (end) {
+                    size_t size = end - chunk.get();
+                    seastar::temporary_buffer<char> record;
+                    if (partial.empty()) {
+                        record = chunk.share(0, size);
+                    } else {
+                        partial.append(chunk.get(), size);
+                        record = seastar::temporary_buffer<char>(partial.data(), partial.size());
+                        partial.clear();
+                    }
+                    chunk.trim_front(size + 1);
+                    return seastar::make_ready_future<std::optional<record_t>>(record_t(std::move(record)));
+                }
+
+                partial.append(chunk.get(), chunk.size());
+                chunk = {};
+                if (partial.size() > max_record_size) {
+                    return seastar::make_exception_future<std::optional<record_t>>(std::runtime_error("record exceeds max_record_size"));
+                }
+            }
+
+            return in.read().then([this](seastar::temporary_buffer<char> buf){
+                if (!buf.empty()) {
+                    chunk = std::move(buf);
+                    return std::optional<record_t>();
+                }
+                // the last record may miss its newline
+                if (partial.empty()) {
+                    return std::optional<record_t>(record_t());
+                }
+                seastar::temporary_buffer<char> record(partial.data(), partial.size());
+                partial.clear();
+                return std::optional<record_t>(record_t(std::move(record)));
+            });
+        });
+    }
+
+    seastar::future<record_t> next_length_prefixed() {
+        return in.read_exactly(sizeof(uint32_t)).then([this](seastar::temporary_buffer<char> header){
+            if (header.empty()) {
+                return seastar::make_ready_future<record_t>();
+            }
+            if (header.size() < sizeof(uint32_t)) {
+                return seastar::make_exception_future<record_t>(std::runtime_error("truncated record header"));
+            }
+
+            auto* bytes = reinterpret_cast<const unsigned char*>(header.get());
+            size_t size = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (uint32_t(bytes[3]) << 24);
+            if (size > max_record_size) {
+                return seastar::make_exception_future<record_t>(std::runtime_error("record exceeds max_record_size"));
+            }
+            return in.read_exactly(size).then([size](seastar::temporary_buffer<char> record){
+                if (record.size() < size) {
+                    return seastar::make_exception_future<record_t>(std::runtime_error("truncated record"));
+                }
+                return seastar::make_ready_future<record_t>(std::move(record));
+            });
+        });
+    }
+
+    seastar::input_stream<char>& in;
+    const record_framing framing;
+    const size_t max_record_size;
+    seastar::temporary_buffer<char> chunk;
+    std::string partial;
+};
+
+/// writes @c record framed the same way record_reader expects it
+inline seastar::future<> write_record(seastar::output_stream<char>& out, record_framing framing, const seastar::temporary_buffer<char>& record) {
+    if (framing == record_framing::newline) {
+        return out.write(record.get(), record.size()).then([&out]{
+            return out.write("\n", 1);
+        });
+    }
+
+    uint32_t size = record.size();
+    char header[sizeof(uint32_t)] = {
+        char(size & 0xff), char((size >> 8) & 0xff), char((size >> 16) & 0xff), char((size >> 24) & 0xff)};
+    return out.write(header, sizeof(header)).then([&out, &record]{
+        return out.write(record.get(), record.size());
+    });
+}
@@ -26,6 +26,11 @@ public:
         return seastar::make_ready_future<>();
     }
 
+    /// a negative @c n takes slots away as their holders unlock them
+    void add_slots(int64_t n) {
+        free_slots.fetch_add(n);
+    }
+
 private:
     std::atomic<int64_t> free_slots;
 };
\ No newline at end of file
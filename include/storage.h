@@ -1,77 +1,1539 @@
 #pragma once
 
+#include "admission-control.h"
+#include "dataset-registry.h"
+#include "engine-profile.h"
+#include "fair-dispatch.h"
+#include "host-functions.h"
+#include "idle-gc.h"
+#include "invocation-capture.h"
+#include "invocation-trace.h"
+#include "kv-store.h"
+#include "memo-cache.h"
 #include "native_thread_pool.h"
+#include "reactor-engine.h"
+#include "record-stream.h"
+#include "struct-binding.h"
 #include "v8-instance.h"
+#include "v8-seastar-platform.h"
+#include "warmup.h"
 
 #include "libplatform/libplatform.h"
 #include "v8.h"
 
+#include "seastar/core/fstream.hh"
+#include "seastar/core/gate.hh"
+#include "seastar/core/loop.hh"
 #include "seastar/core/future.hh"
+#include "seastar/core/memory.hh"
+#include "seastar/core/metrics.hh"
+#include "seastar/core/scheduling.hh"
+#include "seastar/core/shared_ptr.hh"
+#include "seastar/core/sleep.hh"
+#include "seastar/core/with_scheduling_group.hh"
+#include "seastar/core/timer.hh"
 #include "seastar/core/when_all.hh"
 
+#include <algorithm>
+#include <array>
 #include <chrono>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <optional>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 
 class storage_t {
 public:
     storage_t(v::ThreadPool& thread_pool_)
-    : thread_pool(thread_pool_) {}
+    : thread_pool(thread_pool_),
+      fair_dispatch(thread_pool.slots_per_shard()) {
+        thread_pool.add_idle_work(&idle_gc);
+        memory_pressure_timer.set_callback([this]{
+            check_memory_pressure();
+        });
+        memory_measurement_timer.set_callback([this]{
+            measure_shared_memory();
+        });
+        set_memory_measurement_period(std::chrono::seconds(10));
+        set_idle_gc_policy(idle_gc_policy{});
+        kv_store::set_local(&env.kv);
+        register_kv_host_functions();
+        setup_metrics();
+    }
+
+    ~storage_t() {
+        kv_store::set_local(nullptr);
+        thread_pool.remove_idle_work(&idle_gc);
+    }
+
+    /**
+     * loads the file at @c path as the dataset @c name shared by the isolates
+     * of all shards, replacing its previous version. see dataset_registry.
+     */
+    seastar::future<bool> load_dataset(const std::string& name, const std::string& path, bool use_mmap = true) {
+        return seastar::do_with(std::shared_ptr<dataset_version>(), [this, path, use_mmap](auto& version){
+            return thread_pool.submit([&version, path, use_mmap](){
+                version = dataset_registry::load_file(path, use_mmap);
+            })
+            .then([&version]{
+                return std::move(version);
+            });
+        })
+        .then([name](std::shared_ptr<dataset_version> version){
+            dataset_registry::instance().publish(name, std::move(version));
+            return true;
+        })
+        .handle_exception([path](std::exception_ptr ex){
+            std::cout << "Can not load dataset " << path << ": " << ex << std::endl;
+            return false;
+        });
+    }
+
+    /// scripts holding the dataset keep using it until they drop it
+    bool unload_dataset(const std::string& name) {
+        return dataset_registry::instance().remove(name);
+    }
+
+    /// the shard's key-value state, scripts use it via kv_get and kv_put
+    kv_store& kv_state() {
+        return env.kv;
+    }
 
-    seastar::future<bool> add_new_instance(const std::string& instance_name, const std::string& script_path) {
+    void set_idle_gc_policy(idle_gc_policy policy) {
+        idle_policy = policy;
+        thread_pool.set_idle_budget(idle_policy.idle_time_budget);
+        memory_pressure_timer.rearm_periodic(idle_policy.memory_check_period);
+    }
+
+    /// @param needs_warm_up the storage is not ready until the script was warmed up, see warm_up
+    seastar::future<bool> add_new_instance(const std::string& instance_name, const std::string& script_path, bool needs_warm_up = false) {
         auto engine_it = v8_instances.find(instance_name);
         if (engine_it != v8_instances.end()) {
             std::cout << "Script " << instance_name << "already exists" << std::endl; //TODO: use log system from seastar
             return seastar::make_ready_future<bool>(false);
         }
 
-        return create_instance(instance_name, script_path);
+        if (!needs_warm_up) {
+            return create_instance(instance_name, script_path);
+        }
+        warmups_pending.insert(instance_name);
+        return create_instance(instance_name, script_path)
+        .then([this, instance_name](bool result){
+            if (!result) {
+                warmups_pending.erase(instance_name);
+            }
+            return result;
+        });
+    }
+
+    /// registers a script without creating its isolate. the isolate is
+    /// created by the first run and evicted once it was the least recently
+    /// used one while lazy instances exceed the memory budget.
+    seastar::future<bool> register_instance(const std::string& instance_name, const std::string& script_path) {
+        auto engine_it = v8_instances.find(instance_name);
+        if (engine_it != v8_instances.end()) {
+            std::cout << "Script " << instance_name << "already exists" << std::endl; //TODO: use log system from seastar
+            return seastar::make_ready_future<bool>(false);
+        }
+
+        auto& instance = emplace_instance(instance_name, instance_mode::lazy);
+        return instance.init_lazy_instance(script_path)
+        .then([this, &instance](bool result){
+            if (result) {
+                idle_gc.add_instance(&instance);
+            }
+            return result;
+        });
+    }
+
+    /// adds a script whose every run gets a fresh context restored from a
+    /// snapshot taken after its top level code, so no global state leaks
+    /// between requests
+    seastar::future<bool> add_fresh_context_instance(const std::string& instance_name, const std::string& script_path) {
+        auto engine_it = v8_instances.find(instance_name);
+        if (engine_it != v8_instances.end() || shared_scripts.contains(instance_name)) {
+            std::cout << "Script " << instance_name << "already exists" << std::endl;
+            return seastar::make_ready_future<bool>(false);
+        }
+
+        auto& instance = emplace_instance(instance_name, instance_mode::fresh_context);
+        return instance.init_fresh_context_instance(thread_pool, script_path)
+        .then([this, &instance](bool result){
+            if (result) {
+                idle_gc.add_instance(&instance);
+            }
+            return result;
+        });
+    }
+
+    /**
+     * adds a script as a context of the isolate @c group_name, which is created
+     * by its first script. scripts of a group share the isolate's heap and
+     * JIT caches and run one at a time. the group name can be used to profile
+     * the shared isolate.
+     */
+    seastar::future<bool> add_shared_instance(const std::string& group_name, const std::string& instance_name, const std::string& script_path) {
+        if (v8_instances.contains(instance_name) || shared_scripts.contains(instance_name)) {
+            std::cout << "Script " << instance_name << "already exists" << std::endl;
+            return seastar::make_ready_future<bool>(false);
+        }
+
+        auto engine_it = v8_instances.find(group_name);
+        if (engine_it == v8_instances.end()) {
+            auto& group = emplace_instance(group_name, instance_mode::eager);
+            engine_it = v8_instances.find(group_name);
+            shared_groups.insert(group_name);
+            idle_gc.add_instance(&group);
+        } else if (!shared_groups.contains(group_name)) {
+            std::cout << "Script " << group_name << " is not a shared group" << std::endl;
+            return seastar::make_ready_future<bool>(false);
+        }
+
+        return engine_it->second.add_context(thread_pool, instance_name, script_path)
+        .then([this, group_name, instance_name](bool result){
+            if (result) {
+                shared_scripts.emplace(instance_name, group_name);
+            }
+            return result;
+        });
+    }
+
+    /// bytes of the shared isolate's heap attributed to the script's context
+    /// by the last memory measurement
+    std::optional<size_t> context_memory_usage(const std::string& instance_name) {
+        auto script_it = shared_scripts.find(instance_name);
+        if (script_it == shared_scripts.end()) {
+            return std::nullopt;
+        }
+        return v8_instances.at(script_it->second).context_memory_usage(instance_name);
+    }
+
+    /// starts a memory measurement of every shared isolate, 0 stops them
+    void set_memory_measurement_period(std::chrono::milliseconds period) {
+        memory_measurement_timer.cancel();
+        if (period.count() > 0) {
+            memory_measurement_timer.arm_periodic(period);
+        }
+    }
+
+    /**
+     * makes @c function available to scripts as host_call(name, data). an
+     * async script awaiting host calls releases its worker thread until they
+     * complete on the reactor.
+     */
+    void register_host_function(const std::string& name, host_function_t function) {
+        env.host_functions.insert_or_assign(name, std::move(function));
+    }
+
+    /// declares the binding's JS class in the contexts of instances added afterwards
+    template <typename T, size_t N>
+    void add_struct_binding(const struct_binding<T, N>& binding) {
+        env.script_prelude += binding.js_class();
+    }
+
+    /**
+     * runs the isolate of the instance, or of the shared group, added next
+     * under @c profile, see engine_profile and engine_profiles. instances
+     * already added keep their profile.
+     * @return false if the profile needs V8 flags the process was not initialized with
+     */
+    bool set_engine_profile(const std::string& instance_name, engine_profile profile) {
+        if (!profile.is_compatible(process_v8_flags())) {
+            std::cout << "Engine profile of " << instance_name << " needs V8 flags \"" << profile.process_flags
+                      << "\", the process runs with \"" << process_v8_flags() << "\"" << std::endl;
+            return false;
+        }
+        engine_profiles.insert_or_assign(instance_name, std::move(profile));
+        return true;
+    }
+
+    /// @param budget_bytes heap size of lazy instances above which idle ones are evicted
+    void set_lazy_memory_budget(size_t budget_bytes) {
+        lazy_memory_budget = budget_bytes;
+        evict_lazy_instances();
+    }
+
+    /**
+     * caches results of the script, which has to be a pure function of its
+     * input: runs of an input seen before copy the bytes its earlier run left
+     * in the buffer without dispatching to the pool. only runs which
+     * completed without throwing are cached. the cache belongs to the shard,
+     * so inputs routed to one shard share it.
+     *
+     * @param max_bytes memory of the cached inputs and results
+     */
+    void enable_memoization(const std::string& instance_name, size_t max_bytes) {
+        memo_caches.insert_or_assign(instance_name, memo_cache(max_bytes));
+    }
+
+    void disable_memoization(const std::string& instance_name) {
+        memo_caches.erase(instance_name);
+    }
+
+    /**
+     * bounds the runs of the script this shard accepts, see
+     * admission_controller. a run beyond the limits fails with
+     * overloaded_error without being dispatched. runs waiting under the
+     * previous limits keep them. limits with a max_concurrency of 0 throw
+     * std::invalid_argument.
+     */
+    void set_admission_limits(const std::string& instance_name, admission_limits limits) {
+        auto it = admission_controllers.find(instance_name);
+        if (it != admission_controllers.end()) {
+            it->second->set_limits(limits);
+            return;
+        }
+        admission_controllers.emplace(instance_name, seastar::make_lw_shared<admission_controller>(instance_name, limits));
+    }
+
+    /**
+     * makes the script or pipeline a part of @c tenant, whose runs share its
+     * shares of the shard's worker time. a script or pipeline not set is a
+     * tenant of its own, named after it.
+     */
+    void set_tenant(const std::string& name, const std::string& tenant) {
+        script_tenants.insert_or_assign(name, tenant);
+    }
+
+    /**
+     * weight of the tenant in the division of the shard's worker time
+     * between the tenants waiting for it, see fair_dispatcher. tenants have
+     * fair_dispatcher::default_shares until it is set. runs in a scheduling
+     * group weigh the product of the tenant's and the group's shares.
+     */
+    void set_tenant_shares(const std::string& tenant, uint32_t shares) {
+        tenant_shares.insert_or_assign(tenant, shares);
+        fair_dispatch.set_shares(tenant, shares);
+    }
+
+    /// with @c fair false the shard's worker time goes to runs in the order they arrived
+    void set_fair_dispatch(bool fair) {
+        fair_dispatch.set_fair(fair);
+    }
+
+    /**
+     * runs the script on the reactor thread, without leaving it for the
+     * pool, as long as a run completes within @c budget. see reactor_engine.
+     * a run exceeding the budget or failing there is run on the pool from its
+     * original input, so the script has to be added as an instance as well.
+     * a script failing in the reactor, e.g. by using the host API, or
+     * exceeding its budget max_in_reactor_overruns times in a row runs on
+     * the pool only from then on.
+     */
+    seastar::future<bool> enable_in_reactor(const std::string& instance_name, const std::string& script_path, std::chrono::microseconds budget = std::chrono::microseconds(50)) {
+        return seastar::with_file(seastar::open_file_dma(script_path, seastar::open_flags::ro), [](seastar::file f){
+            return f.size()
+            .then([f](size_t size) mutable {
+                return f.dma_read<char>(0, size);
+            });
+        })
+        .then([this, instance_name, budget](seastar::temporary_buffer<char> source){
+            if (!in_reactor) {
+                in_reactor = std::make_unique<reactor_engine>();
+            }
+            in_reactor_overruns.erase(instance_name);
+            return in_reactor->add_script(instance_name, std::string_view(source.get(), source.size()), env.script_prelude, budget);
+        })
+        .handle_exception([script_path](std::exception_ptr ex){
+            std::cout << "Can not read script " << script_path << ": " << ex << std::endl;
+            return false;
+        });
+    }
+
+    void disable_in_reactor(const std::string& instance_name) {
+        if (in_reactor) {
+            in_reactor->remove_script(instance_name);
+        }
+    }
+
+    /**
+     * runs the script over @c corpus until it is warm, see warmup_tracker, so
+     * the requests following a deploy do not pay for the interpreter and the
+     * tier up. the runs skip capture, memoization, admission control and fair
+     * dispatch. the runs go to the pool even if the script is enabled on the
+     * reactor. the storage is not ready while a warmup runs, see is_ready.
+     *
+     * @param corpus sample inputs, made by warmup_options::synthetic_input if empty
+     */
+    seastar::future<warmup_result> warm_up(const std::string& instance_name, std::vector<std::string> corpus, warmup_options options = {}) {
+        if (!v8_instances.contains(instance_name) && !shared_scripts.contains(instance_name)) {
+            std::cout << "Can not find script " << instance_name << std::endl;
+            return seastar::make_ready_future<warmup_result>();
+        }
+        if (corpus.empty() && !options.synthetic_input) {
+            corpus.emplace_back(options.synthetic_input_size, '\0');
+        }
+
+        warmups_running[instance_name]++;
+        auto synthetic_input = options.synthetic_input;
+        return seastar::do_with(std::move(corpus), std::move(synthetic_input), warmup_tracker(options), std::string(), size_t(0),
+            [this, instance_name](auto& corpus, auto& synthetic_input, auto& tracker, auto& input, size_t& next){
+            return seastar::repeat([this, &instance_name, &corpus, &synthetic_input, &tracker, &input, &next]{
+                // the script may change its input, every run gets a fresh copy
+                input = corpus.empty() ? synthetic_input(next) : corpus[next % corpus.size()];
+                next++;
+                auto start = std::chrono::steady_clock::now();
+                // the isolate of the pool, a run on the reactor would not warm it up
+                return dispatch_instance(instance_name, std::span<char>(input.data(), input.size()), nullptr, nullptr)
+                .then([&tracker, start](bool){
+                    tracker.record(std::chrono::steady_clock::now() - start);
+                    if (!tracker.round_complete()) {
+                        return seastar::stop_iteration::no;
+                    }
+                    return tracker.finish_round() ? seastar::stop_iteration::yes : seastar::stop_iteration::no;
+                });
+            })
+            .then([&tracker]{
+                return tracker.outcome();
+            });
+        })
+        .then([instance_name](warmup_result result){
+            auto us = [](std::chrono::nanoseconds value){
+                return std::chrono::duration_cast<std::chrono::microseconds>(value).count();
+            };
+            std::cout << "Script " << instance_name << (result.converged ? " is warm" : " did not converge") << " after " << result.runs
+                      << " runs, median latency " << us(result.first_median) << " us -> " << us(result.last_median) << " us" << std::endl;
+            return result;
+        })
+        .finally([this, instance_name]{
+            if (--warmups_running[instance_name] == 0) {
+                warmups_running.erase(instance_name);
+            }
+            warmups_pending.erase(instance_name);
+        });
+    }
+
+    /// false while a warmup runs or a script added with needs_warm_up waits
+    /// for one, a health check should keep traffic away then
+    bool is_ready() const {
+        return warmups_running.empty() && warmups_pending.empty();
+    }
+
+    /// scripts being or waiting to be warmed up
+    std::vector<std::string> warming_scripts() const {
+        std::vector<std::string> names;
+        for (const auto& [name, count] : warmups_running) {
+            names.push_back(name);
+        }
+        for (const auto& name : warmups_pending) {
+            if (!warmups_running.contains(name)) {
+                names.push_back(name);
+            }
+        }
+        return names;
+    }
+
+    /// runs admitted or waiting before keep their slots and deadlines
+    void remove_admission_limits(const std::string& instance_name) {
+        auto it = admission_controllers.find(instance_name);
+        if (it != admission_controllers.end()) {
+            retired_admission_counters += it->second->counters();
+            admission_controllers.erase(it);
+        }
+    }
+
+    /**
+     * records every following run_instance call to a capture file at @c path,
+     * see invocation_capture.h. replaces a running capture.
+     */
+    seastar::future<> start_capture(std::string path) {
+        return stop_capture().then([this, path = std::move(path)]{
+            return invocation_recorder::open(path);
+        })
+        .then([this](std::unique_ptr<invocation_recorder> recorder){
+            capture = std::move(recorder);
+        });
+    }
+
+    /// waits for evictions, memory measurements and context removals on the
+    /// workers and stops the capture, call it before the storage is destroyed
+    seastar::future<> stop() {
+        memory_pressure_timer.cancel();
+        memory_measurement_timer.cancel();
+        return background_work.close().then([this]{
+            return stop_capture();
+        });
+    }
+
+    seastar::future<> stop_capture() {
+        if (!capture) {
+            return seastar::make_ready_future<>();
+        }
+        return seastar::do_with(std::move(capture), [](auto& recorder){
+            return recorder->close().then([&recorder]{
+                std::cout << "Captured " << recorder->recorded() << " invocations, dropped " << recorder->dropped() << std::endl;
+            });
+        });
     }
 
     seastar::future<bool> run_instance(std::string instance_name, std::span<char> data) {
+        auto group_it = script_groups.find(instance_name);
+        if (group_it != script_groups.end()) {
+            return run_instance(std::move(instance_name), data, group_it->second);
+        }
+        return run_in_group(std::move(instance_name), data, std::nullopt);
+    }
+
+    /**
+     * runs the script on behalf of @c group: the reactor side of the call
+     * runs in the group, the worker's CPU time is accounted to the group and
+     * in the fair dispatcher the runs of the script's tenant in the group
+     * queue apart from its runs in other groups, by the shares of both.
+     */
+    seastar::future<bool> run_instance(std::string instance_name, std::span<char> data, seastar::scheduling_group group) {
+        return seastar::with_scheduling_group(group, [this, instance_name = std::move(instance_name), data, group]() mutable {
+            return run_in_group(std::move(instance_name), data, group);
+        });
+    }
+
+    /**
+     * makes @c group known to the storage with @c shares, which are set as
+     * the group's CPU shares on the reactor and used as the weight of its
+     * runs in the fair dispatcher
+     */
+    void add_scheduling_group(seastar::scheduling_group group, uint32_t shares) {
+        group.set_shares(shares);
+        usage_of(group).shares = shares;
+    }
+
+    /// runs of the script without a group of their own run in @c group
+    void set_scheduling_group(const std::string& instance_name, seastar::scheduling_group group) {
+        script_groups.insert_or_assign(instance_name, group);
+    }
+
+    void remove_scheduling_group(const std::string& instance_name) {
+        script_groups.erase(instance_name);
+    }
+
+    /**
+     * traces a share of the following runs: when a run arrived, waited for
+     * its instance and the pool, ran on a worker and completed. the last
+     * traces of the shard are kept, see trace_json.
+     *
+     * @param rate share of runs to trace, 0 disables tracing
+     */
+    void set_trace_sampling_rate(double rate) {
+        traces.set_sampling_rate(rate);
+    }
+
+    /// traces of the shard in the Chrome trace event format, opened by
+    /// chrome://tracing and ui.perfetto.dev
+    std::string trace_json() const {
+        return traces.chrome_trace_json(seastar::this_shard_id());
+    }
+
+    /**
+     * samples the script's isolate for @c duration and returns the profile in
+     * the collapsed stack format, ready for flamegraph.pl
+     * @return nullopt if there is no such script or it is already profiled
+     */
+    seastar::future<std::optional<std::string>> profile_cpu(std::string instance_name, std::chrono::milliseconds duration, std::chrono::microseconds sampling_interval) {
+        auto engine_it = v8_instances.find(instance_name);
+        if (engine_it == v8_instances.end()) {
+            std::cout << "Can not find script " << instance_name << std::endl;
+            return seastar::make_ready_future<std::optional<std::string>>(std::nullopt);
+        }
+
+        return seastar::with_gate(engine_it->second.pending_work, [this, &instance = engine_it->second, sampling_interval]{
+            return instance.start_cpu_profiling(thread_pool, sampling_interval);
+        })
+        .then([this, instance_name, duration](bool started){
+            if (!started) {
+                return seastar::make_ready_future<std::optional<std::string>>(std::nullopt);
+            }
+
+            return seastar::sleep(duration)
+            .then([this, instance_name]{
+                // the script could have been deleted while we slept
+                auto engine_it = v8_instances.find(instance_name);
+                if (engine_it == v8_instances.end()) {
+                    return seastar::make_ready_future<std::optional<std::string>>(std::nullopt);
+                }
+
+                return seastar::with_gate(engine_it->second.pending_work, [this, &instance = engine_it->second]{
+                    return seastar::do_with(collapsed_stacks_t{}, [this, &instance](auto& stacks){
+                        return instance.stop_cpu_profiling(thread_pool, stacks)
+                        .then([&stacks](bool stopped){
+                            if (!stopped) {
+                                return std::optional<std::string>{};
+                            }
+                            return std::optional<std::string>{format_collapsed_stacks(stacks)};
+                        });
+                    });
+                });
+            });
+        });
+    }
+
+    /**
+     * starts sampling allocations of the script's isolate
+     * @param sample_interval average number of bytes between samples
+     * @param stack_depth maximum depth of the recorded stacks
+     */
+    seastar::future<bool> start_heap_sampling(const std::string& instance_name, uint64_t sample_interval = 512 * 1024, int stack_depth = 16) {
+        auto engine_it = v8_instances.find(instance_name);
+        if (engine_it == v8_instances.end()) {
+            std::cout << "Can not find script " << instance_name << std::endl;
+            return seastar::make_ready_future<bool>(false);
+        }
+
+        return seastar::with_gate(engine_it->second.pending_work, [this, &instance = engine_it->second, sample_interval, stack_depth]{
+            return instance.start_heap_sampling(thread_pool, sample_interval, stack_depth);
+        });
+    }
+
+    /// stops sampling and returns the live sampled bytes per stack in the collapsed stack format
+    seastar::future<std::optional<std::string>> stop_heap_sampling(const std::string& instance_name) {
+        auto engine_it = v8_instances.find(instance_name);
+        if (engine_it == v8_instances.end()) {
+            std::cout << "Can not find script " << instance_name << std::endl;
+            return seastar::make_ready_future<std::optional<std::string>>(std::nullopt);
+        }
+
+        return seastar::with_gate(engine_it->second.pending_work, [this, &instance = engine_it->second]{
+            return seastar::do_with(collapsed_stacks_t{}, [this, &instance](auto& stacks){
+                return instance.stop_heap_sampling(thread_pool, stacks)
+                .then([&stacks](bool stopped){
+                    if (!stopped) {
+                        return std::optional<std::string>{};
+                    }
+                    return std::optional<std::string>{format_collapsed_stacks(stacks)};
+                });
+            });
+        });
+    }
+
+    /// writes a heap snapshot of the script's isolate in the .heapsnapshot
+    /// format (readable by Chrome DevTools) to @c snapshot_path
+    seastar::future<bool> write_heap_snapshot(const std::string& instance_name, const std::string& snapshot_path) {
         auto engine_it = v8_instances.find(instance_name);
         if (engine_it == v8_instances.end()) {
             std::cout << "Can not find script " << instance_name << std::endl;
             return seastar::make_ready_future<bool>(false);
         }
 
-        return engine_it->second.run_instance(thread_pool, 1.0, data);
+        auto flags = seastar::open_flags::wo | seastar::open_flags::create | seastar::open_flags::truncate;
+        return seastar::with_gate(engine_it->second.pending_work, [this, &instance = engine_it->second, snapshot_path, flags]{
+            return seastar::open_file_dma(snapshot_path, flags)
+            .then([](seastar::file f){
+                return seastar::make_file_output_stream(std::move(f));
+            })
+            .then([this, &instance](seastar::output_stream<char> out){
+                return seastar::do_with(std::move(out), [this, &instance](auto& out){
+                    return instance.write_heap_snapshot(thread_pool, out)
+                    .finally([&out]{
+                        return out.close();
+                    });
+                });
+            });
+        })
+        .then([]{
+            return true;
+        })
+        .handle_exception([snapshot_path](std::exception_ptr ex){
+            std::cout << "Can not write heap snapshot to " << snapshot_path << ": " << ex << std::endl;
+            return false;
+        });
+    }
+
+    /**
+     * runs the script with the JSON document @c input as its argument.
+     *
+     * @return the JSON of the value the script returned, empty for undefined,
+     *         or nothing if the run failed
+     */
+    seastar::future<std::optional<seastar::temporary_buffer<char>>> run_json(const std::string& instance_name, std::string_view input, json_parsing parsing = json_parsing::eager) {
+        using result_t = std::optional<seastar::temporary_buffer<char>>;
+        auto engine_it = v8_instances.find(instance_name);
+        if (engine_it == v8_instances.end() || shared_groups.contains(instance_name)) {
+            std::cout << "Can not find script " << instance_name << std::endl;
+            return seastar::make_ready_future<result_t>();
+        }
+
+        return fair_dispatch.dispatch(tenant_of(instance_name), instance_name, [this, instance_name, input, parsing]{
+            // the script could have been deleted while the run waited
+            auto engine_it = v8_instances.find(instance_name);
+            if (engine_it == v8_instances.end()) {
+                return seastar::make_ready_future<result_t>();
+            }
+
+            auto& instance = engine_it->second;
+            if (instance.is_lazy()) {
+                instance.lru_link.unlink();
+                lazy_lru.push_back(instance);
+            }
+            return seastar::with_gate(instance.pending_work, [this, &instance, input, parsing]{
+                return seastar::do_with(seastar::temporary_buffer<char>(), [this, &instance, input, parsing](auto& output){
+                    return instance.run_json(thread_pool, 1.0, input, parsing, output)
+                    .then([this, &instance, &output](bool succeeded){
+                        if (instance.is_lazy()) {
+                            evict_lazy_instances();
+                        }
+                        return succeeded ? result_t(std::move(output)) : result_t();
+                    });
+                });
+            });
+        });
+    }
+
+    /**
+     * declares a chain of scripts which run_pipeline executes in order over
+     * the same buffer. stages are looked up by name on every run, shared
+     * scripts can not be stages.
+     */
+    bool add_pipeline(const std::string& pipeline_name, std::vector<std::string> stages) {
+        if (pipelines.contains(pipeline_name) || stages.empty()) {
+            std::cout << "Can not add pipeline " << pipeline_name << std::endl;
+            return false;
+        }
+        for (const auto& stage : stages) {
+            if (!v8_instances.contains(stage) || shared_groups.contains(stage)) {
+                std::cout << "Can not add pipeline " << pipeline_name << ": unknown script " << stage << std::endl;
+                return false;
+            }
+        }
+
+        pipelines.emplace(pipeline_name, std::move(stages));
+        return true;
+    }
+
+    bool remove_pipeline(const std::string& pipeline_name) {
+        if (!pipelines.erase(pipeline_name)) {
+            return false;
+        }
+        remove_tenant_of(pipeline_name);
+        return true;
+    }
+
+    /// @return true if every stage of the pipeline succeeded
+    seastar::future<bool> run_pipeline(const std::string& pipeline_name, std::span<char> data) {
+        // a pipeline is dispatched as one run, its stages run in a row on the worker
+        return fair_dispatch.dispatch(tenant_of(pipeline_name), pipeline_name, [this, pipeline_name, data]{
+            return run_pipeline_stages(pipeline_name, data);
+        });
+    }
+
+    /**
+     * feeds the records of @c in to the script in batches and writes the
+     * records it returns to @c out with the same framing, see run_batch.
+     * reading waits while max_in_flight_bytes of records are not written yet.
+     * @c out is flushed but not closed.
+     */
+    seastar::future<stream_stats> process_stream(const std::string& instance_name, seastar::input_stream<char>& in, seastar::output_stream<char>& out, stream_options options = {}) {
+        auto engine_it = v8_instances.find(instance_name);
+        if (engine_it == v8_instances.end() || shared_groups.contains(instance_name)) {
+            std::cout << "Can not find script " << instance_name << std::endl;
+            return seastar::make_ready_future<stream_stats>(stream_stats{.succeeded = false});
+        }
+
+        auto& instance = engine_it->second;
+        if (instance.is_lazy()) {
+            instance.lru_link.unlink();
+            lazy_lru.push_back(instance);
+        }
+
+        // a stream can run for minutes, deleting the script waits for it
+        return seastar::with_gate(instance.pending_work, [this, &instance, &in, &out, options, instance_name]{
+            return seastar::do_with(std::make_unique<stream_state>(in, options), std::string(instance_name), [this, &instance, &out](auto& state, const std::string& instance_name){
+                return seastar::repeat([this, &instance_name, &instance, &out, &state]{
+                    if (!state->stats.succeeded) {
+                        return seastar::make_ready_future<seastar::stop_iteration>(seastar::stop_iteration::yes);
+                    }
+
+                    return read_stream_batch(*state).then([this, &instance_name, &instance, &out, &state](stream_batch batch){
+                        if (batch.records.empty()) {
+                            return seastar::make_ready_future<seastar::stop_iteration>(seastar::stop_iteration::yes);
+                        }
+
+                        auto batch_bytes = std::min(batch.bytes, state->options.max_in_flight_bytes);
+                        return seastar::get_units(state->in_flight, batch_bytes)
+                        .then([this, &instance_name, &instance, &out, &state, batch = std::move(batch)](auto units) mutable {
+                            // the next batch is read while this one runs, outputs are written in order
+                            auto processed = process_stream_batch(instance_name, instance, std::move(batch));
+                            state->written = state->written.then([&out, &state, processed = std::move(processed), units = std::move(units)]() mutable {
+                                return std::move(processed).then([&out, &state](stream_batch batch){
+                                    return write_stream_batch(out, *state, std::move(batch));
+                                });
+                            });
+                            return seastar::stop_iteration::no;
+                        });
+                    });
+                })
+                .handle_exception([&state](std::exception_ptr ex){
+                    std::cout << "Can not read stream: " << ex << std::endl;
+                    state->stats.succeeded = false;
+                })
+                .then([&state]{
+                    return std::move(state->written);
+                })
+                .then([&out]{
+                    return out.flush();
+                })
+                .then([this, &instance, &state]{
+                    if (instance.is_lazy()) {
+                        evict_lazy_instances();
+                    }
+                    return state->stats;
+                });
+            });
+        });
     }
 
     bool delete_instance(const std::string& instance_name) {
+        memo_caches.erase(instance_name);
+        warmups_pending.erase(instance_name);
+        remove_admission_limits(instance_name);
+        remove_tenant_of(instance_name);
+        auto script_it = shared_scripts.find(instance_name);
+        if (script_it != shared_scripts.end()) {
+            // the context is released once running calls of the group finish
+            if (!background_work.is_closed()) {
+                (void)seastar::with_gate(background_work, [this, &group = v8_instances.at(script_it->second), instance_name]{
+                    return seastar::with_gate(group.pending_work, [this, &group, instance_name]{
+                        return group.remove_context(thread_pool, instance_name);
+                    });
+                });
+            }
+            shared_scripts.erase(script_it);
+            return true;
+        }
+
         auto engine_it = v8_instances.find(instance_name);
         if (engine_it == v8_instances.end()) {
             std::cout << "Can not find script " << instance_name << std::endl;
             return false;
         }
 
-        v8_instances.erase(engine_it);
+        if (shared_groups.erase(instance_name)) {
+            std::erase_if(shared_scripts, [&instance_name](const auto& script){
+                return script.second == instance_name;
+            });
+        }
+        idle_gc.remove_instance(&engine_it->second);
+        engine_it->second.lru_link.unlink();
+        // runs, streams and evictions started before keep the instance until they finish
+        auto node = v8_instances.extract(engine_it);
+        if (background_work.is_closed()) {
+            (void)node.mapped().pending_work.close().finally([node = std::move(node)]{});
+        } else {
+            (void)seastar::with_gate(background_work, [node = std::move(node)]() mutable {
+                return node.mapped().pending_work.close().finally([node = std::move(node)]{});
+            });
+        }
         return true;
     }
 
-    static std::unique_ptr<v8::Platform> init_v8() {
-        auto platform = v8::platform::NewDefaultPlatform();
+    /**
+     * @param n_background_threads the number of threads for V8 background tasks,
+     *                             at least 1, see seastar_v8_platform
+     * @param cpu_id the CPU core of the native thread pool, background threads
+     *               are pinned to it to stay off the reactor cores
+     */
+    /// @param v8_flags the process configuration of the engine profiles, see engine_profile
+    static std::unique_ptr<v8::Platform> init_v8(size_t n_background_threads, unsigned cpu_id, const std::string& v8_flags = "") {
+        process_v8_flags() = v8_flags;
+        if (!v8_flags.empty()) {
+            v8::V8::SetFlagsFromString(v8_flags.c_str(), v8_flags.size());
+        }
+        auto platform = std::make_unique<seastar_v8_platform>(n_background_threads, cpu_id);
         v8::V8::InitializePlatform(platform.get());
         v8::V8::Initialize();
         return platform;
     }
 
+    /// the flags V8 was initialized with
+    static std::string& process_v8_flags() {
+        static std::string flags;
+        return flags;
+    }
+
     static void shutdown_v8() {
+        dataset_registry::instance().clear();
         v8::V8::Dispose();
         v8::V8::ShutdownPlatform();
     }
 
 private:
+    seastar::future<bool> run_in_group(std::string instance_name, std::span<char> data, std::optional<seastar::scheduling_group> group) {
+        if (capture) {
+            capture->record(instance_name, data);
+        }
+        auto memo_it = memo_caches.find(instance_name);
+        if (memo_it == memo_caches.end()) {
+            return admit_instance(std::move(instance_name), data, group);
+        }
+        if (memo_it->second.lookup(data)) {
+            return seastar::make_ready_future<bool>(false);
+        }
+
+        std::string input(data.data(), data.size());
+        auto succeeded = std::make_unique<bool>(false);
+        auto* succeeded_ptr = succeeded.get();
+        return admit_instance(instance_name, data, group, succeeded_ptr)
+        .then([this, instance_name, input = std::move(input), data, succeeded = std::move(succeeded)](bool is_canceled){
+            auto memo_it = memo_caches.find(instance_name);
+            if (*succeeded && memo_it != memo_caches.end()) {
+                memo_it->second.insert(input, data);
+            }
+            return is_canceled;
+        });
+    }
+
+    /// @param succeeded set to whether the script completed without throwing, if any
+    seastar::future<bool> admit_instance(std::string instance_name, std::span<char> data, std::optional<seastar::scheduling_group> group, bool* succeeded = nullptr) {
+        if (in_reactor && in_reactor->has_script(instance_name) && run_in_reactor(instance_name, data)) {
+            if (succeeded) {
+                *succeeded = true;
+            }
+            return seastar::make_ready_future<bool>(false);
+        }
+
+        auto admission_it = admission_controllers.find(instance_name);
+        if (admission_it == admission_controllers.end()) {
+            return schedule_instance(std::move(instance_name), data, group, succeeded);
+        }
+
+        auto controller = admission_it->second;
+        return controller->admit().then([this, controller, instance_name = std::move(instance_name), data, group, succeeded](seastar::semaphore_units<> units) mutable {
+            auto start = std::chrono::steady_clock::now();
+            return schedule_instance(std::move(instance_name), data, group, succeeded)
+            .finally([controller, start, units = std::move(units)]{
+                controller->completed(std::chrono::steady_clock::now() - start);
+            });
+        });
+    }
+
+    /// @return false if the run has to go to the pool, @c data is restored then
+    bool run_in_reactor(const std::string& instance_name, std::span<char> data) {
+        in_reactor_input.assign(data.data(), data.size());
+        auto result = in_reactor->run(instance_name, data);
+        if (result == reactor_engine::run_result::succeeded) {
+            in_reactor_stats.runs++;
+            in_reactor_overruns.erase(instance_name);
+            return true;
+        }
+
+        std::copy(in_reactor_input.begin(), in_reactor_input.end(), data.begin());
+        in_reactor_stats.fallbacks[static_cast<size_t>(result)]++;
+        if (result == reactor_engine::run_result::failed
+            || (result == reactor_engine::run_result::over_budget && ++in_reactor_overruns[instance_name] >= max_in_reactor_overruns)) {
+            std::cout << "Script " << instance_name << " runs on the pool from now on" << std::endl;
+            in_reactor->remove_script(instance_name);
+            in_reactor_overruns.erase(instance_name);
+            in_reactor_stats.demotions++;
+        }
+        return false;
+    }
+
+    // waits for the script's turn in the shard, see set_tenant_shares
+    seastar::future<bool> schedule_instance(std::string instance_name, std::span<char> data, std::optional<seastar::scheduling_group> group, bool* succeeded) {
+        if (!group) {
+            return fair_dispatch.dispatch(tenant_of(instance_name), instance_name, [this, instance_name, data, succeeded]{
+                return dispatch_instance(instance_name, data, nullptr, succeeded);
+            });
+        }
+
+        auto& usage = usage_of(*group);
+        return fair_dispatch.dispatch(group_tenant(tenant_of(instance_name), *group, usage), instance_name, [this, instance_name, data, &usage, succeeded]{
+            auto cpu_time = std::make_unique<std::chrono::nanoseconds>(0);
+            auto* cpu_time_ptr = cpu_time.get();
+            return dispatch_instance(instance_name, data, cpu_time_ptr, succeeded)
+            .finally([&usage, cpu_time = std::move(cpu_time)]{
+                usage.cpu_time += *cpu_time;
+                usage.runs++;
+            });
+        });
+    }
+
+    /**
+     * @param cpu_time the worker's CPU time of the run is added to it, if any
+     * @param succeeded set to whether the script completed without throwing, if any
+     */
+    seastar::future<bool> dispatch_instance(std::string instance_name, std::span<char> data, std::chrono::nanoseconds* cpu_time, bool* succeeded) {
+        if (!traces.should_sample()) {
+            return route_instance(instance_name, data, v::TaskAccounting{nullptr, cpu_time}, succeeded);
+        }
+
+        auto trace = std::make_unique<invocation_trace>();
+        trace->mark(invocation_trace::arrived);
+        auto* trace_ptr = trace.get();
+        return route_instance(instance_name, data, v::TaskAccounting{trace_ptr, cpu_time}, succeeded)
+        .then([this, instance_name, trace = std::move(trace)](bool is_canceled){
+            trace->mark(invocation_trace::completed);
+            traces.push(instance_name, *trace);
+            return is_canceled;
+        });
+    }
+
+    seastar::future<bool> route_instance(const std::string& instance_name, std::span<char> data, v::TaskAccounting accounting, bool* succeeded) {
+        auto engine_it = v8_instances.find(instance_name);
+        if (engine_it == v8_instances.end()) {
+            auto script_it = shared_scripts.find(instance_name);
+            if (script_it == shared_scripts.end()) {
+                std::cout << "Can not find script " << instance_name << std::endl;
+                return seastar::make_ready_future<bool>(false);
+            }
+            auto& group = v8_instances.at(script_it->second);
+            return seastar::with_gate(group.pending_work, [this, &group, &context_name = script_it->first, data, accounting, succeeded]{
+                return group.run_context(thread_pool, 1.0, context_name, data, accounting, succeeded);
+            });
+        }
+
+        auto& instance = engine_it->second;
+        if (!instance.is_lazy()) {
+            return seastar::with_gate(instance.pending_work, [this, &instance, data, accounting, succeeded]{
+                return instance.run_instance(thread_pool, 1.0, data, accounting, succeeded);
+            });
+        }
+
+        instance.lru_link.unlink();
+        lazy_lru.push_back(instance);
+        // the run finds out whether it is a cold start once it holds the
+        // instance, a run queued behind an eviction is one
+        auto start = std::chrono::steady_clock::now();
+        return seastar::with_gate(instance.pending_work, [this, &instance, data, accounting, succeeded, start]{
+            return seastar::do_with(false, [this, &instance, data, accounting, succeeded, start](bool& cold_start){
+                return instance.run_instance(thread_pool, 1.0, data, accounting, succeeded, &cold_start)
+                .then([this, start, &cold_start](bool result){
+                    if (cold_start) {
+                        lazy_stats.cold_starts++;
+                        lazy_stats.cold_start_time += std::chrono::steady_clock::now() - start;
+                    }
+                    // the heap may have grown past the budget
+                    evict_lazy_instances();
+                    return result;
+                });
+            });
+        });
+    }
+
+    const std::string& tenant_of(const std::string& name) const {
+        auto it = script_tenants.find(name);
+        return it == script_tenants.end() ? name : it->second;
+    }
+
+    // the dispatcher forgets the tenant once no script or pipeline is a part of it
+    void remove_tenant_of(const std::string& name) {
+        auto tenant = tenant_of(name);
+        script_tenants.erase(name);
+        bool in_use = std::any_of(script_tenants.begin(), script_tenants.end(), [&tenant](const auto& entry){
+            return entry.second == tenant;
+        });
+        // a script or pipeline named like the tenant is a part of it unless set otherwise
+        bool named_after = tenant != name && !script_tenants.contains(tenant)
+            && (v8_instances.contains(tenant) || shared_scripts.contains(tenant) || pipelines.contains(tenant));
+        if (!in_use && !named_after) {
+            fair_dispatch.remove_tenant(tenant);
+            for (const auto& [group_name, usage] : group_usages) {
+                fair_dispatch.remove_tenant(group_name + "/" + tenant);
+            }
+            tenant_shares.erase(tenant);
+        }
+    }
+
+    seastar::future<bool> run_pipeline_stages(const std::string& pipeline_name, std::span<char> data) {
+        auto pipeline_it = pipelines.find(pipeline_name);
+        if (pipeline_it == pipelines.end()) {
+            std::cout << "Can not find pipeline " << pipeline_name << std::endl;
+            return seastar::make_ready_future<bool>(false);
+        }
+
+        std::vector<v8_instance*> stages;
+        bool has_lazy_stages = false;
+        for (const auto& stage_name : pipeline_it->second) {
+            auto engine_it = v8_instances.find(stage_name);
+            if (engine_it == v8_instances.end()) {
+                std::cout << "Can not find script " << stage_name << std::endl;
+                return seastar::make_ready_future<bool>(false);
+            }
+
+            auto& instance = engine_it->second;
+            if (instance.is_lazy()) {
+                instance.lru_link.unlink();
+                lazy_lru.push_back(instance);
+                has_lazy_stages = true;
+            }
+            stages.push_back(&instance);
+        }
+
+        // the stages can not be deleted until the pipeline completes
+        for (auto* stage : stages) {
+            stage->pending_work.enter();
+        }
+        auto held = stages;
+        return v8_instance::run_pipeline(thread_pool, 1.0, std::move(stages), data)
+        .finally([held = std::move(held)]{
+            for (auto* stage : held) {
+                stage->pending_work.leave();
+            }
+        })
+        .then([this, has_lazy_stages](bool result){
+            if (has_lazy_stages) {
+                evict_lazy_instances();
+            }
+            return result;
+        });
+    }
+
+    v8_instance& emplace_instance(const std::string& instance_name, instance_mode mode) {
+        auto profile_it = engine_profiles.find(instance_name);
+        auto profile = profile_it == engine_profiles.end() ? engine_profile{} : profile_it->second;
+        auto create_params = profile.create_params();
+
+        auto it = v8_instances.emplace(std::piecewise_construct, std::forward_as_tuple(instance_name), std::forward_as_tuple(std::move(create_params), mode, &env, std::move(profile)));
+        return it.first->second;
+    }
+
     seastar::future<bool> create_instance(const std::string& instance_name, const std::string& script_path) {
-        v8::Isolate::CreateParams create_params;
-        create_params.array_buffer_allocator_shared = std::shared_ptr<v8::ArrayBuffer::Allocator>(v8::ArrayBuffer::Allocator::NewDefaultAllocator());
+        auto& instance = emplace_instance(instance_name, instance_mode::eager);
+        return instance.init_instance(script_path)
+        .then([this, &instance](bool result){
+            if (result) {
+                idle_gc.add_instance(&instance);
+            }
+            return result;
+        });
+    }
+
+    /**
+     * host_call("kv_get", key) resolves with a copy of the value, empty if the
+     * key is missing. host_call("kv_put", record) stores a record made of the
+     * key size as a little-endian uint32, the key and the value. both are
+     * served by the shard owning the key, see kv_store::owner_shard. a call
+     * fails if that shard has no storage, the key would be lost otherwise.
+     */
+    void register_kv_host_functions() {
+        register_host_function("kv_get", [](seastar::temporary_buffer<char> key){
+            auto shard = kv_store::owner_shard(std::string_view(key.get(), key.size()));
+            return seastar::smp::submit_to(shard, [key = std::string(key.get(), key.size())]{
+                auto value = owner_store().get(key);
+                return value ? seastar::temporary_buffer<char>(value->data, value->size) : seastar::temporary_buffer<char>();
+            });
+        });
+        register_host_function("kv_put", [](seastar::temporary_buffer<char> record){
+            if (record.size() < sizeof(uint32_t)) {
+                return seastar::make_exception_future<seastar::temporary_buffer<char>>(std::runtime_error("kv_put record is too short"));
+            }
+            auto* bytes = reinterpret_cast<const unsigned char*>(record.get());
+            size_t key_size = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (uint32_t(bytes[3]) << 24);
+            if (record.size() - sizeof(uint32_t) < key_size) {
+                return seastar::make_exception_future<seastar::temporary_buffer<char>>(std::runtime_error("kv_put key exceeds the record"));
+            }
+
+            std::string key(record.get() + sizeof(uint32_t), key_size);
+            std::string value(record.get() + sizeof(uint32_t) + key_size, record.size() - sizeof(uint32_t) - key_size);
+            auto shard = kv_store::owner_shard(key);
+            return seastar::smp::submit_to(shard, [key = std::move(key), value = std::move(value)]{
+                owner_store().put(key, value);
+                return seastar::temporary_buffer<char>();
+            });
+        });
+    }
+
+    // the store of the shard serving a routed kv call
+    static kv_store& owner_store() {
+        auto* store = kv_store::local();
+        if (!store) {
+            throw std::runtime_error("shard " + std::to_string(seastar::this_shard_id()) + " has no storage for routed kv calls");
+        }
+        return *store;
+    }
+
+    struct stream_state {
+        stream_state(seastar::input_stream<char>& in, stream_options options_)
+        : options(options_), reader(in, options.framing, options.max_record_size) {}
+
+        stream_options options;
+        record_reader reader;
+        stream_stats stats;
+        seastar::semaphore in_flight{options.max_in_flight_bytes};
+        // writes of the dispatched batches, in stream order
+        seastar::future<> written = seastar::make_ready_future<>();
+    };
+
+    struct stream_batch {
+        std::vector<seastar::temporary_buffer<char>> records{};
+        size_t bytes = 0;
+        bool succeeded = true;
+    };
+
+    static seastar::future<stream_batch> read_stream_batch(stream_state& state) {
+        return seastar::do_with(stream_batch{}, [&state](auto& batch){
+            return seastar::repeat([&state, &batch]{
+                if (batch.records.size() >= state.options.batch_records || batch.bytes >= state.options.batch_bytes) {
+                    return seastar::make_ready_future<seastar::stop_iteration>(seastar::stop_iteration::yes);
+                }
+
+                return state.reader.next().then([&state, &batch](std::optional<seastar::temporary_buffer<char>> record){
+                    if (!record) {
+                        return seastar::stop_iteration::yes;
+                    }
+                    state.stats.records_in++;
+                    state.stats.bytes_in += record->size();
+                    batch.bytes += record->size();
+                    batch.records.push_back(std::move(*record));
+                    return seastar::stop_iteration::no;
+                });
+            })
+            .then([&batch]{
+                return std::move(batch);
+            });
+        });
+    }
+
+    /// runs the batch in the script's turn and returns the records the script produced
+    seastar::future<stream_batch> process_stream_batch(const std::string& instance_name, v8_instance& instance, stream_batch batch) {
+        return seastar::do_with(std::move(batch), stream_batch{}, [this, &instance_name, &instance](auto& batch, auto& outputs){
+            return fair_dispatch.dispatch(tenant_of(instance_name), instance_name, [this, &instance, &batch, &outputs]{
+                return instance.run_batch(thread_pool, 1.0, batch.records, outputs.records);
+            })
+            .then([&outputs](bool succeeded){
+                outputs.succeeded = succeeded;
+                return std::move(outputs);
+            });
+        })
+        .handle_exception([](std::exception_ptr ex){
+            std::cout << "Can not process stream batch: " << ex << std::endl;
+            return stream_batch{.succeeded = false};
+        });
+    }
+
+    static seastar::future<> write_stream_batch(seastar::output_stream<char>& out, stream_state& state, stream_batch batch) {
+        if (!state.stats.succeeded) {
+            return seastar::make_ready_future<>();
+        }
+        if (!batch.succeeded) {
+            state.stats.succeeded = false;
+            return seastar::make_ready_future<>();
+        }
+
+        state.stats.batches++;
+        return seastar::do_with(std::move(batch), [&out, &state](auto& batch){
+            return seastar::do_for_each(batch.records, [&out, &state](const seastar::temporary_buffer<char>& record){
+                state.stats.records_out++;
+                state.stats.bytes_out += record.size();
+                return write_record(out, state.options.framing, record);
+            });
+        })
+        .handle_exception([&state](std::exception_ptr ex){
+            std::cout << "Can not write stream: " << ex << std::endl;
+            state.stats.succeeded = false;
+        });
+    }
+
+    /// evicts least recently used idle instances until the heaps of the
+    /// materialized lazy instances fit into the budget. the isolates are
+    /// disposed on workers, stop waits for them.
+    void evict_lazy_instances() {
+        if (background_work.is_closed()) {
+            return;
+        }
+
+        size_t total_heap_size = 0;
+        for (const auto& instance : lazy_lru) {
+            if (instance.is_materialized()) {
+                total_heap_size += instance.heap_size();
+            }
+        }
+
+        for (auto it = lazy_lru.begin(); it != lazy_lru.end() && total_heap_size > lazy_memory_budget;) {
+            auto& instance = *it++;
+            if (!instance.is_evictable()) {
+                continue;
+            }
+
+            instance.lru_link.unlink();
+            total_heap_size -= instance.heap_size();
+            lazy_stats.evictions++;
+            (void)seastar::with_gate(background_work, [this, &instance]{
+                return seastar::with_gate(instance.pending_work, [this, &instance]{
+                    return instance.evict(thread_pool);
+                });
+            });
+        }
+    }
+
+    uint64_t sum_memo_stats(uint64_t memo_cache::stats_t::*counter) const {
+        uint64_t total = 0;
+        for (const auto& [name, cache] : memo_caches) {
+            total += cache.stats().*counter;
+        }
+        return total;
+    }
+
+    // what the runs of a scheduling group used
+    struct group_usage {
+        uint32_t shares = fair_dispatcher::default_shares;
+        std::chrono::nanoseconds cpu_time{};
+        uint64_t runs = 0;
+    };
+
+    // node based, the reference stays valid for runs holding it
+    group_usage& usage_of(const seastar::scheduling_group& group) {
+        auto name = std::string(group.name());
+        auto [it, inserted] = group_usages.try_emplace(name);
+        if (inserted) {
+            namespace sm = seastar::metrics;
+            auto& usage = it->second;
+            metrics.add_group("scheduling", {
+                sm::make_derive("worker_cpu_time_ns", [&usage] {
+                    return usage.cpu_time.count();
+                }, sm::description("CPU time the workers spent in runs of the scheduling group"), {sm::label("group")(name)}),
+                sm::make_derive("runs", [&usage] {
+                    return usage.runs;
+                }, sm::description("Number of runs of the scheduling group"), {sm::label("group")(name)}),
+            });
+        }
+        return it->second;
+    }
+
+    // the dispatcher's tenant of the tenant's runs in @c group
+    std::string group_tenant(const std::string& tenant, const seastar::scheduling_group& group, const group_usage& usage) {
+        auto name = std::string(group.name()) + "/" + tenant;
+        auto shares_it = tenant_shares.find(tenant);
+        uint64_t shares = shares_it == tenant_shares.end() ? fair_dispatcher::default_shares : shares_it->second;
+        fair_dispatch.set_shares(name, std::min<uint64_t>(shares * usage.shares / fair_dispatcher::default_shares, std::numeric_limits<uint32_t>::max()));
+        return name;
+    }
+
+    admission_counters sum_admission_counters() const {
+        auto total = retired_admission_counters;
+        for (const auto& [name, controller] : admission_controllers) {
+            total += controller->counters();
+        }
+        return total;
+    }
+
+    void setup_metrics() {
+        namespace sm = seastar::metrics;
+        metrics.add_group("storage", {
+            sm::make_derive("lazy_cold_starts", [this] {
+                return lazy_stats.cold_starts;
+            }, sm::description("Number of runs which had to create the isolate of a lazy instance")),
+            sm::make_derive("lazy_cold_start_time_us", [this] {
+                return std::chrono::duration_cast<std::chrono::microseconds>(lazy_stats.cold_start_time).count();
+            }, sm::description("Total latency of runs which had to create the isolate of a lazy instance")),
+            sm::make_derive("lazy_evictions", [this] {
+                return lazy_stats.evictions;
+            }, sm::description("Number of evicted isolates of lazy instances")),
+            sm::make_derive("fresh_contexts", [this] {
+                uint64_t contexts = 0;
+                for (const auto& [name, instance] : v8_instances) {
+                    contexts += instance.fresh_contexts();
+                }
+                return contexts;
+            }, sm::description("Number of contexts restored from snapshots for runs of fresh_context instances")),
+            sm::make_derive("fresh_context_creation_time_ns", [this] {
+                std::chrono::nanoseconds creation_time{};
+                for (const auto& [name, instance] : v8_instances) {
+                    creation_time += instance.fresh_contexts_creation_time();
+                }
+                return creation_time.count();
+            }, sm::description("Total time spent restoring contexts for runs of fresh_context instances")),
+            sm::make_gauge("datasets_bytes", [] {
+                return dataset_registry::instance().memory_usage();
+            }, sm::description("Bytes of the current versions of the datasets shared by the process")),
+            sm::make_gauge("lazy_materialized_instances", [this] {
+                return std::count_if(lazy_lru.begin(), lazy_lru.end(), [](const auto& instance){
+                    return instance.is_materialized();
+                });
+            }, sm::description("Number of lazy instances which have an isolate")),
+        });
+        metrics.add_group("memo", {
+            sm::make_derive("hits", [this] {
+                return sum_memo_stats(&memo_cache::stats_t::hits);
+            }, sm::description("Number of runs answered by the memoization caches")),
+            sm::make_derive("misses", [this] {
+                return sum_memo_stats(&memo_cache::stats_t::misses);
+            }, sm::description("Number of runs of memoized scripts dispatched to the pool")),
+            sm::make_derive("evictions", [this] {
+                return sum_memo_stats(&memo_cache::stats_t::evictions);
+            }, sm::description("Number of results evicted from the memoization caches")),
+            sm::make_derive("rejections", [this] {
+                return sum_memo_stats(&memo_cache::stats_t::rejections);
+            }, sm::description("Number of results not admitted to the memoization caches")),
+            sm::make_gauge("memory_bytes", [this] {
+                size_t total = 0;
+                for (const auto& [name, cache] : memo_caches) {
+                    total += cache.memory_usage();
+                }
+                return total;
+            }, sm::description("Bytes of inputs and results held by the memoization caches")),
+        });
+        std::vector<sm::metric_definition> admission_metrics;
+        for (size_t i = 0; i < static_cast<size_t>(rejection_reason::count); i++) {
+            auto reason = static_cast<rejection_reason>(i);
+            admission_metrics.push_back(sm::make_derive("rejections", [this, i] {
+                return sum_admission_counters().rejections[i];
+            }, sm::description("Number of runs rejected by admission control"), {sm::label("reason")(rejection_reason_name(reason))}));
+        }
+        admission_metrics.push_back(sm::make_derive("admitted", [this] {
+            return sum_admission_counters().admitted;
+        }, sm::description("Number of completed runs admitted by admission control")));
+        admission_metrics.push_back(sm::make_gauge("queue_length", [this] {
+            size_t total = 0;
+            for (const auto& [name, controller] : admission_controllers) {
+                total += controller->queue_length();
+            }
+            return total;
+        }, sm::description("Number of runs waiting for admission")));
+        admission_metrics.push_back(sm::make_gauge("fair_queue_length", [this] {
+            return fair_dispatch.queue_length();
+        }, sm::description("Number of admitted runs waiting for their turn in the fair dispatcher")));
+        metrics.add_group("admission", admission_metrics);
+        std::vector<sm::metric_definition> in_reactor_metrics;
+        for (auto [result, name] : {std::pair{reactor_engine::run_result::failed, "failed"}, std::pair{reactor_engine::run_result::preempted, "preempted"}, std::pair{reactor_engine::run_result::over_budget, "over_budget"}}) {
+            in_reactor_metrics.push_back(sm::make_derive("fallbacks", [this, i = static_cast<size_t>(result)] {
+                return in_reactor_stats.fallbacks[i];
+            }, sm::description("Number of runs given to the pool after they did not complete on the reactor"), {sm::label("reason")(name)}));
+        }
+        in_reactor_metrics.push_back(sm::make_derive("runs", [this] {
+            return in_reactor_stats.runs;
+        }, sm::description("Number of runs completed on the reactor thread")));
+        in_reactor_metrics.push_back(sm::make_derive("demotions", [this] {
+            return in_reactor_stats.demotions;
+        }, sm::description("Number of scripts which stopped running on the reactor thread")));
+        metrics.add_group("in_reactor", in_reactor_metrics);
+        metrics.add_group("thread_pool", {
+            sm::make_gauge("active_threads", [this] {
+                return thread_pool.active_thread_count();
+            }, sm::description("Number of pool threads taking tasks, the others are parked")),
+            sm::make_derive("resizes", [this] {
+                return thread_pool.resize_count();
+            }, sm::description("Number of times a pool thread was activated or parked")),
+            sm::make_derive("tasks", [this] {
+                return thread_pool.started_task_count();
+            }, sm::description("Number of tasks started by the pool threads")),
+            sm::make_derive("queue_wait_ns", [this] {
+                return thread_pool.total_queue_wait().count();
+            }, sm::description("Total time tasks waited for a pool thread")),
+        });
+        metrics.add_group("kv", {
+            sm::make_gauge("keys", [this] {
+                return env.kv.size();
+            }, sm::description("Number of keys in the shard's key-value state")),
+            sm::make_gauge("memory_bytes", [this] {
+                return env.kv.memory_usage();
+            }, sm::description("Bytes of arena chunks owned by the shard's key-value state")),
+        });
+        metrics.add_group("v8_platform", {
+            sm::make_gauge("background_queue_length", [] {
+                auto* platform = seastar_v8_platform::current();
+                return platform ? platform->background_queue_length() : 0;
+            }, sm::description("Number of V8 background tasks waiting for a thread")),
+            sm::make_derive("background_tasks", [] {
+                auto* platform = seastar_v8_platform::current();
+                return platform ? platform->background_tasks_completed() : 0;
+            }, sm::description("Number of completed V8 background tasks")),
+        });
+    }
+
+    void measure_shared_memory() {
+        if (background_work.is_closed()) {
+            return;
+        }
+        for (const auto& group_name : shared_groups) {
+            (void)seastar::with_gate(background_work, [this, &group = v8_instances.at(group_name)]{
+                return seastar::with_gate(group.pending_work, [this, &group]{
+                    return group.request_memory_measurement(thread_pool);
+                });
+            });
+        }
+    }
 
-        auto it = v8_instances.emplace(instance_name, std::move(create_params));
-        return it.first->second.init_instance(script_path);
+    void check_memory_pressure() {
+        auto stats = seastar::memory::stats();
+        if (stats.total_memory() == 0) {
+            return;
+        }
+        if (stats.free_memory() < stats.total_memory() * idle_policy.low_memory_threshold) {
+            idle_gc.notify_low_memory();
+        }
     }
 
     v::ThreadPool& thread_pool;
+    // declared before the instances which keep a pointer to it
+    host_environment env;
     std::unordered_map<std::string, v8_instance> v8_instances{};
+
+    using lazy_lru_t = boost::intrusive::list<v8_instance,
+        boost::intrusive::member_hook<v8_instance, decltype(v8_instance::lru_link), &v8_instance::lru_link>,
+        boost::intrusive::constant_time_size<false>>;
+
+    // materialized lazy instances, least recently used first
+    lazy_lru_t lazy_lru;
+    size_t lazy_memory_budget = std::numeric_limits<size_t>::max();
+    struct {
+        uint64_t cold_starts = 0;
+        std::chrono::steady_clock::duration cold_start_time{};
+        uint64_t evictions = 0;
+    } lazy_stats;
+    // evictions, memory measurements and context removals running on workers
+    seastar::gate background_work;
+
+    idle_gc_t idle_gc;
+    idle_gc_policy idle_policy;
+    seastar::timer<seastar::lowres_clock> memory_pressure_timer;
+
+    // scripts running in a context of a shared isolate, mapped to the group
+    std::unordered_map<std::string, std::string> shared_scripts;
+    std::unordered_set<std::string> shared_groups;
+    seastar::timer<seastar::lowres_clock> memory_measurement_timer;
+
+    // profiles of instances to be added, by instance or group name
+    std::unordered_map<std::string, engine_profile> engine_profiles;
+
+    // result caches of memoized scripts
+    std::unordered_map<std::string, memo_cache> memo_caches;
+
+    // limits of the scripts which have them, shared with the runs they admitted
+    std::unordered_map<std::string, seastar::lw_shared_ptr<admission_controller>> admission_controllers;
+    // counters of removed controllers, so the metrics never decrease
+    admission_counters retired_admission_counters;
+
+    // scheduling groups seen by the storage, by name
+    std::unordered_map<std::string, group_usage> group_usages;
+    std::unordered_map<std::string, seastar::scheduling_group> script_groups;
+
+    // divides the shard's pool slots between tenants
+    fair_dispatcher fair_dispatch;
+    // tenants of the scripts and pipelines which are not a tenant of their own
+    std::unordered_map<std::string, std::string> script_tenants;
+    // set by set_tenant_shares, the dispatcher's tenants of the groups derive theirs from them
+    std::unordered_map<std::string, uint32_t> tenant_shares;
+
+    // runs whitelisted scripts on the reactor thread, created by the first enable_in_reactor
+    std::unique_ptr<reactor_engine> in_reactor;
+    static constexpr unsigned max_in_reactor_overruns = 3;
+    // budget overruns of the scripts in a row
+    std::unordered_map<std::string, unsigned> in_reactor_overruns;
+    // the input of the run on the reactor, restored if it falls back to the pool
+    std::string in_reactor_input;
+    struct {
+        uint64_t runs = 0;
+        // by reactor_engine::run_result
+        std::array<uint64_t, 4> fallbacks{};
+        uint64_t demotions = 0;
+    } in_reactor_stats;
+
+    // warmups in progress by script
+    std::unordered_map<std::string, size_t> warmups_running;
+    // scripts added with needs_warm_up whose warmup did not complete yet
+    std::unordered_set<std::string> warmups_pending;
+
+    // records run_instance calls while a capture is running
+    std::unique_ptr<invocation_recorder> capture;
+
+    // sampled traces of dispatch_instance
+    trace_ring traces;
+
+    // stage names of every pipeline, in execution order
+    std::unordered_map<std::string, std::vector<std::string>> pipelines;
+
+    seastar::metrics::metric_groups metrics;
 };
\ No newline at end of file
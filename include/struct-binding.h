@@ -0,0 +1,171 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+/// types a bound field can have, each one maps to a DataView accessor
+enum class field_type {
+    int8, uint8, int16, uint16, int32, uint32, int64, uint64, float32, float64, boolean,
+};
+
+template <typename T>
+constexpr field_type field_type_of() {
+    if constexpr (std::is_same_v<T, bool>) {
+        return field_type::boolean;
+    } else if constexpr (std::is_same_v<T, float>) {
+        return field_type::float32;
+    } else if constexpr (std::is_same_v<T, double>) {
+        return field_type::float64;
+    } else if constexpr (std::is_integral_v<T> && sizeof(T) == 1) {
+        return std::is_signed_v<T> ? field_type::int8 : field_type::uint8;
+    } else if constexpr (std::is_integral_v<T> && sizeof(T) == 2) {
+        return std::is_signed_v<T> ? field_type::int16 : field_type::uint16;
+    } else if constexpr (std::is_integral_v<T> && sizeof(T) == 4) {
+        return std::is_signed_v<T> ? field_type::int32 : field_type::uint32;
+    } else if constexpr (std::is_integral_v<T> && sizeof(T) == 8) {
+        return std::is_signed_v<T> ? field_type::int64 : field_type::uint64;
+    } else {
+        static_assert(!sizeof(T), "the field type has no DataView accessor");
+    }
+}
+
+constexpr size_t field_type_size(field_type type) {
+    switch (type) {
+    case field_type::int8: case field_type::uint8: case field_type::boolean:
+        return 1;
+    case field_type::int16: case field_type::uint16:
+        return 2;
+    case field_type::int32: case field_type::uint32: case field_type::float32:
+        return 4;
+    case field_type::int64: case field_type::uint64: case field_type::float64:
+        return 8;
+    }
+    return 0;
+}
+
+struct field_binding {
+    std::string_view name;
+    size_t offset;
+    field_type type;
+
+    constexpr size_t size() const {
+        return field_type_size(type);
+    }
+};
+
+/// a field of the struct @c T, so a binding can not be given the fields of another struct
+template <typename T>
+struct struct_field {
+    field_binding field;
+};
+
+/// describes the member @c member of the struct @c type for make_struct_binding,
+/// field_type_of rejects a member without a DataView accessor of its size
+#define STRUCT_BINDING_FIELD(type, member) \
+    struct_field<type>{field_binding{#member, offsetof(type, member), field_type_of<decltype(type::member)>()}}
+
+/**
+ * layout of a C++ struct shared with scripts without serialization. the host
+ * gets the struct over the bytes of a run via view(), scripts get a class
+ * with the same name generated by js_class(), whose accessors read and write
+ * the same offsets through a DataView:
+ *
+ *     let sum = new test_sum_t(obj);
+ *     sum.ans = sum.a + sum.b;
+ *
+ * the description is checked against the struct when the binding is
+ * constructed, a constexpr binding with overlapping fields, fields outside
+ * of the struct or fields of another struct does not compile.
+ */
+template <typename T, size_t N>
+class struct_binding {
+    static_assert(std::is_standard_layout_v<T> && std::is_trivially_copyable_v<T>,
+        "only standard layout trivially copyable structs can cross the boundary");
+
+public:
+    constexpr struct_binding(std::string_view name_, std::array<field_binding, N> fields_)
+    : name(name_), fields(fields_) {
+        if (name.empty()) {
+            throw std::invalid_argument("struct binding needs a name");
+        }
+        for (size_t i = 0; i < N; i++) {
+            const auto& field = fields[i];
+            if (field.offset + field.size() > sizeof(T)) {
+                throw std::invalid_argument("field is outside of the struct");
+            }
+            for (size_t j = 0; j < i; j++) {
+                const auto& other = fields[j];
+                if (other.name == field.name || (field.offset < other.offset + other.size() && other.offset < field.offset + field.size())) {
+                    throw std::invalid_argument("fields overlap");
+                }
+            }
+        }
+    }
+
+    static constexpr size_t size() {
+        return sizeof(T);
+    }
+
+    /// the struct over the bytes passed to a script
+    T& view(std::span<char> data) const {
+        if (data.size() < sizeof(T) || reinterpret_cast<uintptr_t>(data.data()) % alignof(T) != 0) {
+            throw std::invalid_argument("buffer can not hold " + std::string(name));
+        }
+        return *reinterpret_cast<T*>(data.data());
+    }
+
+    /// JS class of the binding, see storage_t::add_struct_binding
+    std::string js_class() const {
+        const std::string little_endian = std::endian::native == std::endian::little ? "true" : "false";
+        std::string source = "class " + std::string(name) + " {\n"
+            "    constructor(buffer, offset = 0) { this.view = new DataView(buffer, offset, " + std::to_string(sizeof(T)) + "); }\n"
+            "    static get size() { return " + std::to_string(sizeof(T)) + "; }\n";
+        for (const auto& field : fields) {
+            auto offset = std::to_string(field.offset);
+            auto accessor = std::string(data_view_accessor(field.type));
+            std::string getter = "this.view.get" + accessor + "(" + offset + ", " + little_endian + ")";
+            std::string value = "value";
+            if (field.type == field_type::boolean) {
+                getter = "(" + getter + " !== 0)";
+                value = "(value ? 1 : 0)";
+            }
+            source += "    get " + std::string(field.name) + "() { return " + getter + "; }\n";
+            source += "    set " + std::string(field.name) + "(value) { this.view.set" + accessor + "(" + offset + ", " + value + ", " + little_endian + "); }\n";
+        }
+        source += "}\n";
+        return source;
+    }
+
+    std::string_view name;
+    std::array<field_binding, N> fields;
+
+private:
+    static constexpr std::string_view data_view_accessor(field_type type) {
+        switch (type) {
+        case field_type::int8: return "Int8";
+        case field_type::uint8: case field_type::boolean: return "Uint8";
+        case field_type::int16: return "Int16";
+        case field_type::uint16: return "Uint16";
+        case field_type::int32: return "Int32";
+        case field_type::uint32: return "Uint32";
+        case field_type::int64: return "BigInt64";
+        case field_type::uint64: return "BigUint64";
+        case field_type::float32: return "Float32";
+        case field_type::float64: return "Float64";
+        }
+        return "";
+    }
+};
+
+template <typename T, typename... Fields>
+constexpr auto make_struct_binding(std::string_view name, Fields... fields) {
+    static_assert((std::is_same_v<Fields, struct_field<T>> && ...), "every field has to be a member of the bound struct");
+    return struct_binding<T, sizeof...(Fields)>(name, {fields.field...});
+}
@@ -1,31 +1,72 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <optional>
 #include <span>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "seastar/core/do_with.hh"
 #include "seastar/core/file-types.hh"
 #include "seastar/core/file.hh"
 #include "seastar/core/temporary_buffer.hh"
+#include "dataset-registry.h"
+#include "engine-profile.h"
+#include "heap-snapshot-stream.h"
+#include "host-functions.h"
+#include "invocation-trace.h"
+#include "json-index.h"
+#include "kv-store.h"
+#include "profiling.h"
+#include "v8-seastar-platform.h"
 #include "v8.h"
 
+#include "seastar/core/condition-variable.hh"
+#include "seastar/core/shared_ptr.hh"
 #include "seastar/core/future.hh"
+#include "seastar/core/gate.hh"
+#include "seastar/core/loop.hh"
 #include "seastar/core/seastar.hh"
+#include "seastar/core/when_all.hh"
+
+#include <boost/intrusive/list.hpp>
+
+enum class instance_mode {
+    // the isolate is created with the instance and the script runs in one context
+    eager,
+    // the isolate is created by the first run and can be evicted, see init_lazy_instance
+    lazy,
+    // every run gets a new context restored from a snapshot, see init_fresh_context_instance
+    fresh_context,
+};
 
 class v8_instance {
 public:
-    v8_instance(v8::Isolate::CreateParams create_params_)
+    /// @param env_ host functions, key-value state and prelude of the scripts
+    /// @param profile_ applied to every isolate of the instance, created with @c create_params_
+    v8_instance(v8::Isolate::CreateParams create_params_, instance_mode mode_ = instance_mode::eager, host_environment* env_ = nullptr, engine_profile profile_ = {})
     : create_params(std::move(create_params_)),
-      isolate(v8::Isolate::New(create_params)) {
+      mode(mode_),
+      profile(std::move(profile_)),
+      isolate(mode == instance_mode::eager ? v8::Isolate::New(create_params) : nullptr),
+      env(env_) {
             watchdog.set_callback([this]{
-                stop_execution_loop();
-                is_canceled = true;
+                cancel_run();
             });
+            if (isolate) {
+                setup_isolate();
+            }
       }
 
     ~v8_instance() {
-        context.Reset();
-        function.Reset();
-        isolate->Dispose();
+        if (isolate) {
+            dispose_isolate();
+        }
+        delete[] snapshot_blob.data;
     }
 
     seastar::future<bool> init_instance(const std::string script_path) {
@@ -35,23 +76,123 @@ public:
         });
     }
 
-    seastar::future<bool> run_instance(v::ThreadPool& thread_pool, int timeout, std::span<char> data) {
-        return seastar::with_semaphore(mtx, 1, [this, &thread_pool, timeout, data](){
-            is_canceled = false;
-            watchdog.rearm(seastar::lowres_clock::time_point(seastar::lowres_clock::now() + std::chrono::seconds(timeout)));
-            return thread_pool.submit([this, data](){
-                run_instance_internal(data);
-            })
-            .then([this] {
-                if (!is_canceled) {
-                    watchdog.cancel();
+    /// only reads the script. the isolate is created by the first run and can
+    /// be evicted later, so the source is kept along with its code cache.
+    seastar::future<bool> init_lazy_instance(const std::string script_path) {
+        return read_file(script_path)
+        .then([this](seastar::temporary_buffer<char> script){
+            source = std::move(script);
+            return true;
+        });
+    }
+
+    /// snapshots the context left by the script's top level code, every run
+    /// then starts from a fresh copy of it and no state leaks between calls.
+    /// the script can not keep objects V8 can not snapshot, e.g. wasm modules.
+    seastar::future<bool> init_fresh_context_instance(v::ThreadPool& thread_pool, const std::string script_path) {
+        return read_file(script_path)
+        .then([this, &thread_pool](seastar::temporary_buffer<char> script){
+            return seastar::do_with(std::move(script), false, [this, &thread_pool](auto& script, bool& created){
+                return thread_pool.submit([this, &script, &created](){
+                    std::lock_guard lock{isolate_mutex};
+                    created = create_context_snapshot(script.get(), script.size());
+                })
+                .then([&created]{
+                    return created;
+                });
+            });
+        });
+    }
+
+    /**
+     * @param accounting the worker reports on the run in it, see v::TaskAccounting
+     * @param succeeded set to whether the script completed without throwing, if any
+     * @param cold_start set to whether the run had to create the isolate, if any
+     * @return true if the run was canceled
+     */
+    seastar::future<bool> run_instance(v::ThreadPool& thread_pool, int timeout, std::span<char> data, v::TaskAccounting accounting = {}, bool* succeeded = nullptr, bool* cold_start = nullptr) {
+        return seastar::with_semaphore(mtx, 1, [this, &thread_pool, timeout, data, accounting, succeeded, cold_start](){
+            trace_mark(accounting.trace, invocation_trace::instance_locked);
+            if (cold_start) {
+                *cold_start = !isolate;
+            }
+            return ensure_materialized(thread_pool)
+            .then([this, &thread_pool, timeout, data, accounting, succeeded](bool materialized){
+                if (!materialized) {
+                    return seastar::make_ready_future<bool>(false);
+                }
+
+                trace_mark(accounting.trace, invocation_trace::ready);
+                is_canceled = false;
+                active_trace = accounting.trace;
+                watchdog.rearm(seastar::lowres_clock::time_point(seastar::lowres_clock::now() + std::chrono::seconds(timeout)));
+                return seastar::do_with(false, [this, &thread_pool, data, accounting, succeeded](bool& returned){
+                    return thread_pool.submit_accounted(accounting, [this, data, &returned](){
+                        returned = run_instance_internal(data);
+                    })
+                    .then([this, &thread_pool] {
+                        return drive_host_calls(thread_pool);
+                    })
+                    .finally([this] {
+                        active_trace = nullptr;
+                    })
+                    .then([this, &returned, succeeded](bool settled) {
+                        watchdog.cancel();
+                        if (succeeded) {
+                            *succeeded = returned && settled && !is_canceled;
+                        }
+                        return is_canceled;
+                    });
+                });
+            });
+        });
+    }
+
+    bool is_lazy() const {
+        return mode == instance_mode::lazy;
+    }
+
+    /// number of contexts restored for runs in the fresh_context mode
+    uint64_t fresh_contexts() const {
+        return fresh_context_count.load(std::memory_order_relaxed);
+    }
+
+    std::chrono::nanoseconds fresh_contexts_creation_time() const {
+        return std::chrono::nanoseconds(fresh_context_creation_ns.load(std::memory_order_relaxed));
+    }
+
+    bool is_materialized() const {
+        return isolate != nullptr;
+    }
+
+    /// physical size of the isolate's heap after the last run
+    size_t heap_size() const {
+        return last_heap_size;
+    }
+
+    /// whether evict can dispose the isolate now: a materialized lazy instance
+    /// which does not run and is not profiled
+    bool is_evictable() const {
+        return is_lazy() && isolate && !cpu_profiler && !heap_sampling && mtx.available_units() > 0;
+    }
+
+    /// disposes the isolate on a worker, the next run creates it again from
+    /// the kept source and code cache. runs arriving meanwhile wait for it.
+    seastar::future<> evict(v::ThreadPool& thread_pool) {
+        return seastar::with_semaphore(mtx, 1, [this, &thread_pool]{
+            return thread_pool.submit([this]{
+                std::lock_guard lock{isolate_mutex};
+                if (isolate) {
+                    dispose_isolate();
                 }
-        	    return seastar::make_ready_future<bool>(is_canceled);
             });
         });
     }
 
     void stop_execution_loop() {
+        if (!isolate) {
+            return;
+        }
         if (!isolate->IsExecutionTerminating()) {
             isolate->TerminateExecution();
         } else {
@@ -59,12 +200,439 @@ public:
         }
     }
 
+    /// terminates the running script and wakes the run if it waits for host calls
+    void cancel_run() {
+        stop_execution_loop();
+        is_canceled = true;
+        if (waiting_host_calls) {
+            waiting_host_calls->on_completed.broadcast();
+        }
+    }
+
     void continue_execution() {
         if (isolate->IsExecutionTerminating()) {
             isolate->CancelTerminateExecution();
         }
     }
 
+    /// gives the isolate's garbage collector time until @c deadline. called
+    /// from idle worker threads, returns false if the isolate was busy or had
+    /// nothing to collect since its last run.
+    bool idle_notification(std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock lock{isolate_mutex, std::try_to_lock};
+        if (!lock.owns_lock() || !isolate) {
+            return false;
+        }
+
+        auto* platform = seastar_v8_platform::current();
+        if (idle_gc_done.load(std::memory_order_relaxed) && !low_memory_pending.load(std::memory_order_relaxed)
+            && !(platform && platform->has_foreground_tasks(isolate))) {
+            return false;
+        }
+
+        v8::Locker locker(isolate);
+        v8::Isolate::Scope isolate_scope(isolate);
+        if (platform) {
+            platform->pump_message_loop(isolate);
+        }
+        if (low_memory_pending.exchange(false)) {
+            isolate->LowMemoryNotification();
+            idle_gc_done = true;
+            return true;
+        }
+
+        // the platform measures deadlines on CLOCK_MONOTONIC as steady_clock does
+        auto deadline_in_seconds = std::chrono::duration<double>(deadline.time_since_epoch()).count();
+        idle_gc_done = isolate->IdleNotificationDeadline(deadline_in_seconds);
+        return true;
+    }
+
+    void request_low_memory_notification() {
+        low_memory_pending = true;
+    }
+
+    /// compiles a script into its own context of this isolate. contexts get
+    /// distinct security tokens, so scripts can not reach each other's globals.
+    seastar::future<bool> add_context(v::ThreadPool& thread_pool, const std::string context_name, const std::string script_path) {
+        return read_file(script_path)
+        .then([this, &thread_pool, context_name](seastar::temporary_buffer<char> script){
+            return seastar::with_semaphore(mtx, 1, [this, &thread_pool, context_name, script = std::move(script)](){
+                return seastar::do_with(false, [this, &thread_pool, &context_name, &script](bool& added){
+                    return thread_pool.submit([this, &context_name, &script, &added](){
+                        std::lock_guard lock{isolate_mutex};
+                        if (!isolate || tenants.contains(context_name)) {
+                            return;
+                        }
+
+                        tenant_context tenant;
+                        added = compile_source(script.get(), script.size(), tenant.context, context_name.c_str())
+                            && bind_function(tenant.context, tenant.function);
+                        if (added) {
+                            tenants.emplace(context_name, std::move(tenant));
+                        } else {
+                            v8::Locker locker(isolate);
+                            tenant.context.Reset();
+                            tenant.function.Reset();
+                        }
+                    })
+                    .then([&added]{
+                        return added;
+                    });
+                });
+            });
+        });
+    }
+
+    /// releases the context on a worker, the locker may wait for V8 threads
+    seastar::future<> remove_context(v::ThreadPool& thread_pool, const std::string context_name) {
+        return seastar::with_semaphore(mtx, 1, [this, &thread_pool, context_name](){
+            return thread_pool.submit([this, context_name](){
+                std::lock_guard lock{isolate_mutex};
+                auto it = tenants.find(context_name);
+                if (it != tenants.end() && isolate) {
+                    v8::Locker locker(isolate);
+                    tenants.erase(it);
+                }
+                std::lock_guard memory_lock{context_memory_mutex};
+                context_memory.erase(context_name);
+            });
+        });
+    }
+
+    /// see run_instance
+    seastar::future<bool> run_context(v::ThreadPool& thread_pool, int timeout, std::string context_name, std::span<char> data, v::TaskAccounting accounting = {}, bool* succeeded = nullptr) {
+        return seastar::with_semaphore(mtx, 1, [this, &thread_pool, timeout, context_name = std::move(context_name), data, accounting, succeeded](){
+            trace_mark(accounting.trace, invocation_trace::instance_locked);
+            auto it = tenants.find(context_name);
+            if (it == tenants.end()) {
+                return seastar::make_ready_future<bool>(false);
+            }
+
+            trace_mark(accounting.trace, invocation_trace::ready);
+            is_canceled = false;
+            active_trace = accounting.trace;
+            watchdog.rearm(seastar::lowres_clock::time_point(seastar::lowres_clock::now() + std::chrono::seconds(timeout)));
+            return seastar::do_with(false, [this, &thread_pool, &tenant = it->second, data, accounting, succeeded](bool& returned){
+                return thread_pool.submit_accounted(accounting, [this, &tenant, data, &returned](){
+                    returned = run_function(tenant.context, tenant.function, data);
+                })
+                .then([this, &thread_pool] {
+                    return drive_host_calls(thread_pool);
+                })
+                .finally([this] {
+                    active_trace = nullptr;
+                })
+                .then([this, &returned, succeeded](bool settled) {
+                    watchdog.cancel();
+                    if (succeeded) {
+                        *succeeded = returned && settled && !is_canceled;
+                    }
+                    return is_canceled;
+                });
+            });
+        });
+    }
+
+    /**
+     * runs @c stages one after another over the same buffer with one dispatch
+     * to a worker, so every stage sees the bytes written by the previous ones
+     * and the isolates of a run share the worker's cache. a stage awaiting
+     * host calls hands the rest of the chain back to the reactor until its
+     * promise settles. stops at the first failed stage.
+     *
+     * @param timeout seconds for the whole chain
+     * @return true if every stage succeeded
+     */
+    static seastar::future<bool> run_pipeline(v::ThreadPool& thread_pool, int timeout, std::vector<v8_instance*> stages, std::span<char> data) {
+        auto state = std::make_unique<pipeline_state>();
+        state->stages = std::move(stages);
+        return seastar::do_with(std::move(state), [&thread_pool, timeout, data](auto& state){
+            // instances are locked in address order, so pipelines sharing
+            // stages can not deadlock
+            std::vector<v8_instance*> lock_order = state->stages;
+            std::sort(lock_order.begin(), lock_order.end());
+            lock_order.erase(std::unique(lock_order.begin(), lock_order.end()), lock_order.end());
+            return seastar::do_with(std::move(lock_order), [&thread_pool, &state](auto& lock_order){
+                return seastar::do_for_each(lock_order, [&thread_pool, &state](v8_instance* stage){
+                    return seastar::get_units(stage->mtx, 1)
+                    .then([&thread_pool, &state, stage](auto units){
+                        state->units.push_back(std::move(units));
+                        return stage->ensure_materialized(thread_pool);
+                    })
+                    .then([&state](bool materialized){
+                        state->failed = state->failed || !materialized;
+                    });
+                });
+            })
+            .then([&thread_pool, &state, timeout, data]{
+                if (state->failed) {
+                    return seastar::make_ready_future<bool>(false);
+                }
+
+                for (auto* stage : state->stages) {
+                    stage->is_canceled = false;
+                }
+                state->watchdog.set_callback([&state]{
+                    state->stages[state->current.load()]->cancel_run();
+                });
+                state->watchdog.arm(seastar::lowres_clock::time_point(seastar::lowres_clock::now() + std::chrono::seconds(timeout)));
+                return seastar::repeat([&thread_pool, &state, data]{
+                    return thread_pool.submit([&state, data](){
+                        run_pipeline_stages(*state, data);
+                    })
+                    .then([&thread_pool, &state]{
+                        if (state->failed || state->next == state->stages.size()) {
+                            return seastar::make_ready_future<seastar::stop_iteration>(seastar::stop_iteration::yes);
+                        }
+
+                        auto* stage = state->stages[state->next];
+                        return stage->drive_host_calls(thread_pool)
+                        .then([&state, stage](bool succeeded){
+                            state->failed = !succeeded || stage->is_canceled;
+                            state->next++;
+                            return state->failed ? seastar::stop_iteration::yes : seastar::stop_iteration::no;
+                        });
+                    });
+                })
+                .then([&state]{
+                    state->watchdog.cancel();
+                    return !state->failed && state->next == state->stages.size();
+                });
+            });
+        });
+    }
+
+    /**
+     * calls user_script once per record on one worker. the bytes of the value
+     * it returns (ArrayBuffer, view or string) are appended to @c outputs,
+     * undefined drops the record. async scripts can not process batches.
+     *
+     * @return false if the batch was canceled or a record failed
+     */
+    seastar::future<bool> run_batch(v::ThreadPool& thread_pool, int timeout, std::vector<seastar::temporary_buffer<char>>& records, std::vector<seastar::temporary_buffer<char>>& outputs) {
+        return seastar::with_semaphore(mtx, 1, [this, &thread_pool, timeout, &records, &outputs](){
+            return ensure_materialized(thread_pool)
+            .then([this, &thread_pool, timeout, &records, &outputs](bool materialized){
+                if (!materialized || mode == instance_mode::fresh_context) {
+                    return seastar::make_ready_future<bool>(false);
+                }
+
+                is_canceled = false;
+                watchdog.rearm(seastar::lowres_clock::time_point(seastar::lowres_clock::now() + std::chrono::seconds(timeout)));
+                return seastar::do_with(false, [this, &thread_pool, &records, &outputs](bool& succeeded){
+                    return thread_pool.submit([this, &records, &outputs, &succeeded](){
+                        succeeded = run_batch_internal(records, outputs);
+                    })
+                    .then([this, &succeeded] {
+                        watchdog.cancel();
+                        return succeeded && !is_canceled;
+                    });
+                });
+            });
+        });
+    }
+
+    /**
+     * calls user_script with the parsed JSON @c input and writes the value it
+     * returns to @c output as JSON, undefined leaves it empty. async scripts
+     * can not be called with JSON.
+     *
+     * @return false if the run was canceled, failed or the input is not JSON
+     */
+    seastar::future<bool> run_json(v::ThreadPool& thread_pool, int timeout, std::string_view input, json_parsing parsing, seastar::temporary_buffer<char>& output) {
+        return seastar::with_semaphore(mtx, 1, [this, &thread_pool, timeout, input, parsing, &output](){
+            return ensure_materialized(thread_pool)
+            .then([this, &thread_pool, timeout, input, parsing, &output](bool materialized){
+                if (!materialized || mode == instance_mode::fresh_context) {
+                    return seastar::make_ready_future<bool>(false);
+                }
+
+                is_canceled = false;
+                watchdog.rearm(seastar::lowres_clock::time_point(seastar::lowres_clock::now() + std::chrono::seconds(timeout)));
+                return seastar::do_with(false, [this, &thread_pool, input, parsing, &output](bool& succeeded){
+                    return thread_pool.submit([this, input, parsing, &output, &succeeded](){
+                        succeeded = run_json_internal(input, parsing, output);
+                    })
+                    .then([this, &succeeded] {
+                        watchdog.cancel();
+                        return succeeded && !is_canceled;
+                    });
+                });
+            });
+        });
+    }
+
+    /// asks V8 to attribute heap usage to the contexts. the measurement
+    /// finishes with a later GC, its results are read by context_memory_usage.
+    seastar::future<> request_memory_measurement(v::ThreadPool& thread_pool) {
+        return seastar::with_semaphore(mtx, 1, [this, &thread_pool](){
+            return thread_pool.submit([this](){
+                std::lock_guard lock{isolate_mutex};
+                if (!isolate || tenants.empty()) {
+                    return;
+                }
+
+                v8::Locker locker(isolate);
+                v8::Isolate::Scope isolate_scope(isolate);
+                v8::HandleScope handle_scope(isolate);
+                isolate->MeasureMemory(std::make_unique<memory_measurement>(*this));
+            });
+        });
+    }
+
+    /// bytes attributed to the context by the last finished measurement
+    std::optional<size_t> context_memory_usage(const std::string& context_name) {
+        std::lock_guard lock{context_memory_mutex};
+        auto it = context_memory.find(context_name);
+        if (it == context_memory.end()) {
+            return std::nullopt;
+        }
+        return it->second;
+    }
+
+    /// returns false if the isolate is already being profiled.
+    /// V8 samples the thread which started profiling, so with several pool
+    /// threads only runs on that worker are sampled.
+    seastar::future<bool> start_cpu_profiling(v::ThreadPool& thread_pool, std::chrono::microseconds sampling_interval) {
+        return seastar::with_semaphore(mtx, 1, [this, &thread_pool, sampling_interval](){
+            return seastar::do_with(false, [this, &thread_pool, sampling_interval](bool& started){
+                return thread_pool.submit([this, sampling_interval, &started](){
+                    std::lock_guard lock{isolate_mutex};
+                    if (!isolate) {
+                        return;
+                    }
+                    v8::Locker locker(isolate);
+                    v8::Isolate::Scope isolate_scope(isolate);
+                    v8::HandleScope handle_scope(isolate);
+                    if (cpu_profiler) {
+                        return;
+                    }
+
+                    cpu_profiler = v8::CpuProfiler::New(isolate);
+                    v8::CpuProfilingOptions options(v8::kLeafNodeLineNumbers, v8::CpuProfilingOptions::kNoSampleLimit, sampling_interval.count());
+                    started = cpu_profiler->StartProfiling(v8::String::Empty(isolate), options) == v8::CpuProfilingStatus::kStarted;
+                    if (!started) {
+                        cpu_profiler->Dispose();
+                        cpu_profiler = nullptr;
+                    }
+                })
+                .then([&started]{
+                    return started;
+                });
+            });
+        });
+    }
+
+    /// stops profiling and adds the collected samples to @c stacks
+    seastar::future<bool> stop_cpu_profiling(v::ThreadPool& thread_pool, collapsed_stacks_t& stacks) {
+        return seastar::with_semaphore(mtx, 1, [this, &thread_pool, &stacks](){
+            return seastar::do_with(false, [this, &thread_pool, &stacks](bool& stopped){
+                return thread_pool.submit([this, &stacks, &stopped](){
+                    std::lock_guard lock{isolate_mutex};
+                    v8::Locker locker(isolate);
+                    v8::Isolate::Scope isolate_scope(isolate);
+                    v8::HandleScope handle_scope(isolate);
+                    if (!cpu_profiler) {
+                        return;
+                    }
+
+                    if (auto* profile = cpu_profiler->StopProfiling(v8::String::Empty(isolate))) {
+                        collapse_cpu_profile(profile, stacks);
+                        profile->Delete();
+                        stopped = true;
+                    }
+                    cpu_profiler->Dispose();
+                    cpu_profiler = nullptr;
+                })
+                .then([&stopped]{
+                    return stopped;
+                });
+            });
+        });
+    }
+
+    /// returns false if the heap is already being sampled
+    seastar::future<bool> start_heap_sampling(v::ThreadPool& thread_pool, uint64_t sample_interval, int stack_depth) {
+        return seastar::with_semaphore(mtx, 1, [this, &thread_pool, sample_interval, stack_depth](){
+            return seastar::do_with(false, [this, &thread_pool, sample_interval, stack_depth](bool& started){
+                return thread_pool.submit([this, sample_interval, stack_depth, &started](){
+                    std::lock_guard lock{isolate_mutex};
+                    if (!isolate) {
+                        return;
+                    }
+                    v8::Locker locker(isolate);
+                    v8::Isolate::Scope isolate_scope(isolate);
+                    if (heap_sampling) {
+                        return;
+                    }
+
+                    started = heap_sampling = isolate->GetHeapProfiler()->StartSamplingHeapProfiler(sample_interval, stack_depth);
+                })
+                .then([&started]{
+                    return started;
+                });
+            });
+        });
+    }
+
+    /// stops sampling and adds the sampled live bytes to @c stacks
+    seastar::future<bool> stop_heap_sampling(v::ThreadPool& thread_pool, collapsed_stacks_t& stacks) {
+        return seastar::with_semaphore(mtx, 1, [this, &thread_pool, &stacks](){
+            return seastar::do_with(false, [this, &thread_pool, &stacks](bool& stopped){
+                return thread_pool.submit([this, &stacks, &stopped](){
+                    std::lock_guard lock{isolate_mutex};
+                    v8::Locker locker(isolate);
+                    v8::Isolate::Scope isolate_scope(isolate);
+                    v8::HandleScope handle_scope(isolate);
+                    if (!heap_sampling) {
+                        return;
+                    }
+
+                    auto* heap_profiler = isolate->GetHeapProfiler();
+                    std::unique_ptr<v8::AllocationProfile> profile{heap_profiler->GetAllocationProfile()};
+                    if (profile) {
+                        collapse_allocation_profile(isolate, profile.get(), stacks);
+                        stopped = true;
+                    }
+                    heap_profiler->StopSamplingHeapProfiler();
+                    heap_sampling = false;
+                })
+                .then([&stopped]{
+                    return stopped;
+                });
+            });
+        });
+    }
+
+    /// serializes a heap snapshot on a worker while the reactor writes it to @c out
+    seastar::future<> write_heap_snapshot(v::ThreadPool& thread_pool, seastar::output_stream<char>& out) {
+        return seastar::with_semaphore(mtx, 1, [this, &thread_pool, &out](){
+            return seastar::do_with(std::make_unique<heap_snapshot_stream>(), [this, &thread_pool, &out](auto& stream_ptr){
+                auto& stream = *stream_ptr;
+                auto serialized = thread_pool.submit([this, &stream](){
+                    std::lock_guard lock{isolate_mutex};
+                    if (!isolate) {
+                        return;
+                    }
+                    v8::Locker locker(isolate);
+                    v8::Isolate::Scope isolate_scope(isolate);
+                    v8::HandleScope handle_scope(isolate);
+
+                    auto* snapshot = isolate->GetHeapProfiler()->TakeHeapSnapshot();
+                    if (snapshot) {
+                        snapshot->Serialize(&stream, v8::HeapSnapshot::kJSON);
+                        const_cast<v8::HeapSnapshot*>(snapshot)->Delete();
+                    }
+                })
+                .finally([&stream]{
+                    stream.close();
+                });
+
+                return seastar::when_all_succeed(std::move(serialized), stream.write_to(out)).discard_result();
+            });
+        });
+    }
+
 private:
     seastar::future<seastar::temporary_buffer<char>> read_file(const std::string script_path) {
         return seastar::with_file(seastar::open_file_dma(script_path, seastar::open_flags::ro), [](seastar::file f){
@@ -78,82 +646,949 @@ private:
     seastar::future<bool> compile_script(const std::string script_path) {
         return read_file(script_path)
         .then([this](const seastar::temporary_buffer<char> script) mutable {
-            v8::Locker locker(isolate);
-            v8::Isolate::Scope isolate_scope(isolate);
-            v8::HandleScope handle_scope(isolate);
-            v8::TryCatch try_catch(isolate);
-            v8::Local<v8::Context> local_ctx = v8::Context::New(isolate);
-            v8::Context::Scope context_scope(local_ctx);
-
-            v8::Local<v8::String> script_code = v8::String::NewFromUtf8(isolate, script.begin(), v8::NewStringType::kNormal, script.size()).ToLocalChecked();
-            v8::Local<v8::Script> compiled_script;
-            if (!v8::Script::Compile(local_ctx, script_code).ToLocal(&compiled_script)) {
-                v8::String::Utf8Value error(isolate, try_catch.Exception());
-                std::cout << "Can not compile script: " << std::string(*error, error.length()) << std::endl;
-                return seastar::make_ready_future<bool>(false);
-            }
-
-            v8::Local<v8::Value> result;
-            if (!compiled_script->Run(local_ctx).ToLocal(&result)) {
-                std::cout << "Run script error\n" << std::endl;
-                return seastar::make_ready_future<bool>(false);
-            }
-
-            context.Reset(isolate, local_ctx);
-            return seastar::make_ready_future<bool>(true);
+            return seastar::make_ready_future<bool>(compile_source(script.get(), script.size(), context));
         });
     }
 
     seastar::future<bool> create_script() {
+        return seastar::make_ready_future<bool>(bind_function(context, function));
+    }
+
+    /// runs the script in a new context and stores the context in @c target_context
+    bool compile_source(const char* script, size_t script_size, v8::Global<v8::Context>& target_context, const char* security_token = nullptr) {
         v8::Locker locker(isolate);
         v8::Isolate::Scope isolate_scope(isolate);
         v8::HandleScope handle_scope(isolate);
-        v8::Local<v8::Context> local_ctx = v8::Local<v8::Context>::New(isolate, context);
+        v8::TryCatch try_catch(isolate);
+        v8::Local<v8::Context> local_ctx = v8::Context::New(isolate);
+        v8::Context::Scope context_scope(local_ctx);
+        if (security_token) {
+            local_ctx->SetSecurityToken(v8::String::NewFromUtf8(isolate, security_token).ToLocalChecked());
+        }
+        install_host_api(local_ctx);
+        if (!run_prelude(isolate, local_ctx)) {
+            return false;
+        }
+
+        v8::Local<v8::String> script_code = v8::String::NewFromUtf8(isolate, script, v8::NewStringType::kNormal, script_size).ToLocalChecked();
+        auto* cached_data = code_cache ? new v8::ScriptCompiler::CachedData(code_cache->data, code_cache->length) : nullptr;
+        v8::ScriptCompiler::Source script_source(script_code, cached_data);
+        auto options = cached_data ? v8::ScriptCompiler::kConsumeCodeCache : profile.compile_options();
+        v8::Local<v8::Script> compiled_script;
+        if (!v8::ScriptCompiler::Compile(local_ctx, &script_source, options).ToLocal(&compiled_script)) {
+            v8::String::Utf8Value error(isolate, try_catch.Exception());
+            std::cout << "Can not compile script: " << std::string(*error, error.length()) << std::endl;
+            return false;
+        }
+
+        v8::Local<v8::Value> result;
+        if (!compiled_script->Run(local_ctx).ToLocal(&result)) {
+            std::cout << "Run script error\n" << std::endl;
+            return false;
+        }
+
+        // lazy instances are recreated after eviction, the cache spares them
+        // parsing and compiling the script again
+        if (is_lazy() && (!code_cache || script_source.GetCachedData()->rejected)) {
+            code_cache.reset(v8::ScriptCompiler::CreateCodeCache(compiled_script->GetUnboundScript()));
+        }
+
+        target_context.Reset(isolate, local_ctx);
+        return true;
+    }
+
+    /// runs the environment's prelude in the entered context
+    bool run_prelude(v8::Isolate* target_isolate, v8::Local<v8::Context> local_ctx) {
+        if (!env || env->script_prelude.empty()) {
+            return true;
+        }
+
+        v8::TryCatch try_catch(target_isolate);
+        v8::Local<v8::String> prelude_code = v8::String::NewFromUtf8(target_isolate, env->script_prelude.data(), v8::NewStringType::kNormal, env->script_prelude.size()).ToLocalChecked();
+        v8::Local<v8::Script> compiled_prelude;
+        v8::Local<v8::Value> result;
+        if (!v8::Script::Compile(local_ctx, prelude_code).ToLocal(&compiled_prelude) || !compiled_prelude->Run(local_ctx).ToLocal(&result)) {
+            v8::String::Utf8Value error(target_isolate, try_catch.Exception());
+            std::cout << "Can not run script prelude: " << std::string(*error, error.length()) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool bind_function(const v8::Global<v8::Context>& source_context, v8::Global<v8::Function>& target_function) {
+        v8::Locker locker(isolate);
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        v8::Local<v8::Context> local_ctx = v8::Local<v8::Context>::New(isolate, source_context);
         v8::Context::Scope context_scope(local_ctx);
 
         v8::Local<v8::String> function_name = v8::String::NewFromUtf8Literal(isolate, "user_script");
         v8::Local<v8::Value> function_val;
         if (!local_ctx->Global()->Get(local_ctx, function_name).ToLocal(&function_val) || !function_val->IsFunction()) {
             std::cout << "Can not create process for function" << std::endl;
-            return seastar::make_ready_future<bool>(false) ;
+            return false;
         }
 
-        function.Reset(isolate, function_val.As<v8::Function>());
-        return seastar::make_ready_future<bool>(true);
+        target_function.Reset(isolate, function_val.As<v8::Function>());
+        return true;
     }
 
-    bool run_instance_internal(std::span<char> data) {
+    bool create_context_snapshot(const char* script, size_t script_size) {
+        {
+            v8::SnapshotCreator creator;
+            v8::Isolate* snapshot_isolate = creator.GetIsolate();
+            {
+                v8::HandleScope handle_scope(snapshot_isolate);
+                creator.SetDefaultContext(v8::Context::New(snapshot_isolate));
+
+                v8::TryCatch try_catch(snapshot_isolate);
+                v8::Local<v8::Context> local_ctx = v8::Context::New(snapshot_isolate);
+                v8::Context::Scope context_scope(local_ctx);
+                if (!run_prelude(snapshot_isolate, local_ctx)) {
+                    return false;
+                }
+
+                v8::Local<v8::String> script_code = v8::String::NewFromUtf8(snapshot_isolate, script, v8::NewStringType::kNormal, script_size).ToLocalChecked();
+                v8::Local<v8::Script> compiled_script;
+                v8::Local<v8::Value> result;
+                if (!v8::Script::Compile(local_ctx, script_code).ToLocal(&compiled_script) || !compiled_script->Run(local_ctx).ToLocal(&result)) {
+                    v8::String::Utf8Value error(snapshot_isolate, try_catch.Exception());
+                    std::cout << "Can not compile script: " << std::string(*error, error.length()) << std::endl;
+                    return false;
+                }
+
+                v8::Local<v8::Value> function_val;
+                if (!local_ctx->Global()->Get(local_ctx, v8::String::NewFromUtf8Literal(snapshot_isolate, "user_script")).ToLocal(&function_val) || !function_val->IsFunction()) {
+                    std::cout << "Can not create process for function" << std::endl;
+                    return false;
+                }
+
+                snapshot_context_index = creator.AddContext(local_ctx);
+            }
+            snapshot_blob = creator.CreateBlob(v8::SnapshotCreator::FunctionCodeHandling::kKeep);
+        }
+
+        if (!snapshot_blob.data) {
+            std::cout << "Can not create snapshot of the script context" << std::endl;
+            return false;
+        }
+
+        create_params.snapshot_blob = &snapshot_blob;
+        isolate = v8::Isolate::New(create_params);
+        setup_isolate();
+        return true;
+    }
+
+    bool run_in_fresh_context(std::span<char> data) {
+        std::lock_guard lock{isolate_mutex};
+        idle_gc_done = false;
         v8::Locker locker(isolate);
         v8::Isolate::Scope isolate_scope(isolate);
         v8::HandleScope handle_scope(isolate);
         v8::TryCatch try_catch(isolate);
-        v8::Local<v8::Context> local_ctx = v8::Local<v8::Context>::New(isolate, context);
+
+        auto start = std::chrono::steady_clock::now();
+        v8::Local<v8::Context> local_ctx;
+        if (!v8::Context::FromSnapshot(isolate, snapshot_context_index).ToLocal(&local_ctx)) {
+            std::cout << "Can not restore script context from the snapshot" << std::endl;
+            return false;
+        }
+        fresh_context_creation_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+        fresh_context_count.fetch_add(1, std::memory_order_relaxed);
         v8::Context::Scope context_scope(local_ctx);
+        // native functions can not be snapshotted without external references
+        install_host_api(local_ctx);
+
+        v8::Local<v8::Value> function_val;
+        if (!local_ctx->Global()->Get(local_ctx, v8::String::NewFromUtf8Literal(isolate, "user_script")).ToLocal(&function_val) || !function_val->IsFunction()) {
+            std::cout << "Can not create process for function" << std::endl;
+            return false;
+        }
 
+        return call_user_script(local_ctx, function_val.As<v8::Function>(), data);
+    }
+
+    /// calls user_script of the entered context with the data. a promise
+    /// returned by an async user_script is kept in pending_result until
+    /// drive_host_calls settles it.
+    bool call_user_script(v8::Local<v8::Context> local_ctx, v8::Local<v8::Function> local_function, std::span<char> data, v8::Local<v8::Value>* result_out = nullptr) {
+        v8::TryCatch try_catch(isolate);
         const int argc = 1;
         auto store = v8::ArrayBuffer::NewBackingStore(data.data(), data.size(), v8::BackingStore::EmptyDeleter, nullptr);
         auto array = v8::ArrayBuffer::New(isolate, std::move(store));
         v8::Local<v8::Value> argv[argc] = { array };
         v8::Local<v8::Value> result;
 
-        v8::Local<v8::Function> local_function = v8::Local<v8::Function>::New(isolate, function);
-        if (!local_function->Call(local_ctx, local_ctx->Global(), argc, argv).ToLocal(&result)) {
+        trace_mark(active_trace, invocation_trace::js_started);
+        bool succeeded = local_function->Call(local_ctx, local_ctx->Global(), argc, argv).ToLocal(&result);
+        trace_mark(active_trace, invocation_trace::js_finished);
+        if (!succeeded) {
             v8::String::Utf8Value error(isolate, try_catch.Exception());
             std::cout << "Can not run script: " << std::string(*error, error.length()) << std::endl;
+        } else {
+            if (result_out) {
+                *result_out = result;
+            }
+            isolate->PerformMicrotaskCheckpoint();
+            if (result->IsPromise()) {
+                pending_result.Reset(isolate, result.As<v8::Promise>());
+                pending_context.Reset(isolate, local_ctx);
+                succeeded = check_pending_result();
+            }
+        }
+
+        // host calls of a sync script or a failed call are never awaited
+        if (pending_result.IsEmpty()) {
+            clear_host_calls();
+        }
+
+        // foreground tasks posted by V8 (e.g. finalizing concurrent compilation)
+        // run on the worker which owns the isolate right now
+        if (auto* platform = seastar_v8_platform::current()) {
+            platform->pump_message_loop(isolate);
+        }
+        return succeeded;
+    }
+
+    /// forgets the pending promise once it is settled, returns false if it was rejected
+    bool check_pending_result() {
+        auto promise = pending_result.Get(isolate);
+        switch (promise->State()) {
+        case v8::Promise::kPending:
+            return true;
+        case v8::Promise::kRejected: {
+            v8::String::Utf8Value error(isolate, promise->Result());
+            std::cout << "Script promise is rejected: " << std::string(*error, error.length()) << std::endl;
+            clear_host_calls();
+            return false;
+        }
+        case v8::Promise::kFulfilled:
+            clear_host_calls();
+            return true;
+        }
+        return true;
+    }
+
+    /// the caller holds the isolate's Locker
+    void clear_host_calls() {
+        pending_result.Reset();
+        pending_context.Reset();
+        host_call_resolvers.clear();
+        issued_host_calls.clear();
+    }
+
+    void setup_isolate() {
+        v8::Locker locker(isolate);
+        v8::Isolate::Scope isolate_scope(isolate);
+        // promises resolved by host calls settle only when we run microtasks
+        isolate->SetMicrotasksPolicy(v8::MicrotasksPolicy::kExplicit);
+        profile.apply(isolate);
+        // V8 aborts the process when a heap outgrows its limit, e.g. the
+        // small one of engine_profiles::cold()
+        isolate->AddNearHeapLimitCallback(near_heap_limit_callback, this);
+        isolate->AutomaticallyRestoreInitialHeapLimit();
+    }
+
+    // runs on the worker in a garbage collection. a run near the limit is
+    // canceled, the limit is raised so the script can unwind.
+    static size_t near_heap_limit_callback(void* data, size_t current_heap_limit, size_t initial_heap_limit) {
+        auto* instance = static_cast<v8_instance*>(data);
+        if (instance->isolate->InContext()) {
+            std::cout << "Script ran out of heap, the run is canceled" << std::endl;
+            instance->is_canceled = true;
+            instance->isolate->TerminateExecution();
+        }
+        return current_heap_limit + initial_heap_limit / 4;
+    }
+
+    void install_host_api(v8::Local<v8::Context> local_ctx) {
+        v8::Local<v8::Function> host_call = v8::Function::New(local_ctx, host_call_callback, v8::External::New(isolate, this)).ToLocalChecked();
+        local_ctx->Global()->Set(local_ctx, v8::String::NewFromUtf8Literal(isolate, "host_call"), host_call).Check();
+        v8::Local<v8::Function> dataset = v8::Function::New(local_ctx, dataset_callback, v8::External::New(isolate, this)).ToLocalChecked();
+        local_ctx->Global()->Set(local_ctx, v8::String::NewFromUtf8Literal(isolate, "dataset"), dataset).Check();
+
+        if (env) {
+            v8::Local<v8::Function> kv_get = v8::Function::New(local_ctx, kv_get_callback, v8::External::New(isolate, &env->kv)).ToLocalChecked();
+            v8::Local<v8::Function> kv_put = v8::Function::New(local_ctx, kv_put_callback, v8::External::New(isolate, &env->kv)).ToLocalChecked();
+            local_ctx->Global()->Set(local_ctx, v8::String::NewFromUtf8Literal(isolate, "kv_get"), kv_get).Check();
+            local_ctx->Global()->Set(local_ctx, v8::String::NewFromUtf8Literal(isolate, "kv_put"), kv_put).Check();
+        }
+    }
+
+    // dataset(name) -> SharedArrayBuffer of the current version or undefined.
+    // the isolate maps a version once, writes stay in its copy.
+    static void dataset_callback(const v8::FunctionCallbackInfo<v8::Value>& info) {
+        auto* instance = static_cast<v8_instance*>(info.Data().As<v8::External>()->Value());
+        auto* isolate = info.GetIsolate();
+        if (info.Length() < 1 || !info[0]->IsString()) {
+            isolate->ThrowException(v8::Exception::TypeError(v8::String::NewFromUtf8Literal(isolate, "dataset expects a name")));
+            return;
+        }
+
+        v8::String::Utf8Value name(isolate, info[0]);
+        auto dataset_name = std::string(*name, name.length());
+        auto version = dataset_registry::instance().get(dataset_name);
+        if (!version) {
+            return;
+        }
+
+        auto& mapped = instance->mapped_datasets[dataset_name];
+        if (mapped.version != version) {
+            try {
+                mapped.backing_store = version->map();
+            } catch (const std::exception& e) {
+                instance->mapped_datasets.erase(dataset_name);
+                isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate, e.what()).ToLocalChecked()));
+                return;
+            }
+            mapped.version = std::move(version);
+        }
+        info.GetReturnValue().Set(v8::SharedArrayBuffer::New(isolate, mapped.backing_store));
+    }
+
+    // kv_get(key) -> ArrayBuffer over the stored bytes or undefined, it keeps
+    // its arena chunk alive. V8 has no read-only ArrayBuffers, the view is
+    // read-only by contract: a write changes the stored value in place under
+    // the other readers of the key, kv_put a modified copy instead.
+    static void kv_get_callback(const v8::FunctionCallbackInfo<v8::Value>& info) {
+        auto* store = static_cast<kv_store*>(info.Data().As<v8::External>()->Value());
+        auto* isolate = info.GetIsolate();
+        if (info.Length() < 1) {
+            isolate->ThrowException(v8::Exception::TypeError(v8::String::NewFromUtf8Literal(isolate, "kv_get expects a key")));
+            return;
+        }
+
+        auto key = copy_bytes(isolate, info[0]);
+        auto value = store->get(std::string_view(key.get(), key.size()));
+        if (!value) {
+            return;
+        }
+
+        auto* chunk = new std::shared_ptr<const void>(std::move(value->chunk));
+        auto backing_store = v8::ArrayBuffer::NewBackingStore(const_cast<char*>(value->data), value->size,
+            [](void*, size_t, void* deleter_data){
+                delete static_cast<std::shared_ptr<const void>*>(deleter_data);
+            }, chunk);
+        info.GetReturnValue().Set(v8::ArrayBuffer::New(isolate, std::move(backing_store)));
+    }
+
+    // kv_put(key, value) with strings, ArrayBuffers or views
+    static void kv_put_callback(const v8::FunctionCallbackInfo<v8::Value>& info) {
+        auto* store = static_cast<kv_store*>(info.Data().As<v8::External>()->Value());
+        auto* isolate = info.GetIsolate();
+        if (info.Length() < 2) {
+            isolate->ThrowException(v8::Exception::TypeError(v8::String::NewFromUtf8Literal(isolate, "kv_put expects a key and a value")));
+            return;
+        }
+
+        auto key = copy_bytes(isolate, info[0]);
+        auto value = copy_bytes(isolate, info[1]);
+        store->put(std::string_view(key.get(), key.size()), std::span<const char>(value.get(), value.size()));
+    }
+
+    static seastar::temporary_buffer<char> copy_bytes(v8::Isolate* isolate, v8::Local<v8::Value> value) {
+        if (value->IsArrayBuffer()) {
+            auto store = value.As<v8::ArrayBuffer>()->GetBackingStore();
+            return seastar::temporary_buffer<char>(static_cast<const char*>(store->Data()), store->ByteLength());
+        }
+        if (value->IsArrayBufferView()) {
+            auto view = value.As<v8::ArrayBufferView>();
+            auto store = view->Buffer()->GetBackingStore();
+            return seastar::temporary_buffer<char>(static_cast<const char*>(store->Data()) + view->ByteOffset(), view->ByteLength());
+        }
+        v8::String::Utf8Value string(isolate, value);
+        return seastar::temporary_buffer<char>(*string ? *string : "", string.length());
+    }
+
+    // host_call(name, data) -> Promise<ArrayBuffer>, runs on the worker
+    static void host_call_callback(const v8::FunctionCallbackInfo<v8::Value>& info) {
+        auto* instance = static_cast<v8_instance*>(info.Data().As<v8::External>()->Value());
+        auto* isolate = info.GetIsolate();
+        if (info.Length() < 1 || !info[0]->IsString()) {
+            isolate->ThrowException(v8::Exception::TypeError(v8::String::NewFromUtf8Literal(isolate, "host_call expects a function name")));
+            return;
+        }
+
+        v8::Local<v8::Promise::Resolver> resolver;
+        if (!v8::Promise::Resolver::New(isolate->GetCurrentContext()).ToLocal(&resolver)) {
+            return;
+        }
+
+        v8::String::Utf8Value function_name(isolate, info[0]);
+        auto id = instance->next_host_call_id++;
+        instance->issued_host_calls.push_back(host_call_t{
+            id,
+            std::string(*function_name, function_name.length()),
+            info.Length() > 1 ? copy_bytes(isolate, info[1]) : seastar::temporary_buffer<char>()});
+        instance->host_call_resolvers.emplace(id, v8::Global<v8::Promise::Resolver>(isolate, resolver));
+        info.GetReturnValue().Set(resolver->GetPromise());
+    }
+
+    struct host_call_t {
+        uint64_t id;
+        std::string function_name;
+        seastar::temporary_buffer<char> argument;
+    };
+
+    struct host_call_result_t {
+        uint64_t id;
+        seastar::temporary_buffer<char> result;
+        std::exception_ptr error;
+    };
+
+    // shared with the host calls, which may outlive a canceled run
+    struct host_calls_state {
+        size_t outstanding = 0;
+        std::vector<host_call_result_t> completed;
+        std::vector<host_call_result_t> resuming;
+        seastar::condition_variable on_completed;
+    };
+
+    struct pipeline_state {
+        std::vector<v8_instance*> stages;
+        std::vector<seastar::semaphore_units<>> units;
+        // the first stage which has not finished yet
+        size_t next = 0;
+        // the stage the watchdog terminates, written by the worker
+        std::atomic<size_t> current{0};
+        bool failed = false;
+        seastar::timer<seastar::lowres_clock> watchdog;
+    };
+
+    /// runs the stages starting from state.next on a worker, returns early
+    /// when a stage fails or leaves a pending promise
+    static void run_pipeline_stages(pipeline_state& state, std::span<char> data) {
+        for (; state.next < state.stages.size(); state.next++) {
+            auto* stage = state.stages[state.next];
+            state.current.store(state.next);
+            if (!stage->run_instance_internal(data) || stage->is_canceled) {
+                state.failed = true;
+                return;
+            }
+            if (!stage->pending_result.IsEmpty()) {
+                return;
+            }
+        }
+    }
+
+    /// runs host calls issued by an async script on the reactor and re-enters
+    /// the isolate on a worker whenever some of them complete, until the
+    /// promise returned by user_script settles or the run is canceled. the
+    /// caller holds mtx. returns false if the promise was rejected or abandoned.
+    seastar::future<bool> drive_host_calls(v::ThreadPool& thread_pool) {
+        if (pending_result.IsEmpty()) {
+            return seastar::make_ready_future<bool>(true);
+        }
+
+        async_succeeded = true;
+        auto state = seastar::make_lw_shared<host_calls_state>();
+        waiting_host_calls = state.get();
+        return seastar::repeat([this, &thread_pool, state]{
+            if (pending_result.IsEmpty()) {
+                return seastar::make_ready_future<seastar::stop_iteration>(seastar::stop_iteration::yes);
+            }
+
+            for (auto& call : std::exchange(issued_host_calls, {})) {
+                start_host_call(state, std::move(call));
+            }
+            if (state->outstanding == 0 && state->completed.empty()) {
+                std::cout << "Script awaits a promise the host never settles" << std::endl;
+                return abandon_host_calls(thread_pool);
+            }
+
+            return state->on_completed.wait([this, state]{
+                return !state->completed.empty() || is_canceled;
+            })
+            .then([this, &thread_pool, state]{
+                if (is_canceled) {
+                    return abandon_host_calls(thread_pool);
+                }
+
+                state->resuming = std::exchange(state->completed, {});
+                return thread_pool.submit([this, state](){
+                    resume_host_calls(state->resuming);
+                })
+                .then([]{
+                    return seastar::stop_iteration::no;
+                });
+            });
+        })
+        .then([this, state]{
+            // the calls the script did not await complete before the next run,
+            // unless the run was canceled, a hung one must not hold mtx
+            return state->on_completed.wait([this, state]{
+                return state->outstanding == 0 || is_canceled;
+            });
+        })
+        .finally([this]{
+            waiting_host_calls = nullptr;
+        })
+        .then([this]{
+            return async_succeeded;
+        });
+    }
+
+    void start_host_call(const seastar::lw_shared_ptr<host_calls_state>& state, host_call_t call) {
+        auto function_it = env ? env->host_functions.find(call.function_name) : host_functions_t::iterator{};
+        if (!env || function_it == env->host_functions.end()) {
+            state->completed.push_back(host_call_result_t{call.id, {}, std::make_exception_ptr(std::runtime_error("unknown host function " + call.function_name))});
+            return;
+        }
+
+        state->outstanding++;
+        (void)seastar::futurize_invoke(function_it->second, std::move(call.argument))
+        .then_wrapped([state, id = call.id](auto f){
+            if (f.failed()) {
+                state->completed.push_back(host_call_result_t{id, {}, f.get_exception()});
+            } else {
+                state->completed.push_back(host_call_result_t{id, f.get(), nullptr});
+            }
+            state->outstanding--;
+            state->on_completed.signal();
+        });
+    }
+
+    /// forgets the pending promise. the watchdog may have terminated the
+    /// isolate while no script ran, the termination must not hit the next run.
+    seastar::future<seastar::stop_iteration> abandon_host_calls(v::ThreadPool& thread_pool) {
+        async_succeeded = false;
+        return thread_pool.submit([this](){
+            std::lock_guard lock{isolate_mutex};
+            v8::Locker locker(isolate);
+            v8::Isolate::Scope isolate_scope(isolate);
+            clear_host_calls();
+            continue_execution();
+        })
+        .then([]{
+            return seastar::stop_iteration::yes;
+        });
+    }
+
+    /// settles the promises of completed host calls and runs the microtasks
+    /// waiting for them
+    void resume_host_calls(std::vector<host_call_result_t>& completed) {
+        std::lock_guard lock{isolate_mutex};
+        idle_gc_done = false;
+        v8::Locker locker(isolate);
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        continue_execution();
+        v8::Local<v8::Context> local_ctx = pending_context.Get(isolate);
+        v8::Context::Scope context_scope(local_ctx);
+        v8::TryCatch try_catch(isolate);
+
+        for (auto& call : completed) {
+            auto resolver_it = host_call_resolvers.find(call.id);
+            if (resolver_it == host_call_resolvers.end()) {
+                continue;
+            }
+
+            auto resolver = resolver_it->second.Get(isolate);
+            if (call.error) {
+                std::string message;
+                try {
+                    std::rethrow_exception(call.error);
+                } catch (const std::exception& e) {
+                    message = e.what();
+                } catch (...) {
+                    message = "host call failed";
+                }
+                // fails only while the isolate is terminating, the run is canceled then
+                resolver->Reject(local_ctx, v8::Exception::Error(v8::String::NewFromUtf8(isolate, message.c_str()).ToLocalChecked())).FromMaybe(false);
+            } else {
+                auto result = v8::ArrayBuffer::New(isolate, call.result.size());
+                std::memcpy(result->GetBackingStore()->Data(), call.result.get(), call.result.size());
+                resolver->Resolve(local_ctx, result).FromMaybe(false);
+            }
+            host_call_resolvers.erase(resolver_it);
+        }
+
+        isolate->PerformMicrotaskCheckpoint();
+        async_succeeded = check_pending_result();
+        if (auto* platform = seastar_v8_platform::current()) {
+            platform->pump_message_loop(isolate);
+        }
+    }
+
+    /// creates the isolate of a lazy instance on a worker. the caller holds mtx.
+    seastar::future<bool> ensure_materialized(v::ThreadPool& thread_pool) {
+        if (isolate) {
+            return seastar::make_ready_future<bool>(true);
+        }
+
+        return seastar::do_with(false, [this, &thread_pool](bool& materialized){
+            return thread_pool.submit([this, &materialized](){
+                std::lock_guard lock{isolate_mutex};
+                isolate = v8::Isolate::New(create_params);
+                setup_isolate();
+                materialized = compile_source(source.get(), source.size(), context) && bind_function(context, function);
+                if (!materialized) {
+                    dispose_isolate();
+                }
+            })
+            .then([&materialized]{
+                return materialized;
+            });
+        });
+    }
+
+    void dispose_isolate() {
+        {
+            v8::Locker locker(isolate);
+            v8::Isolate::Scope isolate_scope(isolate);
+            if (cpu_profiler) {
+                cpu_profiler->Dispose();
+                cpu_profiler = nullptr;
+            }
+            context.Reset();
+            function.Reset();
+            lazy_json_template.Reset();
+            tenants.clear();
+            clear_host_calls();
+        }
+        isolate->Dispose();
+        mapped_datasets.clear();
+        if (auto* platform = seastar_v8_platform::current()) {
+            platform->notify_isolate_shutdown(isolate);
+        }
+        isolate = nullptr;
+        heap_sampling = false;
+        idle_gc_done = false;
+    }
+
+    bool run_instance_internal(std::span<char> data) {
+        if (mode == instance_mode::fresh_context) {
+            return run_in_fresh_context(data);
+        }
+        return run_function(context, function, data);
+    }
+
+    bool run_batch_internal(std::vector<seastar::temporary_buffer<char>>& records, std::vector<seastar::temporary_buffer<char>>& outputs) {
+        std::lock_guard lock{isolate_mutex};
+        idle_gc_done = false;
+        if (function.IsEmpty()) {
+            std::cout << "Can not run script: no user_script in the context" << std::endl;
             return false;
         }
 
+        v8::Locker locker(isolate);
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        v8::Local<v8::Context> local_ctx = v8::Local<v8::Context>::New(isolate, context);
+        v8::Context::Scope context_scope(local_ctx);
+        v8::Local<v8::Function> local_function = v8::Local<v8::Function>::New(isolate, function);
+
+        for (auto& record : records) {
+            // handles of a record die with its output copy
+            v8::HandleScope record_scope(isolate);
+            v8::Local<v8::Value> result;
+            if (!call_user_script(local_ctx, local_function, std::span<char>(record.get_write(), record.size()), &result)) {
+                return false;
+            }
+            if (!pending_result.IsEmpty()) {
+                std::cout << "Can not run script: async scripts can not process batches" << std::endl;
+                clear_host_calls();
+                return false;
+            }
+            if (!result.IsEmpty() && result->IsPromise()) {
+                result = result.As<v8::Promise>()->Result();
+            }
+            if (!result.IsEmpty() && !result->IsNullOrUndefined()) {
+                outputs.push_back(copy_bytes(isolate, result));
+            }
+        }
+
+        v8::HeapStatistics heap_statistics;
+        isolate->GetHeapStatistics(&heap_statistics);
+        last_heap_size = heap_statistics.total_physical_size();
         return true;
     }
 
+    bool run_json_internal(std::string_view input, json_parsing parsing, seastar::temporary_buffer<char>& output) {
+        std::lock_guard lock{isolate_mutex};
+        idle_gc_done = false;
+        if (function.IsEmpty()) {
+            std::cout << "Can not run script: no user_script in the context" << std::endl;
+            return false;
+        }
+
+        v8::Locker locker(isolate);
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        v8::Local<v8::Context> local_ctx = v8::Local<v8::Context>::New(isolate, context);
+        v8::Context::Scope context_scope(local_ctx);
+        v8::TryCatch try_catch(isolate);
+
+        // the index and the lazy document only live for the call
+        lazy_json_document lazy_document;
+        v8::Local<v8::Value> document;
+        v8::Local<v8::Object> lazy_object;
+        if (parsing == json_parsing::lazy && lazy_document.index.build(input)) {
+            lazy_object = lazy_json_template_for_isolate()->NewInstance(local_ctx).ToLocalChecked();
+            // non-masking interceptors are skipped for names found on the prototype chain,
+            // e.g. a "constructor" or "toString" field, so the lazy object has no prototype
+            lazy_object->SetPrototype(local_ctx, v8::Null(isolate)).Check();
+            lazy_object->SetAlignedPointerInInternalField(0, &lazy_document);
+            document = lazy_object;
+        } else {
+            v8::Local<v8::String> json = v8::String::NewFromUtf8(isolate, input.data(), v8::NewStringType::kNormal, input.size()).ToLocalChecked();
+            if (!v8::JSON::Parse(local_ctx, json).ToLocal(&document)) {
+                v8::String::Utf8Value error(isolate, try_catch.Exception());
+                std::cout << "Can not parse JSON: " << std::string(*error, error.length()) << std::endl;
+                return false;
+            }
+        }
+
+        v8::Local<v8::Function> local_function = v8::Local<v8::Function>::New(isolate, function);
+        v8::Local<v8::Value> argv[] = { document };
+        v8::Local<v8::Value> result;
+        bool succeeded = local_function->Call(local_ctx, local_ctx->Global(), 1, argv).ToLocal(&result);
+        if (succeeded && result->IsPromise()) {
+            isolate->PerformMicrotaskCheckpoint();
+            auto promise = result.As<v8::Promise>();
+            if (promise->State() != v8::Promise::kFulfilled) {
+                std::cout << "Can not run script: async scripts can not be called with JSON" << std::endl;
+                succeeded = false;
+            } else {
+                result = promise->Result();
+            }
+        }
+        // host calls are never awaited here
+        clear_host_calls();
+
+        v8::Local<v8::String> json_result;
+        if (succeeded && !result->IsUndefined()) {
+            succeeded = v8::JSON::Stringify(local_ctx, result).ToLocal(&json_result);
+            if (succeeded) {
+                output = seastar::temporary_buffer<char>(json_result->Utf8Length(isolate));
+                json_result->WriteUtf8(isolate, output.get_write(), output.size(), nullptr, v8::String::NO_NULL_TERMINATION);
+            }
+        }
+        if (!succeeded && try_catch.HasCaught()) {
+            v8::String::Utf8Value error(isolate, try_catch.Exception());
+            std::cout << "Can not run script: " << std::string(*error, error.length()) << std::endl;
+        }
+
+        // a script may keep the document, its fields are gone with the index
+        if (!lazy_object.IsEmpty()) {
+            lazy_object->SetAlignedPointerInInternalField(0, nullptr);
+        }
+
+        if (auto* platform = seastar_v8_platform::current()) {
+            platform->pump_message_loop(isolate);
+        }
+        v8::HeapStatistics heap_statistics;
+        isolate->GetHeapStatistics(&heap_statistics);
+        last_heap_size = heap_statistics.total_physical_size();
+        return succeeded;
+    }
+
+    struct lazy_json_document {
+        json_index index;
+        std::unordered_set<std::string> deleted;
+
+        std::optional<std::string_view> find(v8::Isolate* isolate, v8::Local<v8::Name> property, std::string& key) const {
+            if (!property->IsString()) {
+                return std::nullopt;
+            }
+            v8::String::Utf8Value name(isolate, property);
+            key.assign(*name, name.length());
+            if (deleted.contains(key)) {
+                return std::nullopt;
+            }
+            return index.find(key);
+        }
+    };
+
+    static lazy_json_document* lazy_document_of(const v8::PropertyCallbackInfo<auto>& info) {
+        return static_cast<lazy_json_document*>(info.Holder()->GetAlignedPointerFromInternalField(0));
+    }
+
+    /// objects whose missing properties are looked up in a lazy_json_document
+    v8::Local<v8::ObjectTemplate> lazy_json_template_for_isolate() {
+        if (!lazy_json_template.IsEmpty()) {
+            return lazy_json_template.Get(isolate);
+        }
+
+        auto object_template = v8::ObjectTemplate::New(isolate);
+        object_template->SetInternalFieldCount(1);
+        // parsed fields become own properties, non-masking skips the interceptor for them
+        object_template->SetHandler(v8::NamedPropertyHandlerConfiguration(
+            lazy_json_getter, nullptr, lazy_json_query, lazy_json_deleter, lazy_json_enumerator, v8::Local<v8::Value>(),
+            static_cast<v8::PropertyHandlerFlags>(static_cast<int>(v8::PropertyHandlerFlags::kNonMasking) | static_cast<int>(v8::PropertyHandlerFlags::kOnlyInterceptStrings))));
+        lazy_json_template.Reset(isolate, object_template);
+        return object_template;
+    }
+
+    static void lazy_json_getter(v8::Local<v8::Name> property, const v8::PropertyCallbackInfo<v8::Value>& info) {
+        auto* document = lazy_document_of(info);
+        std::string key;
+        auto* isolate = info.GetIsolate();
+        auto raw_value = document ? document->find(isolate, property, key) : std::nullopt;
+        if (!raw_value) {
+            return;
+        }
+
+        auto context = isolate->GetCurrentContext();
+        v8::Local<v8::Value> value;
+        auto json = v8::String::NewFromUtf8(isolate, raw_value->data(), v8::NewStringType::kNormal, raw_value->size()).ToLocalChecked();
+        if (!v8::JSON::Parse(context, json).ToLocal(&value)) {
+            return;
+        }
+        info.Holder()->CreateDataProperty(context, property, value).Check();
+        info.GetReturnValue().Set(value);
+    }
+
+    static void lazy_json_query(v8::Local<v8::Name> property, const v8::PropertyCallbackInfo<v8::Integer>& info) {
+        auto* document = lazy_document_of(info);
+        std::string key;
+        if (document && document->find(info.GetIsolate(), property, key)) {
+            info.GetReturnValue().Set(v8::PropertyAttribute::None);
+        }
+    }
+
+    static void lazy_json_deleter(v8::Local<v8::Name> property, const v8::PropertyCallbackInfo<v8::Boolean>& info) {
+        auto* document = lazy_document_of(info);
+        std::string key;
+        if (document && document->find(info.GetIsolate(), property, key)) {
+            document->deleted.insert(std::move(key));
+        }
+    }
+
+    static void lazy_json_enumerator(const v8::PropertyCallbackInfo<v8::Array>& info) {
+        auto* document = lazy_document_of(info);
+        if (!document) {
+            return;
+        }
+
+        auto* isolate = info.GetIsolate();
+        std::vector<v8::Local<v8::Value>> names;
+        for (auto key : document->index.field_names()) {
+            if (!document->deleted.contains(std::string(key))) {
+                names.push_back(v8::String::NewFromUtf8(isolate, key.data(), v8::NewStringType::kNormal, key.size()).ToLocalChecked());
+            }
+        }
+        info.GetReturnValue().Set(v8::Array::New(isolate, names.data(), names.size()));
+    }
+
+    bool run_function(const v8::Global<v8::Context>& function_context, const v8::Global<v8::Function>& user_function, std::span<char> data) {
+        std::lock_guard lock{isolate_mutex};
+        idle_gc_done = false;
+        if (user_function.IsEmpty()) {
+            std::cout << "Can not run script: no user_script in the context" << std::endl;
+            return false;
+        }
+
+        v8::Locker locker(isolate);
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        v8::Local<v8::Context> local_ctx = v8::Local<v8::Context>::New(isolate, function_context);
+        v8::Context::Scope context_scope(local_ctx);
+
+        v8::Local<v8::Function> local_function = v8::Local<v8::Function>::New(isolate, user_function);
+        bool succeeded = call_user_script(local_ctx, local_function, data);
+
+        v8::HeapStatistics heap_statistics;
+        isolate->GetHeapStatistics(&heap_statistics);
+        last_heap_size = heap_statistics.total_physical_size();
+        return succeeded;
+    }
+
+public:
+    // position in the storage's eviction order of lazy instances
+    boost::intrusive::list_member_hook<boost::intrusive::link_mode<boost::intrusive::auto_unlink>> lru_link;
+    // work the storage started on the instance, it is destroyed once the gate is closed
+    seastar::gate pending_work;
+
+private:
     v8::Isolate::CreateParams create_params;
+    const instance_mode mode;
+    const engine_profile profile;
     v8::Isolate* isolate{};
 
+    host_environment* env;
+
+    // state of an async user_script call, touched by one worker or the
+    // reactor at a time while mtx is held
+    v8::Global<v8::Promise> pending_result;
+    v8::Global<v8::Context> pending_context;
+    std::vector<host_call_t> issued_host_calls;
+    std::unordered_map<uint64_t, v8::Global<v8::Promise::Resolver>> host_call_resolvers;
+    uint64_t next_host_call_id = 0;
+    bool async_succeeded = true;
+    // trace of the current run_instance/run_context call, read by the worker
+    invocation_trace* active_trace = nullptr;
+    // host calls of the run waiting for them, woken by cancel_run
+    host_calls_state* waiting_host_calls = nullptr;
+
+    struct mapped_dataset {
+        std::shared_ptr<dataset_version> version;
+        std::shared_ptr<v8::BackingStore> backing_store;
+    };
+    // the isolate's mappings of the datasets it asked for, under isolate_mutex
+    std::unordered_map<std::string, mapped_dataset> mapped_datasets;
+
+    // the isolate of the fresh_context mode is created from this blob
+    v8::StartupData snapshot_blob{nullptr, 0};
+    size_t snapshot_context_index = 0;
+    std::atomic<uint64_t> fresh_context_count{0};
+    std::atomic<uint64_t> fresh_context_creation_ns{0};
+
+    seastar::temporary_buffer<char> source;
+    std::unique_ptr<v8::ScriptCompiler::CachedData> code_cache;
+    size_t last_heap_size = 0;
+
     v8::Global<v8::Context> context;
     v8::Global<v8::Function> function;
+    v8::Global<v8::ObjectTemplate> lazy_json_template;
+
+    struct tenant_context {
+        v8::Global<v8::Context> context;
+        v8::Global<v8::Function> function;
+    };
+
+    // scripts sharing this isolate, changed under isolate_mutex while mtx is held
+    std::unordered_map<std::string, tenant_context> tenants;
+
+    class memory_measurement final : public v8::MeasureMemoryDelegate {
+    public:
+        explicit memory_measurement(v8_instance& instance_)
+        : instance(instance_) {}
+
+        bool ShouldMeasure(v8::Local<v8::Context> context) override {
+            return true;
+        }
+
+        // called by a worker which holds isolate_mutex
+        void MeasurementComplete(const std::vector<std::pair<v8::Local<v8::Context>, size_t>>& context_sizes_in_bytes, size_t unattributed_size_in_bytes) override {
+            std::lock_guard lock{instance.context_memory_mutex};
+            for (const auto& [measured_context, size] : context_sizes_in_bytes) {
+                for (const auto& [name, tenant] : instance.tenants) {
+                    if (tenant.context == measured_context) {
+                        instance.context_memory[name] = size;
+                        break;
+                    }
+                }
+            }
+        }
+
+    private:
+        v8_instance& instance;
+    };
+
+    std::mutex context_memory_mutex;
+    std::unordered_map<std::string, size_t> context_memory;
 
     bool is_canceled;
     seastar::timer<seastar::lowres_clock> watchdog;
 
     seastar::semaphore mtx{1};
+
+    v8::CpuProfiler* cpu_profiler{};
+    bool heap_sampling = false;
+
+    // guards isolate usage between run tasks and idle worker threads
+    std::mutex isolate_mutex;
+    std::atomic<bool> idle_gc_done{false};
+    std::atomic<bool> low_memory_pending{false};
 };
\ No newline at end of file
@@ -0,0 +1,277 @@
+#pragma once
+
+#include "libplatform/libplatform.h"
+#include "v8-platform.h"
+#include "v8.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <pthread.h>
+
+/// v8::Platform which keeps V8 away from the seastar reactor cores.
+///
+/// background tasks (concurrent compilation, GC marking, wasm tier-up) run on
+/// a fixed number of threads pinned to the CPU of the native thread pool, and
+/// foreground tasks of an isolate run on whatever worker enters the isolate
+/// next via @c pump_message_loop.
+class seastar_v8_platform final : public v8::Platform {
+    using clock_type = std::chrono::steady_clock;
+    using delayed_tasks_t = std::multimap<clock_type::time_point, std::unique_ptr<v8::Task>>;
+
+    static clock_type::time_point deadline_after(double delay_in_seconds) {
+        return clock_type::now() + std::chrono::duration_cast<clock_type::duration>(
+            std::chrono::duration<double>(delay_in_seconds));
+    }
+
+    class foreground_task_runner final : public v8::TaskRunner {
+    public:
+        void PostTask(std::unique_ptr<v8::Task> task) override {
+            std::lock_guard lock{mutex};
+            tasks.push_back(std::move(task));
+        }
+
+        void PostNonNestableTask(std::unique_ptr<v8::Task> task) override {
+            PostTask(std::move(task));
+        }
+
+        void PostDelayedTask(std::unique_ptr<v8::Task> task, double delay_in_seconds) override {
+            std::lock_guard lock{mutex};
+            delayed_tasks.emplace(deadline_after(delay_in_seconds), std::move(task));
+        }
+
+        void PostNonNestableDelayedTask(std::unique_ptr<v8::Task> task, double delay_in_seconds) override {
+            PostDelayedTask(std::move(task), delay_in_seconds);
+        }
+
+        void PostIdleTask(std::unique_ptr<v8::IdleTask> task) override {
+            // idle tasks are disabled, see IdleTasksEnabled()
+        }
+
+        bool IdleTasksEnabled() override {
+            return false;
+        }
+
+        // tasks are only run from pump_message_loop which is never nested
+        bool NonNestableTasksEnabled() const override {
+            return true;
+        }
+
+        bool NonNestableDelayedTasksEnabled() const override {
+            return true;
+        }
+
+        bool has_ready_tasks() {
+            std::lock_guard lock{mutex};
+            return !tasks.empty() || (!delayed_tasks.empty() && delayed_tasks.begin()->first <= clock_type::now());
+        }
+
+        /// runs the tasks which are ready at the moment of the call, tasks
+        /// posted by them wait for the next pump
+        size_t run_ready_tasks() {
+            std::deque<std::unique_ptr<v8::Task>> ready;
+            {
+                std::lock_guard lock{mutex};
+                auto now = clock_type::now();
+                while (!delayed_tasks.empty() && delayed_tasks.begin()->first <= now) {
+                    tasks.push_back(std::move(delayed_tasks.begin()->second));
+                    delayed_tasks.erase(delayed_tasks.begin());
+                }
+                ready.swap(tasks);
+            }
+
+            for (auto& task : ready) {
+                task->Run();
+            }
+            return ready.size();
+        }
+
+    private:
+        std::mutex mutex;
+        std::deque<std::unique_ptr<v8::Task>> tasks;
+        delayed_tasks_t delayed_tasks;
+    };
+
+public:
+    /**
+     * @param n_threads the number of background threads, at least 1: V8
+     *                  posts tasks it waits for, such as concurrent
+     *                  compilation and GC, which would never run without one
+     * @param cpu_id the CPU core of the native thread pool the background
+     *               threads share
+     * @throws std::invalid_argument if @c n_threads is 0
+     */
+    seastar_v8_platform(size_t n_threads, unsigned cpu_id) {
+        if (n_threads == 0) {
+            throw std::invalid_argument("V8 platform needs at least one background thread");
+        }
+        for (size_t i = 0; i < n_threads; i++) {
+            threads.emplace_back([this, cpu_id] {
+                pin(cpu_id);
+                loop();
+            });
+        }
+        current_platform = this;
+    }
+
+    ~seastar_v8_platform() override {
+        {
+            std::lock_guard lock{mutex};
+            stopping = true;
+        }
+        cond.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        current_platform = nullptr;
+    }
+
+    /// the platform installed by storage_t::init_v8, if any
+    static seastar_v8_platform* current() {
+        return current_platform;
+    }
+
+    /// runs ready foreground tasks of @c isolate. the caller has to hold the
+    /// isolate's v8::Locker.
+    size_t pump_message_loop(v8::Isolate* isolate) {
+        return get_runner(isolate)->run_ready_tasks();
+    }
+
+    bool has_foreground_tasks(v8::Isolate* isolate) {
+        std::lock_guard lock{runners_mutex};
+        auto it = runners.find(isolate);
+        return it != runners.end() && it->second->has_ready_tasks();
+    }
+
+    /// drops pending foreground tasks of a disposed isolate
+    void notify_isolate_shutdown(v8::Isolate* isolate) {
+        std::lock_guard lock{runners_mutex};
+        runners.erase(isolate);
+    }
+
+    size_t background_queue_length() const {
+        return queue_length.load(std::memory_order_relaxed);
+    }
+
+    uint64_t background_tasks_completed() const {
+        return tasks_completed.load(std::memory_order_relaxed);
+    }
+
+    int NumberOfWorkerThreads() override {
+        return static_cast<int>(threads.size());
+    }
+
+    std::shared_ptr<v8::TaskRunner> GetForegroundTaskRunner(v8::Isolate* isolate) override {
+        return get_runner(isolate);
+    }
+
+    void CallOnWorkerThread(std::unique_ptr<v8::Task> task) override {
+        {
+            std::lock_guard lock{mutex};
+            tasks.push_back(std::move(task));
+        }
+        queue_length.fetch_add(1, std::memory_order_relaxed);
+        cond.notify_one();
+    }
+
+    void CallDelayedOnWorkerThread(std::unique_ptr<v8::Task> task, double delay_in_seconds) override {
+        {
+            std::lock_guard lock{mutex};
+            delayed_tasks.emplace(deadline_after(delay_in_seconds), std::move(task));
+        }
+        queue_length.fetch_add(1, std::memory_order_relaxed);
+        // the earliest deadline may have changed
+        cond.notify_one();
+    }
+
+    std::unique_ptr<v8::JobHandle> PostJob(v8::TaskPriority priority, std::unique_ptr<v8::JobTask> job_task) override {
+        return v8::platform::NewDefaultJobHandle(this, priority, std::move(job_task), threads.size());
+    }
+
+    double MonotonicallyIncreasingTime() override {
+        return std::chrono::duration<double>(clock_type::now().time_since_epoch()).count();
+    }
+
+    double CurrentClockTimeMillis() override {
+        return SystemClockTimeMillis();
+    }
+
+    v8::TracingController* GetTracingController() override {
+        return &tracing_controller;
+    }
+
+private:
+    void loop() {
+        for (;;) {
+            std::unique_ptr<v8::Task> task;
+            {
+                std::unique_lock lock{mutex};
+                for (;;) {
+                    if (stopping) {
+                        return;
+                    }
+                    auto now = clock_type::now();
+                    while (!delayed_tasks.empty() && delayed_tasks.begin()->first <= now) {
+                        tasks.push_back(std::move(delayed_tasks.begin()->second));
+                        delayed_tasks.erase(delayed_tasks.begin());
+                    }
+                    if (!tasks.empty()) {
+                        task = std::move(tasks.front());
+                        tasks.pop_front();
+                        break;
+                    }
+                    if (delayed_tasks.empty()) {
+                        cond.wait(lock);
+                    } else {
+                        cond.wait_until(lock, delayed_tasks.begin()->first);
+                    }
+                }
+            }
+            queue_length.fetch_sub(1, std::memory_order_relaxed);
+            task->Run();
+            tasks_completed.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    static void pin(unsigned cpu_id) {
+        cpu_set_t cs;
+        CPU_ZERO(&cs);
+        CPU_SET(cpu_id, &cs);
+        [[maybe_unused]] auto r = pthread_setaffinity_np(
+          pthread_self(), sizeof(cs), &cs);
+    }
+
+    std::shared_ptr<foreground_task_runner> get_runner(v8::Isolate* isolate) {
+        std::lock_guard lock{runners_mutex};
+        auto& runner = runners[isolate];
+        if (!runner) {
+            runner = std::make_shared<foreground_task_runner>();
+        }
+        return runner;
+    }
+
+    inline static seastar_v8_platform* current_platform = nullptr;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool stopping = false;
+    std::deque<std::unique_ptr<v8::Task>> tasks;
+    delayed_tasks_t delayed_tasks;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> queue_length{0};
+    std::atomic<uint64_t> tasks_completed{0};
+
+    std::mutex runners_mutex;
+    std::unordered_map<v8::Isolate*, std::shared_ptr<foreground_task_runner>> runners;
+
+    v8::TracingController tracing_controller;
+};
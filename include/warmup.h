@@ -0,0 +1,87 @@
+#pragma once
+
+#include "latency-histogram.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <functional>
+#include <optional>
+#include <string>
+
+struct warmup_options {
+    // runs of the script per round, the corpus is cycled through
+    size_t runs_per_round = 200;
+    size_t min_rounds = 3;
+    // the script is taken as warm after that many rounds even if it did not converge
+    size_t max_rounds = 50;
+    // a round converged when its median latency is within this share of the previous one's
+    double tolerance = 0.05;
+    // converged rounds in a row which make the script warm
+    size_t stable_rounds = 3;
+    // bytes of the zeroed input used when no corpus and no synthetic_input are given
+    size_t synthetic_input_size = 64;
+    // makes the input of the n-th run when no corpus is given. a zeroed input
+    // skips the loops of scripts which take their bounds from it, as
+    // sum_array.js does, so the code which should tier up never runs
+    std::function<std::string(size_t run)> synthetic_input;
+};
+
+struct warmup_result {
+    bool converged = false;
+    size_t rounds = 0;
+    size_t runs = 0;
+    // of the first and the last round
+    std::chrono::nanoseconds first_median{0};
+    std::chrono::nanoseconds last_median{0};
+};
+
+/**
+ * decides when a script is warm by the latencies of its runs. V8 has no
+ * public API telling whether the hot functions reached the optimizing tier,
+ * but a script tiering up runs faster with every round until its code
+ * settles, so the script is taken as warm once the median latency of a round
+ * stops changing.
+ */
+class warmup_tracker {
+public:
+    explicit warmup_tracker(warmup_options options_)
+    : options(options_) {}
+
+    void record(std::chrono::nanoseconds latency) {
+        round.record(latency);
+        result.runs++;
+    }
+
+    bool round_complete() const {
+        return round.count() >= options.runs_per_round;
+    }
+
+    /// closes the round, @return true if the warmup is over
+    bool finish_round() {
+        auto median = round.percentile(0.5);
+        round = latency_histogram{};
+        if (result.rounds == 0) {
+            result.first_median = median;
+        } else {
+            double previous = result.last_median.count();
+            bool stable = previous > 0 && std::abs(median.count() - previous) <= options.tolerance * previous;
+            stable_rounds = stable ? stable_rounds + 1 : 0;
+        }
+        result.last_median = median;
+        result.rounds++;
+
+        result.converged = result.rounds >= options.min_rounds && stable_rounds >= options.stable_rounds;
+        return result.converged || result.rounds >= options.max_rounds;
+    }
+
+    const warmup_result& outcome() const {
+        return result;
+    }
+
+private:
+    const warmup_options options;
+    latency_histogram round;
+    size_t stable_rounds = 0;
+    warmup_result result;
+};
@@ -2,25 +2,31 @@
 #include "seastar/core/future.hh"
 #include "seastar/core/app-template.hh"
 #include "seastar/core/shared_ptr.hh"
+#include "admin-server.h"
+#include "example-prelude.h"
+#include "latency-histogram.h"
 #include "storage.h"
 
 #include "native_thread_pool.h"
 #include "v8.h"
 
+#include <boost/program_options.hpp>
+#include <boost/range/irange.hpp>
+
+#include <algorithm>
+#include <array>
 #include <cstdlib>
+#include <cstring>
 #include <memory>
+#include <string>
+#include <vector>
 
+namespace bpo = boost::program_options;
 
-struct test_sum_t {
-    int a;
-    int b;
-
-    int ans;
-};
 
 seastar::future<> run_simple(std::unique_ptr<storage_t>& storage_ptr) {
-    auto* raw_ptr = new char[sizeof(test_sum_t)];
-    auto* obj_ptr = reinterpret_cast<test_sum_t*>(raw_ptr);
+    auto* raw_ptr = new (std::align_val_t(alignof(test_sum_t))) char[sizeof(test_sum_t)];
+    auto* obj_ptr = &test_sum_binding.view(std::span<char>(raw_ptr, sizeof(test_sum_t)));
     obj_ptr->a = 1;
     obj_ptr->b = 3;
     obj_ptr->ans = 0;
@@ -30,15 +36,48 @@ seastar::future<> run_simple(std::unique_ptr<storage_t>& storage_ptr) {
     return storage_ptr->run_instance("simple_sum", data_span)
     .then([raw_ptr, obj_ptr](auto res){
         assert(obj_ptr->ans == obj_ptr->a + obj_ptr->b);
-        delete[] raw_ptr;
-        obj_ptr->~test_sum_t();
+        operator delete[](raw_ptr, std::align_val_t(alignof(test_sum_t)));
         return seastar::make_ready_future<void>();
     });
 }
 
+// scripts of the tenant flooding the shard in run_fairness_benchmark
+constexpr size_t flood_scripts = 4;
+// headroom of run_fairness_benchmark's bound for the dispatcher and the noise of a loaded shard
+constexpr size_t fairness_p99_factor = 4;
+
+// an input of examples/sum_array.js: the count, the sum and the values
+std::string make_sum_array_input(size_t n_values) {
+    std::vector<int32_t> array(n_values + 2, 1);
+    array[0] = n_values;
+    array[1] = 0;
+    return std::string(reinterpret_cast<const char*>(array.data()), array.size() * sizeof(int32_t));
+}
+
+// warms the scripts added with needs_warm_up before they take traffic
+seastar::future<> warm_up_scripts(std::unique_ptr<storage_t>& storage_ptr) {
+    std::vector<std::string> corpus;
+    for (int i = 0; i < 4; i++) {
+        test_sum_t sum{i, i * 7, 0};
+        corpus.emplace_back(reinterpret_cast<const char*>(&sum), sizeof(sum));
+    }
+    // arrays of a few sizes, so the loop runs long enough to tier up
+    warmup_options sum_array_options;
+    sum_array_options.synthetic_input = [](size_t run){
+        return make_sum_array_input(256 << (run % 4));
+    };
+    std::vector<seastar::future<warmup_result>> warmups;
+    warmups.push_back(storage_ptr->warm_up("simple_sum", corpus));
+    warmups.push_back(storage_ptr->warm_up("sum_wasm", corpus));
+    for (size_t i = 0; i < flood_scripts; i++) {
+        warmups.push_back(storage_ptr->warm_up(fmt::format("flood_{}", i), {}, sum_array_options));
+    }
+    return seastar::when_all(warmups.begin(), warmups.end()).discard_result();
+}
+
 seastar::future<> run_wasm_simple(std::unique_ptr<storage_t>& storage_ptr) {
-    auto* raw_ptr = new char[sizeof(test_sum_t)];
-    auto* obj_ptr = reinterpret_cast<test_sum_t*>(raw_ptr);
+    auto* raw_ptr = new (std::align_val_t(alignof(test_sum_t))) char[sizeof(test_sum_t)];
+    auto* obj_ptr = &test_sum_binding.view(std::span<char>(raw_ptr, sizeof(test_sum_t)));
     obj_ptr->a = 1;
     obj_ptr->b = 3;
     obj_ptr->ans = 0;
@@ -48,8 +87,59 @@ seastar::future<> run_wasm_simple(std::unique_ptr<storage_t>& storage_ptr) {
     return storage_ptr->run_instance("sum_wasm", data_span)
     .then([raw_ptr, obj_ptr](auto res){
         assert(obj_ptr->ans == obj_ptr->a + obj_ptr->b);
-        delete[] raw_ptr;
-        obj_ptr->~test_sum_t();
+        operator delete[](raw_ptr, std::align_val_t(alignof(test_sum_t)));
+        return seastar::make_ready_future<void>();
+    });
+}
+
+seastar::future<> run_async_sum(std::unique_ptr<storage_t>& storage_ptr) {
+    auto* raw_ptr = new (std::align_val_t(alignof(test_sum_t))) char[sizeof(test_sum_t)];
+    auto* obj_ptr = &test_sum_binding.view(std::span<char>(raw_ptr, sizeof(test_sum_t)));
+    obj_ptr->a = 1;
+    obj_ptr->b = 3;
+    obj_ptr->ans = 0;
+
+    std::span<char> data_span(raw_ptr, raw_ptr + sizeof(test_sum_t));
+
+    return storage_ptr->run_instance("async_sum", data_span)
+    .then([raw_ptr, obj_ptr](auto res){
+        assert(obj_ptr->ans == obj_ptr->a + obj_ptr->b);
+        operator delete[](raw_ptr, std::align_val_t(alignof(test_sum_t)));
+        return seastar::make_ready_future<void>();
+    });
+}
+
+seastar::future<> run_sum_and_double(std::unique_ptr<storage_t>& storage_ptr) {
+    auto* raw_ptr = new (std::align_val_t(alignof(test_sum_t))) char[sizeof(test_sum_t)];
+    auto* obj_ptr = &test_sum_binding.view(std::span<char>(raw_ptr, sizeof(test_sum_t)));
+    obj_ptr->a = 1;
+    obj_ptr->b = 3;
+    obj_ptr->ans = 0;
+
+    std::span<char> data_span(raw_ptr, raw_ptr + sizeof(test_sum_t));
+
+    return storage_ptr->run_pipeline("sum_and_double", data_span)
+    .then([raw_ptr, obj_ptr](auto res){
+        assert(res && obj_ptr->ans == (obj_ptr->a + obj_ptr->b) * 2);
+        operator delete[](raw_ptr, std::align_val_t(alignof(test_sum_t)));
+        return seastar::make_ready_future<void>();
+    });
+}
+
+// examples/double.js on the reactor thread
+seastar::future<> run_double_in_reactor(std::unique_ptr<storage_t>& storage_ptr) {
+    auto* raw_ptr = new (std::align_val_t(alignof(test_sum_t))) char[sizeof(test_sum_t)];
+    auto* obj_ptr = &test_sum_binding.view(std::span<char>(raw_ptr, sizeof(test_sum_t)));
+    obj_ptr->a = 1;
+    obj_ptr->b = 3;
+    obj_ptr->ans = 5;
+
+    std::span<char> data_span(raw_ptr, raw_ptr + sizeof(test_sum_t));
+
+    return storage_ptr->run_instance("double_in_reactor", data_span)
+    .then([raw_ptr, obj_ptr](auto res){
+        assert(obj_ptr->ans == 10);
+        operator delete[](raw_ptr, std::align_val_t(alignof(test_sum_t)));
         return seastar::make_ready_future<void>();
     });
 }
@@ -64,28 +154,369 @@ seastar::future<> run_loop(std::unique_ptr<storage_t>& storage_ptr) {
     });
 }
 
+// writes newline framed records until the file has @c size_mb megabytes
+seastar::future<> generate_stream_file(const std::string& path, size_t size_mb) {
+    auto flags = seastar::open_flags::wo | seastar::open_flags::create | seastar::open_flags::truncate;
+    return seastar::open_file_dma(path, flags)
+    .then([](seastar::file f){
+        return seastar::make_file_output_stream(std::move(f));
+    })
+    .then([size_mb](seastar::output_stream<char> out){
+        return seastar::do_with(std::move(out), size_t(0), [size_mb](auto& out, size_t& written){
+            return seastar::do_until([&written, size_mb]{ return written >= size_mb << 20; }, [&out, &written]{
+                auto record = fmt::format("{{\"id\":{},\"payload\":\"{:0>80}\"}}\n", written, written);
+                written += record.size();
+                return out.write(record);
+            })
+            .finally([&out]{
+                return out.close();
+            });
+        });
+    });
+}
+
+// runs every record of @c path through examples/passthrough.js and prints the throughput
+seastar::future<> run_stream_benchmark(std::unique_ptr<storage_t>& storage_ptr, const std::string& path, size_t size_mb) {
+    return seastar::file_exists(path)
+    .then([path, size_mb](bool exists){
+        if (exists) {
+            return seastar::make_ready_future<>();
+        }
+        return generate_stream_file(path, size_mb);
+    })
+    .then([path]{
+        return seastar::when_all_succeed(
+            seastar::open_file_dma(path, seastar::open_flags::ro),
+            seastar::open_file_dma(path + ".out", seastar::open_flags::wo | seastar::open_flags::create | seastar::open_flags::truncate));
+    })
+    .then_unpack([&storage_ptr](seastar::file input, seastar::file output){
+        return seastar::make_file_output_stream(std::move(output))
+        .then([&storage_ptr, input = std::move(input)](seastar::output_stream<char> out) mutable {
+            auto in = seastar::make_file_input_stream(std::move(input));
+            return seastar::do_with(std::move(in), std::move(out), std::chrono::steady_clock::now(), [&storage_ptr](auto& in, auto& out, auto start){
+                return storage_ptr->process_stream("passthrough", in, out)
+                .then([start](stream_stats stats){
+                    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                    std::cout << "Stream benchmark: " << stats.records_in << " records, "
+                              << stats.bytes_in / elapsed.count() / (1 << 20) << " MB/s"
+                              << (stats.succeeded ? "" : " (failed)") << std::endl;
+                })
+                .finally([&in, &out]{
+                    return seastar::when_all(in.close(), out.close()).discard_result();
+                });
+            });
+        });
+    });
+}
+
+/// compares passing test_sum_t to a script through its binding with a round
+/// trip of the record through v8::ValueSerializer. blocks, runs on a worker.
+void run_binding_benchmark(size_t iterations) {
+    v8::Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator_shared = std::shared_ptr<v8::ArrayBuffer::Allocator>(v8::ArrayBuffer::Allocator::NewDefaultAllocator());
+    v8::Isolate* isolate = v8::Isolate::New(create_params);
+    {
+        v8::Locker locker(isolate);
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        v8::Local<v8::Context> context = v8::Context::New(isolate);
+        v8::Context::Scope context_scope(context);
+
+        auto source = test_sum_binding.js_class() +
+            "function by_binding(obj) { let sum = new test_sum_t(obj); sum.ans = sum.a + sum.b; }\n"
+            "function by_object(obj) { obj.ans = obj.a + obj.b; }\n";
+        v8::Script::Compile(context, v8::String::NewFromUtf8(isolate, source.c_str()).ToLocalChecked()).ToLocalChecked()->Run(context).ToLocalChecked();
+        auto by_binding = context->Global()->Get(context, v8::String::NewFromUtf8Literal(isolate, "by_binding")).ToLocalChecked().As<v8::Function>();
+        auto by_object = context->Global()->Get(context, v8::String::NewFromUtf8Literal(isolate, "by_object")).ToLocalChecked().As<v8::Function>();
+        auto a = v8::String::NewFromUtf8Literal(isolate, "a");
+        auto b = v8::String::NewFromUtf8Literal(isolate, "b");
+        auto ans = v8::String::NewFromUtf8Literal(isolate, "ans");
+
+        test_sum_t sum{1, 3, 0};
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++) {
+            v8::HandleScope iteration_scope(isolate);
+            auto store = v8::ArrayBuffer::NewBackingStore(&sum, sizeof(sum), v8::BackingStore::EmptyDeleter, nullptr);
+            v8::Local<v8::Value> argv[] = { v8::ArrayBuffer::New(isolate, std::move(store)) };
+            by_binding->Call(context, context->Global(), 1, argv).ToLocalChecked();
+        }
+        std::chrono::duration<double, std::nano> binding_time = std::chrono::steady_clock::now() - start;
+
+        auto serialize = [isolate, context](v8::Local<v8::Value> value){
+            v8::ValueSerializer serializer(isolate);
+            serializer.WriteHeader();
+            serializer.WriteValue(context, value).Check();
+            return serializer.Release();
+        };
+        auto deserialize = [isolate, context](std::pair<uint8_t*, size_t> buffer){
+            v8::ValueDeserializer deserializer(isolate, buffer.first, buffer.second);
+            deserializer.ReadHeader(context).Check();
+            auto value = deserializer.ReadValue(context).ToLocalChecked();
+            free(buffer.first);
+            return value;
+        };
+
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++) {
+            v8::HandleScope iteration_scope(isolate);
+            auto record = v8::Object::New(isolate);
+            record->Set(context, a, v8::Integer::New(isolate, sum.a)).Check();
+            record->Set(context, b, v8::Integer::New(isolate, sum.b)).Check();
+            record->Set(context, ans, v8::Integer::New(isolate, sum.ans)).Check();
+            v8::Local<v8::Value> argv[] = { deserialize(serialize(record)) };
+            by_object->Call(context, context->Global(), 1, argv).ToLocalChecked();
+            auto result = deserialize(serialize(argv[0])).As<v8::Object>();
+            sum.ans = result->Get(context, ans).ToLocalChecked()->Int32Value(context).FromJust();
+        }
+        std::chrono::duration<double, std::nano> serializer_time = std::chrono::steady_clock::now() - start;
+
+        std::cout << "Binding benchmark: struct binding " << binding_time.count() / iterations << " ns/call, "
+                  << "ValueSerializer " << serializer_time.count() / iterations << " ns/call" << std::endl;
+    }
+    isolate->Dispose();
+}
+
+// a document with the fields json_pick.js reads, padded with @c n_items items
+std::string make_json_document(size_t n_items) {
+    std::string document = R"({"id":42,"name":"benchmark","items":[)";
+    for (size_t i = 0; i < n_items; i++) {
+        document += fmt::format(R"({}{{"index":{},"tags":["a","b"],"value":{}}})", i ? "," : "", i, i * 0.5);
+    }
+    document += "]}";
+    return document;
+}
+
+// runs examples/json_pick.js over small and large documents with both parsing modes
+seastar::future<> run_json_benchmark(std::unique_ptr<storage_t>& storage_ptr, size_t iterations) {
+    struct benchmark_case {
+        std::string name;
+        std::string document;
+        json_parsing parsing;
+    };
+    std::vector<benchmark_case> cases;
+    for (auto parsing : {json_parsing::eager, json_parsing::lazy}) {
+        auto mode = parsing == json_parsing::eager ? "eager" : "lazy";
+        cases.push_back({fmt::format("small {}", mode), make_json_document(3), parsing});
+        cases.push_back({fmt::format("large {}", mode), make_json_document(20000), parsing});
+    }
+
+    return seastar::do_with(std::move(cases), [&storage_ptr, iterations](auto& cases){
+        return seastar::do_for_each(cases, [&storage_ptr, iterations](benchmark_case& c){
+            auto start = std::chrono::steady_clock::now();
+            auto calls = boost::irange<size_t>(0, iterations);
+            return seastar::do_for_each(calls.begin(), calls.end(), [&storage_ptr, &c](size_t){
+                return storage_ptr->run_json("json_pick", c.document, c.parsing).discard_result();
+            })
+            .then([&c, start, iterations]{
+                std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+                std::cout << "JSON benchmark " << c.name << " (" << c.document.size() << " bytes): "
+                          << elapsed.count() / iterations << " us/call" << std::endl;
+            });
+        });
+    });
+}
+
+// sequential runs of examples/double.js, their latencies go to @c latencies
+seastar::future<> measure_double_runs(std::unique_ptr<storage_t>& storage_ptr, size_t runs, latency_histogram& latencies) {
+    auto calls = boost::irange<size_t>(0, runs);
+    return seastar::do_with(std::array<int32_t, 3>{}, calls, [&storage_ptr, &latencies](auto& values, auto& calls){
+        return seastar::do_for_each(calls.begin(), calls.end(), [&storage_ptr, &latencies, &values](size_t){
+            auto start = std::chrono::steady_clock::now();
+            return storage_ptr->run_instance("double", std::span<char>(reinterpret_cast<char*>(values.data()), sizeof(values)))
+            .then([&latencies, start](bool){
+                latencies.record(std::chrono::steady_clock::now() - start);
+            });
+        });
+    });
+}
+
+// runs of examples/sum_array.js by 64 fibers over the flood scripts until
+// @c measure completes
+seastar::future<> flood_while(std::unique_ptr<storage_t>& storage_ptr, std::vector<std::vector<int32_t>>& flood_arrays, uint64_t& flood_runs, seastar::future<> measure) {
+    constexpr size_t flood_fibers = 64;
+    return seastar::do_with(false, std::move(measure), [&storage_ptr, &flood_arrays, &flood_runs](bool& stop, auto& measure){
+        auto fibers = boost::irange<size_t>(0, flood_fibers);
+        // the runs of a flood script are serialized by its instance, so they share its array
+        auto flood = seastar::parallel_for_each(fibers, [&storage_ptr, &flood_arrays, &stop, &flood_runs](size_t fiber){
+            return seastar::do_until([&stop]{ return stop; }, [&storage_ptr, &flood_arrays, &flood_runs, script = fiber % flood_scripts]{
+                flood_runs++;
+                auto& array = flood_arrays[script];
+                return storage_ptr->run_instance(fmt::format("flood_{}", script), std::span<char>(reinterpret_cast<char*>(array.data()), array.size() * sizeof(int32_t))).discard_result();
+            });
+        });
+        return std::move(measure)
+        .finally([&stop, flood = std::move(flood)]() mutable {
+            stop = true;
+            return std::move(flood);
+        });
+    });
+}
+
+// sequential runs of the first flood script over @c array
+seastar::future<> measure_flood_runs(std::unique_ptr<storage_t>& storage_ptr, size_t runs, std::vector<int32_t>& array, latency_histogram& latencies) {
+    auto calls = boost::irange<size_t>(0, runs);
+    return seastar::do_with(calls, [&storage_ptr, &array, &latencies](auto& calls){
+        return seastar::do_for_each(calls.begin(), calls.end(), [&storage_ptr, &array, &latencies](size_t){
+            auto start = std::chrono::steady_clock::now();
+            return storage_ptr->run_instance("flood_0", std::span<char>(reinterpret_cast<char*>(array.data()), array.size() * sizeof(int32_t)))
+            .then([&latencies, start](bool){
+                latencies.record(std::chrono::steady_clock::now() - start);
+            });
+        });
+    });
+}
+
+/**
+ * measures runs of examples/double.js alone and while 64 fibers flood the
+ * shard with runs of examples/sum_array.js over 256k values, by
+ * flood_scripts scripts of one tenant, with the fair dispatcher and in
+ * arrival order. the tenant has a run of each script in flight and more
+ * waiting, in arrival order a run of double waits behind them, with the fair
+ * dispatcher behind about one flood run.
+ *
+ * @return false if the fair p99 of double exceeded fairness_p99_factor times
+ *         its p99 alone plus the p99 of a flood run alone
+ */
+seastar::future<bool> run_fairness_benchmark(std::unique_ptr<storage_t>& storage_ptr, size_t runs) {
+    constexpr size_t flood_values = 256 << 10;
+    std::vector<std::vector<int32_t>> flood_arrays(flood_scripts, std::vector<int32_t>(flood_values + 2, 1));
+    for (auto& array : flood_arrays) {
+        array[0] = flood_values;
+    }
+
+    return seastar::do_with(latency_histogram(), latency_histogram(), latency_histogram(), latency_histogram(), std::move(flood_arrays), uint64_t(0), uint64_t(0),
+        [&storage_ptr, runs](auto& alone, auto& flood_alone, auto& fair, auto& unfair, auto& flood_arrays, uint64_t& fair_flood_runs, uint64_t& unfair_flood_runs){
+        return measure_double_runs(storage_ptr, runs, alone)
+        .then([&storage_ptr, runs, &flood_alone, &flood_arrays]{
+            return measure_flood_runs(storage_ptr, std::max<size_t>(runs / 10, 10), flood_arrays[0], flood_alone);
+        })
+        .then([&storage_ptr, runs, &fair, &flood_arrays, &fair_flood_runs]{
+            return flood_while(storage_ptr, flood_arrays, fair_flood_runs, measure_double_runs(storage_ptr, runs, fair));
+        })
+        .then([&storage_ptr, runs, &unfair, &flood_arrays, &unfair_flood_runs]{
+            storage_ptr->set_fair_dispatch(false);
+            return flood_while(storage_ptr, flood_arrays, unfair_flood_runs, measure_double_runs(storage_ptr, runs, unfair))
+            .finally([&storage_ptr]{
+                storage_ptr->set_fair_dispatch(true);
+            });
+        })
+        .then([&alone, &flood_alone, &fair, &unfair, &fair_flood_runs, &unfair_flood_runs]{
+            auto us = [](std::chrono::nanoseconds value){
+                return std::chrono::duration<double, std::micro>(value).count();
+            };
+            std::cout << fmt::format("Fairness benchmark: double.js alone p50 {:.1f} us, p99 {:.1f} us; "
+                                     "under a flood of {} runs, fair p50 {:.1f} us, p99 {:.1f} us; "
+                                     "under a flood of {} runs, in arrival order p50 {:.1f} us, p99 {:.1f} us",
+                us(alone.percentile(0.5)), us(alone.percentile(0.99)),
+                fair_flood_runs, us(fair.percentile(0.5)), us(fair.percentile(0.99)),
+                unfair_flood_runs, us(unfair.percentile(0.5)), us(unfair.percentile(0.99))) << std::endl;
+
+            auto bound = alone.percentile(0.99) * fairness_p99_factor + flood_alone.percentile(0.99);
+            if (fair.percentile(0.99) > bound) {
+                std::cout << fmt::format("Fairness check failed: fair p99 {:.1f} us exceeds {} x p99 alone + p99 of a flood run {:.1f} us = {:.1f} us",
+                    us(fair.percentile(0.99)), fairness_p99_factor, us(flood_alone.percentile(0.99)), us(bound)) << std::endl;
+                return false;
+            }
+            return true;
+        });
+    });
+}
+
+// profiles of the scripts which fit the process configuration, see engine_profile
+void set_engine_profiles(storage_t& storage) {
+    const auto& v8_flags = storage_t::process_v8_flags();
+    if (v8_flags == engine_profiles::jitless().process_flags) {
+        // sum_wasm can not run without a JIT
+        storage.set_engine_profile("json_pick", engine_profiles::jitless());
+    } else if (v8_flags == engine_profiles::wasm_optimized().process_flags) {
+        storage.set_engine_profile("sum_wasm", engine_profiles::wasm_optimized());
+    } else {
+        storage.set_engine_profile("simple_sum", engine_profiles::hot());
+        storage.set_engine_profile("json_pick", engine_profiles::cold());
+    }
+}
+
 int main(int argc, char** argv) {
     seastar::app_template app;
-    return app.run(argc, argv, [] {
-        std::unique_ptr<v::ThreadPool> thread_pool_ptr = std::make_unique<v::ThreadPool>(1, seastar::smp::count, 1);
-        return seastar::do_with(std::move(thread_pool_ptr), [](auto& thread_pool_ptr){
+    app.add_options()
+        ("admin-port", bpo::value<uint16_t>()->default_value(0), "port of the admin HTTP server, 0 disables it")
+        ("stream-benchmark", bpo::value<std::string>()->default_value(""), "newline framed file to stream through a passthrough script, created if missing")
+        ("stream-benchmark-size-mb", bpo::value<size_t>()->default_value(4096), "size of the created stream benchmark file")
+        ("binding-benchmark", bpo::value<size_t>()->default_value(0), "calls of the struct binding vs ValueSerializer benchmark, 0 disables it")
+        ("json-benchmark", bpo::value<size_t>()->default_value(0), "calls per case of the JSON mode benchmark, 0 disables it")
+        ("fairness-benchmark", bpo::value<size_t>()->default_value(500), "measured runs of the fair dispatch benchmark, which fails the process if the fair p99 is unbounded, 0 disables it")
+        ("v8-flags", bpo::value<std::string>()->default_value(""), "V8 flags of the process, selecting the engine profiles of the scripts, e.g. \"--jitless\"")
+        ("max-native-threads", bpo::value<size_t>()->default_value(1), "threads the native pool grows to under load, pinned to the CPUs following the first one");
+
+    return app.run(argc, argv, [&app] {
+        constexpr unsigned native_cpu_id = 1;
+        uint16_t admin_port = app.configuration()["admin-port"].as<uint16_t>();
+        std::string stream_benchmark = app.configuration()["stream-benchmark"].as<std::string>();
+        size_t stream_benchmark_size_mb = app.configuration()["stream-benchmark-size-mb"].as<size_t>();
+        size_t binding_benchmark = app.configuration()["binding-benchmark"].as<size_t>();
+        size_t json_benchmark = app.configuration()["json-benchmark"].as<size_t>();
+        size_t fairness_benchmark = app.configuration()["fairness-benchmark"].as<size_t>();
+        std::string v8_flags = app.configuration()["v8-flags"].as<std::string>();
+        size_t max_native_threads = std::max<size_t>(app.configuration()["max-native-threads"].as<size_t>(), 1);
+        std::vector<unsigned> native_cpu_ids;
+        for (unsigned i = 0; i < max_native_threads; i++) {
+            native_cpu_ids.push_back(native_cpu_id + i);
+        }
+        // enough slots for one shard to keep every thread busy
+        std::unique_ptr<v::ThreadPool> thread_pool_ptr = std::make_unique<v::ThreadPool>(
+            v::PoolSizing{.min_threads = 1, .max_threads = max_native_threads}, max_native_threads * seastar::smp::count, native_cpu_ids);
+        return seastar::do_with(std::move(thread_pool_ptr), 0, [admin_port, stream_benchmark, stream_benchmark_size_mb, binding_benchmark, json_benchmark, fairness_benchmark, v8_flags](auto& thread_pool_ptr, int& exit_code){
             return thread_pool_ptr->start()
-            .then([&thread_pool_ptr](){
+            .then([&thread_pool_ptr, &exit_code, admin_port, stream_benchmark, stream_benchmark_size_mb, binding_benchmark, json_benchmark, fairness_benchmark, v8_flags](){
 
-                std::unique_ptr<v8::Platform> platfrom_ptr = storage_t::init_v8();
-                return seastar::do_with(std::move(platfrom_ptr), [&thread_pool_ptr](auto& platform_ptr){
+                std::unique_ptr<v8::Platform> platfrom_ptr = storage_t::init_v8(1, native_cpu_id, v8_flags);
+                return seastar::do_with(std::move(platfrom_ptr), [&thread_pool_ptr, &exit_code, admin_port, stream_benchmark, stream_benchmark_size_mb, binding_benchmark, json_benchmark, fairness_benchmark](auto& platform_ptr){
 
                     std::unique_ptr<storage_t> storage_ptr = std::make_unique<storage_t>(*thread_pool_ptr);
-                    return seastar::do_with(std::move(storage_ptr), [](auto& storage_ptr){
+                    register_example_prelude(*storage_ptr);
+                    std::unique_ptr<admin_server> admin_ptr = std::make_unique<admin_server>(*storage_ptr);
+                    return seastar::do_with(std::move(storage_ptr), std::move(admin_ptr), [&thread_pool_ptr, &exit_code, admin_port, stream_benchmark, stream_benchmark_size_mb, binding_benchmark, json_benchmark, fairness_benchmark](auto& storage_ptr, auto& admin_ptr){
+                        set_engine_profiles(*storage_ptr);
                         return seastar::when_all(
                             storage_ptr->add_new_instance("loop", "/home/vadim/v8-with-seastar/examples/loop.js"),
-                            storage_ptr->add_new_instance("simple_sum", "/home/vadim/v8-with-seastar/examples/simple.js"),
-                            storage_ptr->add_new_instance("sum_wasm", "/home/vadim/v8-with-seastar/examples/sum_wasm.js")
+                            storage_ptr->add_new_instance("simple_sum", "/home/vadim/v8-with-seastar/examples/simple.js", true),
+                            storage_ptr->add_new_instance("sum_wasm", "/home/vadim/v8-with-seastar/examples/sum_wasm.js", true),
+                            storage_ptr->add_new_instance("async_sum", "/home/vadim/v8-with-seastar/examples/async_sum.js"),
+                            storage_ptr->add_new_instance("double", "/home/vadim/v8-with-seastar/examples/double.js"),
+                            storage_ptr->add_new_instance("double_in_reactor", "/home/vadim/v8-with-seastar/examples/double.js"),
+                            storage_ptr->add_new_instance("passthrough", "/home/vadim/v8-with-seastar/examples/passthrough.js"),
+                            storage_ptr->add_new_instance("json_pick", "/home/vadim/v8-with-seastar/examples/json_pick.js"),
+                            storage_ptr->add_new_instance("flood_0", "/home/vadim/v8-with-seastar/examples/sum_array.js", true),
+                            storage_ptr->add_new_instance("flood_1", "/home/vadim/v8-with-seastar/examples/sum_array.js", true),
+                            storage_ptr->add_new_instance("flood_2", "/home/vadim/v8-with-seastar/examples/sum_array.js", true),
+                            storage_ptr->add_new_instance("flood_3", "/home/vadim/v8-with-seastar/examples/sum_array.js", true)
                         ).discard_result()
+                        .then([&storage_ptr](){
+                            // one tenant flooding the shard from several scripts, see run_fairness_benchmark
+                            for (size_t i = 0; i < flood_scripts; i++) {
+                                storage_ptr->set_tenant(fmt::format("flood_{}", i), "flood");
+                            }
+                            storage_ptr->add_pipeline("sum_and_double", {"simple_sum", "double"});
+                            storage_ptr->enable_memoization("simple_sum", 1 << 20);
+                            // a copy of double, whose runs on the pool the fairness benchmark measures
+                            return storage_ptr->enable_in_reactor("double_in_reactor", "/home/vadim/v8-with-seastar/examples/double.js").discard_result();
+                        })
+                        .then([&admin_ptr, admin_port](){
+                            if (admin_port == 0) {
+                                return seastar::make_ready_future<>();
+                            }
+                            return admin_ptr->start(admin_port);
+                        })
+                        .then([&storage_ptr](){
+                            return warm_up_scripts(storage_ptr);
+                        })
                         .then([&storage_ptr](){
                             return seastar::when_all(
                                 run_simple(storage_ptr),
                                 run_wasm_simple(storage_ptr),
+                                run_async_sum(storage_ptr),
+                                run_sum_and_double(storage_ptr),
+                                run_double_in_reactor(storage_ptr),
                                 run_loop(storage_ptr)
                             ).discard_result();
                         })
@@ -104,6 +535,45 @@ int main(int argc, char** argv) {
                                 run_loop(storage_ptr),
                                 run_loop(storage_ptr)
                             ).discard_result();
+                        })
+                        .then([&storage_ptr, stream_benchmark, stream_benchmark_size_mb](){
+                            if (stream_benchmark.empty()) {
+                                return seastar::make_ready_future<>();
+                            }
+                            return run_stream_benchmark(storage_ptr, stream_benchmark, stream_benchmark_size_mb);
+                        })
+                        .then([&thread_pool_ptr, binding_benchmark](){
+                            if (binding_benchmark == 0) {
+                                return seastar::make_ready_future<>();
+                            }
+                            return thread_pool_ptr->submit([binding_benchmark](){
+                                run_binding_benchmark(binding_benchmark);
+                            });
+                        })
+                        .then([&storage_ptr, json_benchmark](){
+                            if (json_benchmark == 0) {
+                                return seastar::make_ready_future<>();
+                            }
+                            return run_json_benchmark(storage_ptr, json_benchmark);
+                        })
+                        .then([&storage_ptr, &exit_code, fairness_benchmark](){
+                            if (fairness_benchmark == 0) {
+                                return seastar::make_ready_future<>();
+                            }
+                            return run_fairness_benchmark(storage_ptr, fairness_benchmark).then([&exit_code](bool fair){
+                                if (!fair) {
+                                    exit_code = 1;
+                                }
+                            });
+                        })
+                        .then([&admin_ptr, admin_port](){
+                            if (admin_port == 0) {
+                                return seastar::make_ready_future<>();
+                            }
+                            return admin_ptr->stop();
+                        })
+                        .then([&storage_ptr](){
+                            return storage_ptr->stop();
                         });
                     })
 
@@ -116,8 +586,8 @@ int main(int argc, char** argv) {
             .then([&thread_pool_ptr]() mutable {
                 return thread_pool_ptr->stop();
             })
-            .then([](){
-                return seastar::make_ready_future<int>(0);
+            .then([&exit_code](){
+                return seastar::make_ready_future<int>(exit_code);
             });
         });
     });
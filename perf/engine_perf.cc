@@ -0,0 +1,212 @@
+#include "seastar/core/future.hh"
+#include "example-prelude.h"
+#include "storage.h"
+#include "struct-binding.h"
+
+#include "native_thread_pool.h"
+#include "v8.h"
+
+// after the headers of the project, it pulls in namespace seastar
+#include "seastar/testing/perf_tests.hh"
+
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * benchmarks of the embedding layer, run with seastar's perf_tests runner:
+ *
+ *     v8-with-seastar-perf --json-output results.json
+ *
+ * every test measures one call from the reactor, including the dispatch to
+ * the worker and the wake up of the reactor, unless its name says otherwise.
+ */
+
+namespace {
+
+std::string example_path(const char* name) {
+    return std::string(EXAMPLES_DIR) + "/" + name;
+}
+
+/// V8 can be initialized once per process, so every test shares the engine.
+/// it is never torn down, the runner exits the process after the last test.
+struct perf_engine {
+    static perf_engine& get() {
+        static perf_engine* engine = new perf_engine();
+        return *engine;
+    }
+
+    std::unique_ptr<v::ThreadPool> thread_pool;
+    std::unique_ptr<v8::Platform> platform;
+    std::unique_ptr<storage_t> storage;
+
+private:
+    // runs in the seastar thread of the runner
+    perf_engine() {
+        constexpr unsigned native_cpu_id = 1;
+        thread_pool = std::make_unique<v::ThreadPool>(1, seastar::smp::count, native_cpu_id);
+        thread_pool->start().get();
+        platform = storage_t::init_v8(1, native_cpu_id);
+        storage = std::make_unique<storage_t>(*thread_pool);
+        register_example_prelude(*storage);
+        seastar::when_all_succeed(
+            storage->add_new_instance("simple_sum", example_path("simple.js")),
+            storage->add_new_instance("sum_array", example_path("sum_array.js")),
+            storage->add_new_instance("sum_wasm", example_path("sum_wasm.js")),
+            storage->add_new_instance("empty", example_path("empty.js"))
+        ).discard_result().get();
+    }
+};
+
+class instance {
+public:
+    instance()
+    : engine(perf_engine::get()) {
+        sum.a = 1;
+        sum.b = 3;
+    }
+
+protected:
+    seastar::future<> run_script(const char* name, std::span<char> data) {
+        return engine.storage->run_instance(name, data).discard_result();
+    }
+
+    std::span<char> sum_data() {
+        return std::span<char>(reinterpret_cast<char*>(&sum), sizeof(sum));
+    }
+
+    perf_engine& engine;
+    test_sum_t sum{};
+};
+
+/// layout of examples/sum_array.js: the number of values, the sum, the values
+class sum_array : public instance {
+protected:
+    seastar::future<> run_sum(size_t size) {
+        auto& values = arrays[size];
+        if (values.empty()) {
+            values.resize(size + 2, 1);
+            values[0] = size;
+        }
+        values[1] = 0;
+        return run_script("sum_array", std::span<char>(reinterpret_cast<char*>(values.data()), values.size() * sizeof(int32_t)));
+    }
+
+    std::unordered_map<size_t, std::vector<int32_t>> arrays;
+};
+
+class native_pool {
+public:
+    native_pool()
+    : engine(perf_engine::get()) {}
+
+protected:
+    perf_engine& engine;
+};
+
+/// an isolate of its own on the worker, for measuring V8 itself
+class v8_engine {
+public:
+    v8_engine()
+    : engine(perf_engine::get()) {
+        std::ifstream file(example_path("sum_array.js"));
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        source = buffer.str();
+
+        engine.thread_pool->submit([this]{
+            isolate = v8::Isolate::New(create_params());
+            v8::Locker locker(isolate);
+            v8::Isolate::Scope isolate_scope(isolate);
+            v8::HandleScope handle_scope(isolate);
+            context.Reset(isolate, v8::Context::New(isolate));
+        }).get();
+    }
+
+    ~v8_engine() {
+        engine.thread_pool->submit([this]{
+            {
+                v8::Locker locker(isolate);
+                context.Reset();
+            }
+            isolate->Dispose();
+        }).get();
+    }
+
+protected:
+    static v8::Isolate::CreateParams create_params() {
+        v8::Isolate::CreateParams params;
+        params.array_buffer_allocator_shared = std::shared_ptr<v8::ArrayBuffer::Allocator>(v8::ArrayBuffer::Allocator::NewDefaultAllocator());
+        return params;
+    }
+
+    // compiles the source without the code cache, every run compiles it anew
+    void compile() {
+        v8::Locker locker(isolate);
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        auto local_ctx = context.Get(isolate);
+        v8::Context::Scope context_scope(local_ctx);
+        v8::ScriptCompiler::Source script_source(v8::String::NewFromUtf8(isolate, source.data(), v8::NewStringType::kNormal, source.size()).ToLocalChecked());
+        auto script = v8::ScriptCompiler::Compile(local_ctx, &script_source, v8::ScriptCompiler::kNoCompileOptions).ToLocalChecked();
+        perf_tests::do_not_optimize(script);
+    }
+
+    perf_engine& engine;
+    std::string source;
+    v8::Isolate* isolate = nullptr;
+    v8::Global<v8::Context> context;
+};
+
+} // namespace
+
+PERF_TEST_F(instance, simple_sum) {
+    return run_script("simple_sum", sum_data());
+}
+
+PERF_TEST_F(instance, sum_wasm) {
+    return run_script("sum_wasm", sum_data());
+}
+
+PERF_TEST_F(instance, empty_function) {
+    return run_script("empty", sum_data());
+}
+
+PERF_TEST_F(sum_array, size_16) {
+    return run_sum(16);
+}
+
+PERF_TEST_F(sum_array, size_1k) {
+    return run_sum(1 << 10);
+}
+
+PERF_TEST_F(sum_array, size_64k) {
+    return run_sum(64 << 10);
+}
+
+PERF_TEST_F(sum_array, size_1m) {
+    return run_sum(1 << 20);
+}
+
+// an empty task, the cost every other test pays for leaving the reactor
+PERF_TEST_F(native_pool, round_trip) {
+    return engine.thread_pool->submit([]{});
+}
+
+// creates and disposes an isolate on the worker
+PERF_TEST_F(v8_engine, isolate_creation) {
+    return engine.thread_pool->submit([]{
+        auto* isolate = v8::Isolate::New(create_params());
+        isolate->Dispose();
+    });
+}
+
+// compiles examples/sum_array.js on the worker
+PERF_TEST_F(v8_engine, compile) {
+    return engine.thread_pool->submit([this]{
+        compile();
+    });
+}
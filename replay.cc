@@ -0,0 +1,220 @@
+#include "seastar/core/app-template.hh"
+#include "seastar/core/do_with.hh"
+#include "seastar/core/future.hh"
+#include "seastar/core/gate.hh"
+#include "seastar/core/loop.hh"
+#include "seastar/core/map_reduce.hh"
+#include "seastar/core/sleep.hh"
+#include "seastar/core/smp.hh"
+#include "example-prelude.h"
+#include "invocation-capture.h"
+#include "latency-histogram.h"
+#include "storage.h"
+
+#include "native_thread_pool.h"
+
+#include <boost/program_options.hpp>
+#include <boost/range/irange.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace bpo = boost::program_options;
+
+/**
+ * replays a capture recorded by storage_t::start_capture against a storage_t
+ * and reports its latencies. invocations are issued open-loop at their
+ * recorded arrival times, scaled by --speed, from every shard, so a slow
+ * invocation does not delay the following ones.
+ *
+ * latency is measured from the time an invocation was scheduled to start,
+ * not from the time it was issued, so the queueing a stalled replay would
+ * hide is counted (coordinated omission correction).
+ */
+
+struct replay_result {
+    // from the scheduled start
+    latency_histogram latency;
+    // from the actual start
+    latency_histogram service_time;
+    uint64_t failed = 0;
+    // turned away by admission control, not counted in the latencies
+    uint64_t rejected = 0;
+
+    void merge(const replay_result& other) {
+        latency.merge(other.latency);
+        service_time.merge(other.service_time);
+        failed += other.failed;
+        rejected += other.rejected;
+    }
+};
+
+seastar::future<std::vector<captured_invocation>> load_capture(const std::string& path) {
+    return seastar::open_file_dma(path, seastar::open_flags::ro)
+    .then([](seastar::file f){
+        auto in = seastar::make_file_input_stream(std::move(f));
+        return seastar::do_with(std::move(in), std::vector<captured_invocation>(), [](auto& in, auto& invocations){
+            return seastar::do_with(capture_reader(in), [&invocations](auto& reader){
+                return seastar::repeat([&reader, &invocations]{
+                    return reader.next().then([&invocations](std::optional<captured_invocation> invocation){
+                        if (!invocation) {
+                            return seastar::stop_iteration::yes;
+                        }
+                        invocations.push_back(std::move(*invocation));
+                        return seastar::stop_iteration::no;
+                    });
+                });
+            })
+            .finally([&in]{
+                return in.close();
+            })
+            .then([&invocations]{
+                return std::move(invocations);
+            });
+        });
+    });
+}
+
+/// issues every smp::count-th invocation of @c capture, starting with the
+/// shard's id, to the storage on @c storage_shard
+seastar::future<replay_result> replay_shard(storage_t& storage, seastar::shard_id storage_shard, const std::vector<captured_invocation>& capture, double speed, std::chrono::steady_clock::time_point start) {
+    return seastar::do_with(replay_result{}, seastar::gate{}, size_t(seastar::this_shard_id()),
+        [&storage, storage_shard, &capture, speed, start](auto& result, auto& gate, size_t& next){
+        return seastar::do_until([&next, &capture]{ return next >= capture.size(); }, [&storage, storage_shard, &capture, speed, start, &result, &gate, &next]{
+            const auto& invocation = capture[next];
+            next += seastar::smp::count;
+
+            auto scheduled = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(invocation.arrival / speed);
+            auto now = std::chrono::steady_clock::now();
+            auto wait = now < scheduled ? seastar::sleep(scheduled - now) : seastar::make_ready_future<>();
+            return wait.then([&storage, storage_shard, &invocation, scheduled, &result, &gate]{
+                auto issued = std::chrono::steady_clock::now();
+                // not awaited, the next invocation starts on schedule however long this one takes
+                (void)seastar::with_gate(gate, [&storage, storage_shard, &invocation, scheduled, issued, &result]{
+                    return seastar::smp::submit_to(storage_shard, [&storage, &invocation]{
+                        return seastar::do_with(seastar::temporary_buffer<char>(invocation.input.get(), invocation.input.size()), [&storage, &invocation](auto& input){
+                            return storage.run_instance(invocation.script, std::span<char>(input.get_write(), input.size()));
+                        });
+                    })
+                    .then([scheduled, issued, &result](bool is_canceled){
+                        auto finished = std::chrono::steady_clock::now();
+                        result.latency.record(finished - scheduled);
+                        result.service_time.record(finished - issued);
+                        if (is_canceled) {
+                            result.failed++;
+                        }
+                    })
+                    .handle_exception_type([&result](const overloaded_error&){
+                        result.rejected++;
+                    });
+                });
+            });
+        })
+        .then([&gate]{
+            return gate.close();
+        })
+        .then([&result]{
+            return std::move(result);
+        });
+    });
+}
+
+void print_histogram(const char* name, const latency_histogram& histogram) {
+    auto us = [](std::chrono::nanoseconds value){
+        return std::chrono::duration<double, std::micro>(value).count();
+    };
+    std::cout << fmt::format("{}, us: mean {:.1f}, p50 {:.1f}, p90 {:.1f}, p99 {:.1f}, p99.9 {:.1f}, max {:.1f}",
+        name, us(histogram.mean()), us(histogram.percentile(0.5)), us(histogram.percentile(0.9)),
+        us(histogram.percentile(0.99)), us(histogram.percentile(0.999)), us(histogram.max())) << std::endl;
+}
+
+seastar::future<> run_replay(storage_t& storage, std::string capture_path, double speed) {
+    return load_capture(capture_path)
+    .then([&storage, speed](std::vector<captured_invocation> capture){
+        return seastar::do_with(std::move(capture), boost::irange(0u, seastar::smp::count), [&storage, speed](auto& capture, auto& shards){
+            // every shard starts from the same point
+            auto start = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+            auto storage_shard = seastar::this_shard_id();
+            return seastar::map_reduce(shards.begin(), shards.end(), [&storage, storage_shard, &capture, speed, start](unsigned shard){
+                return seastar::smp::submit_to(shard, [&storage, storage_shard, &capture, speed, start]{
+                    return replay_shard(storage, storage_shard, capture, speed, start);
+                });
+            }, replay_result{}, [](replay_result total, replay_result shard_result){
+                total.merge(shard_result);
+                return total;
+            })
+            .then([&capture, speed, start](replay_result result){
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                std::cout << fmt::format("Replayed {} invocations at {}x in {:.2f} s: {:.0f} invocations/s, {} failed, {} rejected",
+                    capture.size(), speed, elapsed.count(), capture.size() / elapsed.count(), result.failed, result.rejected) << std::endl;
+                print_histogram("Latency", result.latency);
+                print_histogram("Service time", result.service_time);
+            });
+        });
+    });
+}
+
+int main(int argc, char** argv) {
+    seastar::app_template app;
+    app.add_options()
+        ("capture", bpo::value<std::string>()->required(), "capture file recorded by storage_t::start_capture")
+        ("speed", bpo::value<double>()->default_value(1.0), "replay speed, 2 replays the capture twice as fast")
+        ("script", bpo::value<std::vector<std::string>>()->composing(), "name=path of a script the capture calls, repeated for every script");
+
+    return app.run(argc, argv, [&app] {
+        constexpr unsigned native_cpu_id = 1;
+        auto& config = app.configuration();
+        std::string capture_path = config["capture"].as<std::string>();
+        double speed = config["speed"].as<double>();
+        std::vector<std::string> scripts;
+        if (config.count("script")) {
+            scripts = config["script"].as<std::vector<std::string>>();
+        }
+        if (speed <= 0) {
+            std::cout << "--speed must be positive" << std::endl;
+            return seastar::make_ready_future<int>(1);
+        }
+
+        std::unique_ptr<v::ThreadPool> thread_pool_ptr = std::make_unique<v::ThreadPool>(1, seastar::smp::count, native_cpu_id);
+        return seastar::do_with(std::move(thread_pool_ptr), [capture_path, speed, scripts](auto& thread_pool_ptr){
+            return thread_pool_ptr->start()
+            .then([&thread_pool_ptr, capture_path, speed, scripts](){
+                std::unique_ptr<v8::Platform> platfrom_ptr = storage_t::init_v8(1, native_cpu_id);
+                std::unique_ptr<storage_t> storage_ptr = std::make_unique<storage_t>(*thread_pool_ptr);
+                // the scripts see what they saw in the server
+                register_example_prelude(*storage_ptr);
+                return seastar::do_with(std::move(platfrom_ptr), std::move(storage_ptr), [capture_path, speed, scripts](auto& platform_ptr, auto& storage_ptr){
+                    return seastar::parallel_for_each(scripts, [&storage_ptr](const std::string& script){
+                        auto separator = script.find('=');
+                        if (separator == std::string::npos) {
+                            std::cout << "--script " << script << " is not name=path" << std::endl;
+                            return seastar::make_ready_future<>();
+                        }
+                        return storage_ptr->add_new_instance(script.substr(0, separator), script.substr(separator + 1)).discard_result();
+                    })
+                    .then([&storage_ptr, capture_path, speed](){
+                        return run_replay(*storage_ptr, capture_path, speed);
+                    })
+                    .handle_exception([capture_path](std::exception_ptr ex){
+                        std::cout << "Can not replay " << capture_path << ": " << ex << std::endl;
+                    })
+                    .finally([&storage_ptr](){
+                        return storage_ptr->stop().finally([&storage_ptr]{
+                            storage_ptr.reset();
+                            storage_t::shutdown_v8();
+                        });
+                    });
+                });
+            })
+            .then([&thread_pool_ptr]() mutable {
+                return thread_pool_ptr->stop();
+            })
+            .then([](){
+                return seastar::make_ready_future<int>(0);
+            });
+        });
+    });
+}